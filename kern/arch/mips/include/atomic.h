@@ -0,0 +1,53 @@
+#ifndef _MIPS_ATOMIC_H_
+#define _MIPS_ATOMIC_H_
+
+#include <membar.h>
+
+/*
+ * Compare-and-swap using LL/SC. See the notes on LL/SC in
+ * <machine/spinlock.h>; in particular there may be no other memory
+ * accesses between the LL and the SC, which is why the comparison
+ * has to be done in the same asm block.
+ *
+ * Y is left at 0 if the comparison fails; otherwise the SC sets it
+ * to 1 on success and 0 on failure.
+ *
+ * See include/atomic.h for further information.
+ */
+ATOMIC_INLINE
+bool
+atomic_cas32(volatile uint32_t *p, uint32_t oldval, uint32_t newval)
+{
+	uint32_t x;
+	uint32_t y;
+
+	membar_any_any();
+	y = 0;
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		"ll %0, 0(%2);"		/*   x = *p */
+		"bne %0, %3, 1f;"	/*   if (x != oldval) give up */
+		"move %1, %4;"		/*   y = newval */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"1:"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "+r" (y)
+		: "r" (p), "r" (oldval), "r" (newval)
+		: "memory");
+	membar_any_any();
+	return y != 0;
+}
+
+/* Pointers are 32 bits, so just use atomic_cas32. */
+ATOMIC_INLINE
+bool
+atomic_casptr(void *volatile *p, void *oldval, void *newval)
+{
+	return atomic_cas32((volatile uint32_t *)p,
+			    (uint32_t)oldval, (uint32_t)newval);
+}
+
+
+#endif /* _MIPS_ATOMIC_H_ */
@@ -38,6 +38,8 @@
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
+#include <cpustats.h>
+#include <ktrace.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
@@ -125,6 +127,21 @@ kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr)
 	thread_exit();
 }
 
+/*
+ * Call vm_fault, with tracepoints around it.
+ */
+static
+int
+trap_vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	int result;
+
+	KTRACE(KTRACE_FAULT, faultaddress);
+	result = vm_fault(faulttype, faultaddress);
+	KTRACE(KTRACE_FAULTDONE, result);
+	return result;
+}
+
 /*
  * General trap (exception) handling function for mips.
  * This is called by the assembly-language exception handler once
@@ -193,6 +210,10 @@ mips_trap(struct trapframe *tf)
 			doadjust = false;
 		}
 
+		/* Tell the profiler (via hardclock) where we were. */
+		curcpu->c_intrpc = tf->tf_epc;
+
+		CPUSTAT_INC(CPUSTAT_INTERRUPTS);
 		mainbus_interrupt(tf);
 
 		if (doadjust) {
@@ -238,19 +259,22 @@ mips_trap(struct trapframe *tf)
 	 * Call vm_fault on the TLB exceptions.
 	 * Panic on the bus error exceptions.
 	 */
+	if (code == EX_MOD || code == EX_TLBL || code == EX_TLBS) {
+		CPUSTAT_INC(CPUSTAT_TLBFAULTS);
+	}
 	switch (code) {
 	case EX_MOD:
-		if (vm_fault(VM_FAULT_READONLY, tf->tf_vaddr)==0) {
+		if (trap_vm_fault(VM_FAULT_READONLY, tf->tf_vaddr)==0) {
 			goto done;
 		}
 		break;
 	case EX_TLBL:
-		if (vm_fault(VM_FAULT_READ, tf->tf_vaddr)==0) {
+		if (trap_vm_fault(VM_FAULT_READ, tf->tf_vaddr)==0) {
 			goto done;
 		}
 		break;
 	case EX_TLBS:
-		if (vm_fault(VM_FAULT_WRITE, tf->tf_vaddr)==0) {
+		if (trap_vm_fault(VM_FAULT_WRITE, tf->tf_vaddr)==0) {
 			goto done;
 		}
 		break;
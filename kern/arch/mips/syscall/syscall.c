@@ -35,6 +35,8 @@
 #include <mips/trapframe.h>
 #include <thread.h>
 #include <current.h>
+#include <cpustats.h>
+#include <ktrace.h>
 #include <copyinout.h>
 #include <syscall.h>
 
@@ -89,6 +91,8 @@ syscall(struct trapframe *tf)
 	KASSERT(curthread->t_iplhigh_count == 0);
 
 	callno = tf->tf_v0;
+	CPUSTAT_INC(CPUSTAT_SYSCALLS);
+	KTRACE(KTRACE_SYSCALL, callno);
 
 	/*
 	 * Initialize retval to 0. Many of the system calls don't
@@ -113,6 +117,10 @@ syscall(struct trapframe *tf)
 				 (userptr_t)tf->tf_a1);
 		break;
 
+	    case SYS_cpustats:
+		err = sys_cpustats(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
 
 	    /* process calls */
 
@@ -142,6 +150,10 @@ syscall(struct trapframe *tf)
 		err = sys_getpid(&retval);
 		break;
 
+	    case SYS_setaffinity:
+		err = sys_setaffinity(tf->tf_a0);
+		break;
+
 
 	    /* file calls */
 
@@ -284,6 +296,7 @@ syscall(struct trapframe *tf)
 		tf->tf_v0 = retval;
 		tf->tf_a3 = 0;      /* signal no error */
 	}
+	KTRACE(KTRACE_SYSCALLDONE, err);
 
 	/*
 	 * Now, advance the program counter, to avoid restarting
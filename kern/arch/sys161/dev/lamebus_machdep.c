@@ -76,6 +76,22 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+static
+uint32_t
+mips_timer_get(void)
+{
+	uint32_t count;
+
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -267,6 +283,33 @@ mainbus_ramsize(void)
 	return ramsize;
 }
 
+/*
+ * Read the cycle counter.
+ *
+ * c0_count goes back to zero each time the on-chip timer fires, so
+ * add in a timer period for each hardclock this cpu has taken. (If
+ * the timer has fired but hardclock hasn't run yet we come up one
+ * period short; that is rare enough not to matter for tracing.)
+ */
+uint64_t
+mainbus_cycles(void)
+{
+	uint64_t cycles;
+	int s;
+
+	s = splhigh();
+	cycles = (uint64_t)curcpu->c_hardclocks * (CPU_FREQUENCY / HZ)
+		+ mips_timer_get();
+	splx(s);
+	return cycles;
+}
+
+uint32_t
+mainbus_cyclerate(void)
+{
+	return CPU_FREQUENCY;
+}
+
 /*
  * Send IPI.
  */
@@ -37,6 +37,8 @@
 #include <uio.h>
 #include <membar.h>
 #include <synch.h>
+#include <cpustats.h>
+#include <ktrace.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -103,6 +105,7 @@ static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
+	KTRACE(KTRACE_DISKDONE, err);
 	lh->lh_result = err;
 	V(lh->lh_done);
 }
@@ -194,7 +197,7 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
 	uint32_t i;
 	uint32_t statval = LHD_WORKING;
-	int result;
+	int result = 0;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -212,12 +215,16 @@ lhd_io(struct device *d, struct uio *uio)
 		statval |= LHD_ISWRITE;
 	}
 
+	/*
+	 * Wait until nobody else is using the device. Keep it for the
+	 * whole request, so a multi-sector transfer goes to the disk
+	 * back to back without other requests seeking in between.
+	 */
+	P(lh->lh_clear);
+
 	/* Loop over all the sectors we were asked to do. */
 	for (i=0; i<len; i++) {
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
 		/*
 		 * Are we writing? If so, transfer the data to the
 		 * on-card buffer.
@@ -226,8 +233,7 @@ lhd_io(struct device *d, struct uio *uio)
 			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
 			membar_store_store();
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
@@ -236,6 +242,9 @@ lhd_io(struct device *d, struct uio *uio)
 
 		/* and start the operation. */
 		lhd_wreg(lh, LHD_REG_STAT, statval);
+		CPUSTAT_INC(uio->uio_rw == UIO_WRITE ?
+			    CPUSTAT_DISKWRITES : CPUSTAT_DISKREADS);
+		KTRACE(KTRACE_DISKSTART, sector+i);
 
 		/* Now wait until the interrupt handler tells us we're done. */
 		P(lh->lh_done);
@@ -252,16 +261,16 @@ lhd_io(struct device *d, struct uio *uio)
 			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		/* If we failed, stop. */
 		if (result) {
-			return result;
+			break;
 		}
 	}
 
-	return 0;
+	/* Tell another thread it's cleared to go ahead. */
+	V(lh->lh_clear);
+
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
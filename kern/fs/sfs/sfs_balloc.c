@@ -33,22 +33,61 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Zero out a disk block. This only zeros the buffer; the zeros reach
+ * the disk when the buffer is written back, if they haven't been
+ * overwritten by then.
  */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct buf *buf;
+	int result;
+
+	result = buffer_get(&sfs->sfs_absfs, block, SFS_BLOCKSIZE, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(buf), SFS_BLOCKSIZE);
+	buffer_mark_valid(buf);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Finish allocating BLOCK, which the caller has just marked in use
+ * in the freemap (and released the freemap lock): check it and clear
+ * it. (Nobody else can see the block yet, so this needn't hold the
+ * freemap lock.)
+ */
+static
+int
+sfs_balloc_finish(struct sfs_fs *sfs, daddr_t block)
+{
+	int result;
+
+	if (block >= sfs->sfs_sb.sb_nblocks) {
+		panic("sfs: %s: balloc: invalid block %u\n",
+		      sfs->sfs_sb.sb_volname, block);
+	}
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	result = sfs_clearblock(sfs, block);
+	if (result) {
+		lock_acquire(sfs->sfs_freemaplock);
+		bitmap_unmark(sfs->sfs_freemap, block);
+		lock_release(sfs->sfs_freemaplock);
+	}
+	return result;
 }
 
 /*
@@ -59,33 +98,116 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 
-	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
-		panic("sfs: %s: balloc: invalid block %u\n",
-		      sfs->sfs_sb.sb_volname, *diskblock);
+	return sfs_balloc_finish(sfs, *diskblock);
+}
+
+/*
+ * Allocate BLOCK in particular, for growing an extent in place.
+ * Fails with EBUSY if it's already in use or off the end of the
+ * volume.
+ */
+int
+sfs_balloc_at(struct sfs_fs *sfs, daddr_t block)
+{
+	if (block >= sfs->sfs_sb.sb_nblocks) {
+		return EBUSY;
 	}
 
-	/* Clear block before returning it */
-	result = sfs_clearblock(sfs, *diskblock);
-	if (result) {
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	if (bitmap_isset(sfs->sfs_freemap, block)) {
+		lock_release(sfs->sfs_freemaplock);
+		return EBUSY;
 	}
-	return result;
+	bitmap_mark(sfs->sfs_freemap, block);
+	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
+
+	return sfs_balloc_finish(sfs, block);
+}
+
+/*
+ * Allocate a block for starting a new extent: the first free block
+ * at or after GOAL (wrapping around at the end of the volume) that
+ * begins a run of at least RUN free blocks, so the extent has room to
+ * grow, or failing that the first free block at or after GOAL.
+ */
+int
+sfs_balloc_near(struct sfs_fs *sfs, daddr_t goal, unsigned run,
+		daddr_t *diskblock)
+{
+	uint32_t nblocks, i, block, start, len, firstfree;
+	bool havefree, found;
+
+	nblocks = sfs->sfs_sb.sb_nblocks;
+	if (goal >= nblocks) {
+		goal = 0;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+
+	havefree = found = false;
+	firstfree = start = len = 0;
+	for (i=0; i<nblocks; i++) {
+		block = (goal + i) % nblocks;
+		if (block == 0) {
+			/* runs don't wrap around */
+			len = 0;
+		}
+		if (bitmap_isset(sfs->sfs_freemap, block)) {
+			len = 0;
+			continue;
+		}
+		if (!havefree) {
+			firstfree = block;
+			havefree = true;
+		}
+		if (len == 0) {
+			start = block;
+		}
+		len++;
+		if (len >= run) {
+			found = true;
+			break;
+		}
+	}
+
+	if (found) {
+		*diskblock = start;
+	}
+	else if (havefree) {
+		*diskblock = firstfree;
+	}
+	else {
+		lock_release(sfs->sfs_freemaplock);
+		return ENOSPC;
+	}
+	bitmap_mark(sfs->sfs_freemap, *diskblock);
+	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
+
+	return sfs_balloc_finish(sfs, *diskblock);
 }
 
 /*
- * Free a block.
+ * Free a block. Any cached copy of it is now garbage.
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	buffer_drop(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE);
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +216,15 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
@@ -35,39 +35,167 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Look up the disk block number (from 0 up to the number of blocks on
- * the disk) given a file and the logical block number within that
- * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * Block mapping layout.
+ *
+ * The first SFS_NDIRECT blocks of a file are mapped by the direct
+ * block pointers in the inode. After that come the blocks mapped by
+ * the indirect block, then the double indirect block (whose entries
+ * each point to an indirect block), then the triple indirect block.
+ * SFS_DBPERIDB is 128, so that's 15 + 128 + 16384 + 2097152 blocks,
+ * which is more than a 32-bit file size can reach anyway.
+ *
+ * Walking down from a double or triple indirect block reads two or
+ * three blocks for every block mapped. The blocks are normally in the
+ * buffer cache, but to save looking them up again and again, each
+ * vnode remembers the last single indirect block it went through
+ * (sv_ibhint) and the first file block that block maps
+ * (sv_ibhintbase). A lookup that lands in the same indirect block,
+ * which is what sequential I/O and nearby seeks do, goes straight to
+ * it. sfs_itrunc clears the hint before freeing anything.
+ *
+ * Inodes with SFS_IF_EXTENTS set map their blocks with a sorted table
+ * of extents in the inode instead, so a lookup is a binary search
+ * and sfs_bmaprun can hand back a whole run at once. New blocks are
+ * put right after (or before) the neighboring extent on disk when
+ * that's free, so files written in order stay in a few long extents;
+ * when a block has to start a new extent, sfs_balloc_near looks for
+ * room to grow (SFS_EXTRUN blocks) near where it ought to be. If the
+ * table fills up, the inode is converted to the block pointer format
+ * so the file can keep growing.
+ */
+
+/*
+ * Number of file blocks mapped by one entry of an indirect block at
+ * indirection level LEVEL (1 for a single indirect block).
  */
+static
+uint32_t
+sfs_ibspan(unsigned level)
+{
+	uint32_t span = 1;
+
+	while (level > 1) {
+		span *= SFS_DBPERIDB;
+		level--;
+	}
+	return span;
+}
+
+/*
+ * Find the indirect block tree FILEBLOCK (counted from the start of
+ * the file) is in: return a pointer to the inode's entry for the top
+ * of the tree, its indirection level, and the offset of FILEBLOCK
+ * from the first block the tree maps.
+ */
+static
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-	 daddr_t *diskblock)
+sfs_bmap_findtree(struct sfs_vnode *sv, uint32_t fileblock,
+		  uint32_t **topp, unsigned *levelp, uint32_t *offsetp)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	KASSERT(fileblock >= SFS_NDIRECT);
+	fileblock -= SFS_NDIRECT;
+
+	if (fileblock < SFS_DBPERIDB) {
+		*topp = &sv->sv_i.sfi_indirect;
+		*levelp = 1;
+	}
+	else if (fileblock - SFS_DBPERIDB < SFS_DBPERIDB * sfs_ibspan(2)) {
+		fileblock -= SFS_DBPERIDB;
+		*topp = &sv->sv_i.sfi_dindirect;
+		*levelp = 2;
+	}
+	else {
+		fileblock -= SFS_DBPERIDB + SFS_DBPERIDB * sfs_ibspan(2);
+		if (fileblock >= SFS_DBPERIDB * sfs_ibspan(3)) {
+			return EFBIG;
+		}
+		*topp = &sv->sv_i.sfi_tindirect;
+		*levelp = 3;
+	}
+	*offsetp = fileblock;
+	return 0;
+}
+
+/*
+ * Get the entry at INDEX in indirect block IDBLOCK. If there isn't
+ * one and DOALLOC is set, fill it in with NEWBLOCK, or if that's 0
+ * with a freshly allocated (zeroed) block.
+ */
+static
+int
+sfs_bmap_entry(struct sfs_fs *sfs, daddr_t idblock, uint32_t index,
+	       bool doalloc, daddr_t newblock, daddr_t *ret)
+{
+	struct buf *idbuf;
+	uint32_t *iddata;
+	daddr_t block;
+	int result;
+
+	/* Load the indirect block. */
+	result = buffer_read(&sfs->sfs_absfs, idblock, SFS_BLOCKSIZE, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+
+	/* Get the block out of the indirect block */
+	block = iddata[index];
+
+	/* If there's no block there, allocate one */
+	if (block==0 && doalloc && newblock != 0) {
+		block = newblock;
+	}
+	else if (block==0 && doalloc) {
+		result = sfs_balloc(sfs, &block);
+		if (result) {
+			buffer_release(idbuf);
+			return result;
+		}
+	}
+	if (block != iddata[index]) {
+		/* Remember the block we allocated */
+		iddata[index] = block;
 
+		/* The indirect block is now dirty */
+		buffer_mark_dirty(idbuf);
+	}
+	buffer_release(idbuf);
+
+	*ret = block;
+	return 0;
+}
+
+/*
+ * sfs_bmap for the block pointer format. If NEWBLOCK isn't 0, it's
+ * used instead of allocating a data block; sfs_ext_convert uses this
+ * to move a file's blocks out of its extents.
+ */
+static
+int
+sfs_bmap_ind(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	     daddr_t newblock, daddr_t *diskblock)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t block;
 	daddr_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t *topp;
+	uint32_t offset, span;
+	unsigned level;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+	COMPILE_ASSERT(SFS_NINDIRECT == 1);
+	COMPILE_ASSERT(SFS_NDINDIRECT == 1);
+	COMPILE_ASSERT(SFS_NTINDIRECT == 1);
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -81,7 +209,12 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		/*
 		 * Do we need to allocate?
 		 */
-		if (block==0 && doalloc) {
+		if (block==0 && doalloc && newblock != 0) {
+			sv->sv_i.sfi_direct[fileblock] = newblock;
+			sv->sv_dirty = true;
+			block = newblock;
+		}
+		else if (block==0 && doalloc) {
 			result = sfs_balloc(sfs, &block);
 			if (result) {
 				return result;
@@ -105,27 +238,23 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * If we went through the indirect block that maps this one
+	 * last time, go straight there.
 	 */
+	if (sv->sv_ibhint != 0 && fileblock >= sv->sv_ibhintbase &&
+	    fileblock - sv->sv_ibhintbase < SFS_DBPERIDB) {
+		idblock = sv->sv_ibhint;
+		offset = fileblock - sv->sv_ibhintbase;
+		goto leaf;
+	}
 
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum >= SFS_NINDIRECT) {
-		return EFBIG;
+	result = sfs_bmap_findtree(sv, fileblock, &topp, &level, &offset);
+	if (result) {
+		return result;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	/* Get the disk block number of the top of the tree. */
+	idblock = *topp;
 
 	if (idblock==0 && !doalloc) {
 		/*
@@ -149,42 +278,43 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		}
 
 		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+		*topp = idblock;
 
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		/* (sfs_balloc has zeroed it for us) */
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
-	}
-
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+	/*
+	 * Walk down the double and triple indirect blocks to the
+	 * single indirect block that maps FILEBLOCK, allocating any
+	 * that are missing if we're allowed to.
+	 */
+	for (; level > 1; level--) {
+		span = sfs_ibspan(level);
+		result = sfs_bmap_entry(sfs, idblock, offset / span, doalloc,
+					0, &idblock);
 		if (result) {
 			return result;
 		}
+		if (idblock == 0) {
+			KASSERT(!doalloc);
+			*diskblock = 0;
+			return 0;
+		}
+		offset %= span;
+	}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+	sv->sv_ibhint = idblock;
+	sv->sv_ibhintbase = fileblock - offset;
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+ leaf:
+	KASSERT(offset < SFS_DBPERIDB);
+	result = sfs_bmap_entry(sfs, idblock, offset, doalloc, newblock,
+				&block);
+	if (result) {
+		return result;
 	}
 
 	/* Hand back the result and return. */
@@ -198,34 +328,100 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Discard the blocks mapped by indirect block *IDBLOCKP, which is at
+ * indirection level LEVEL and maps the file blocks starting at
+ * BASEBLOCK, from file block BLOCKLEN on. If that leaves the indirect
+ * block empty, free it too, clear *IDBLOCKP, and set *CHANGED. The
+ * data blocks are freed only if FREEDATA is set.
  */
+static
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_itrunc_ib(struct sfs_fs *sfs, uint32_t *idblockp, unsigned level,
+	      uint32_t baseblock, uint32_t blocklen, bool freedata,
+	      bool *changed)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t span, entrybase, j;
+	bool hasnonzero, iddirty;
+	int result;
 
-	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	span = sfs_ibspan(level);
 
-	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	if (*idblockp == 0 || blocklen >= baseblock + span * SFS_DBPERIDB) {
+		/* Nothing here, or all of it is before the new EOF */
+		return 0;
+	}
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
-	int result;
-	int hasnonzero, iddirty;
+	/* Read the indirect block */
+	result = buffer_read(&sfs->sfs_absfs, *idblockp, SFS_BLOCKSIZE,
+			     &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		entrybase = baseblock + j*span;
+		if (iddata[j] == 0 || blocklen >= entrybase + span) {
+			/* nothing to discard under this entry */
+		}
+		else if (level == 1) {
+			/* Discard any blocks that are past the new EOF */
+			if (freedata) {
+				sfs_bfree(sfs, iddata[j]);
+			}
+			iddata[j] = 0;
+			iddirty = true;
+		}
+		else {
+			/* Recurse into the next level down */
+			result = sfs_itrunc_ib(sfs, &iddata[j], level - 1,
+					       entrybase, blocklen, freedata,
+					       &iddirty);
+			if (result) {
+				if (iddirty) {
+					buffer_mark_dirty(idbuf);
+				}
+				buffer_release(idbuf);
+				return result;
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j] != 0) {
+			hasnonzero = true;
+		}
+	}
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	if (iddirty) {
+		buffer_mark_dirty(idbuf);
+	}
+	buffer_release(idbuf);
 
-	vfs_biglock_acquire();
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_bfree(sfs, *idblockp);
+		*idblockp = 0;
+		*changed = true;
+	}
+	return 0;
+}
+
+/*
+ * sfs_itrunc for the block pointer format. With FREEDATA false, only
+ * the indirect blocks are freed; see sfs_ext_convert.
+ */
+static
+int
+sfs_itrunc_ind(struct sfs_vnode *sv, uint32_t blocklen, bool freedata)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t i;
+	daddr_t block;
+	uint32_t baseblock;
+	int result;
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -234,60 +430,404 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	for (i=0; i<SFS_NDIRECT; i++) {
 		block = sv->sv_i.sfi_direct[i];
 		if (i >= blocklen && block != 0) {
-			sfs_bfree(sfs, block);
+			if (freedata) {
+				sfs_bfree(sfs, block);
+			}
 			sv->sv_i.sfi_direct[i] = 0;
 			sv->sv_dirty = true;
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/* Then the indirect, double indirect, and triple indirect trees */
 	baseblock = SFS_NDIRECT;
+	result = sfs_itrunc_ib(sfs, &sv->sv_i.sfi_indirect, 1, baseblock,
+			       blocklen, freedata, &sv->sv_dirty);
+	if (result) {
+		return result;
+	}
 
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
+	baseblock += sfs_ibspan(2);
+	result = sfs_itrunc_ib(sfs, &sv->sv_i.sfi_dindirect, 2, baseblock,
+			       blocklen, freedata, &sv->sv_dirty);
+	if (result) {
+		return result;
+	}
+
+	baseblock += sfs_ibspan(3);
+	return sfs_itrunc_ib(sfs, &sv->sv_i.sfi_tindirect, 3, baseblock,
+			     blocklen, freedata, &sv->sv_dirty);
+}
 
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
+////////////////////////////////////////////////////////////
+// Extents
 
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+/*
+ * Binary search for FILEBLOCK in the extent table: returns the index
+ * of the first extent that ends after FILEBLOCK, which is the one
+ * holding it if there is one, and otherwise where an extent for it
+ * would go. (It may be sfi_nextents.)
+ */
+static
+unsigned
+sfs_ext_search(const struct sfs_dinode *sfi, uint32_t fileblock)
+{
+	const struct sfs_extent *ext;
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = sfi->sfi_nextents;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		ext = &sfi->sfi_extents[mid];
+		if (ext->sfe_fileblock + ext->sfe_len <= fileblock) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Insert a one-block extent at index I in the table, which must not
+ * be full.
+ */
+static
+void
+sfs_ext_insert(struct sfs_dinode *sfi, unsigned i, uint32_t fileblock,
+	       daddr_t block)
+{
+	KASSERT(sfi->sfi_nextents < SFS_NEXTENTS);
+	KASSERT(i <= sfi->sfi_nextents);
+
+	memmove(&sfi->sfi_extents[i+1], &sfi->sfi_extents[i],
+		(sfi->sfi_nextents - i) * sizeof(sfi->sfi_extents[0]));
+	sfi->sfi_extents[i].sfe_fileblock = fileblock;
+	sfi->sfi_extents[i].sfe_block = block;
+	sfi->sfi_extents[i].sfe_len = 1;
+	sfi->sfi_nextents++;
+}
+
+/*
+ * Remove the extent at index I from the table.
+ */
+static
+void
+sfs_ext_remove(struct sfs_dinode *sfi, unsigned i)
+{
+	KASSERT(i < sfi->sfi_nextents);
+
+	memmove(&sfi->sfi_extents[i], &sfi->sfi_extents[i+1],
+		(sfi->sfi_nextents - i - 1) * sizeof(sfi->sfi_extents[0]));
+	sfi->sfi_nextents--;
+	bzero(&sfi->sfi_extents[sfi->sfi_nextents],
+	      sizeof(sfi->sfi_extents[0]));
+}
+
+/*
+ * sfs_bmap for the extent format. Returns EFBIG if a block needs to
+ * be allocated and would need an extent of its own but the table is
+ * full.
+ */
+static
+int
+sfs_ext_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	     daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *sfi = &sv->sv_i;
+	struct sfs_extent *prev, *next;
+	daddr_t block, goal;
+	unsigned i;
+	int result;
+
+	i = sfs_ext_search(sfi, fileblock);
+	prev = i > 0 ? &sfi->sfi_extents[i-1] : NULL;
+	next = i < sfi->sfi_nextents ? &sfi->sfi_extents[i] : NULL;
+
+	if (next != NULL && next->sfe_fileblock <= fileblock) {
+		/* Found it */
+		block = next->sfe_block + (fileblock - next->sfe_fileblock);
+		goto found;
+	}
+	if (!doalloc) {
+		/* A hole */
+		*diskblock = 0;
+		return 0;
+	}
+
+	/*
+	 * If the block follows the previous extent in the file, try
+	 * to grow that extent onto the next disk block. That may close
+	 * the gap to the next extent too.
+	 */
+	if (prev != NULL &&
+	    prev->sfe_fileblock + prev->sfe_len == fileblock) {
+		block = prev->sfe_block + prev->sfe_len;
+		result = sfs_balloc_at(sfs, block);
+		if (result == 0) {
+			prev->sfe_len++;
+			if (next != NULL &&
+			    next->sfe_fileblock == fileblock + 1 &&
+			    next->sfe_block == block + 1) {
+				prev->sfe_len += next->sfe_len;
+				sfs_ext_remove(sfi, i);
+			}
+			goto allocated;
+		}
+		if (result != EBUSY) {
+			return result;
+		}
+	}
+
+	/* Likewise, try to grow the next extent backwards. */
+	if (next != NULL && next->sfe_fileblock == fileblock + 1) {
+		block = next->sfe_block - 1;
+		result = sfs_balloc_at(sfs, block);
+		if (result == 0) {
+			next->sfe_fileblock--;
+			next->sfe_block--;
+			next->sfe_len++;
+			goto allocated;
+		}
+		if (result != EBUSY) {
+			return result;
+		}
+	}
+
+	/*
+	 * It needs an extent of its own. Put it where it would be if
+	 * the previous extent ran all the way up to it, or for the
+	 * first extent near the inode.
+	 */
+	if (sfi->sfi_nextents == SFS_NEXTENTS) {
+		return EFBIG;
+	}
+	if (prev != NULL) {
+		goal = prev->sfe_block + (fileblock - prev->sfe_fileblock);
+	}
+	else {
+		goal = sv->sv_ino + 1;
+	}
+	result = sfs_balloc_near(sfs, goal, SFS_EXTRUN, &block);
+	if (result) {
+		return result;
+	}
+	sfs_ext_insert(sfi, i, fileblock, block);
+
+ allocated:
+	sv->sv_dirty = true;
+
+ found:
+	if (!sfs_bused(sfs, block)) {
+		panic("sfs: %s: Data block %u (block %u of file %u) "
+		      "marked free\n", sfs->sfs_sb.sb_volname,
+		      block, fileblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Switch an extent inode whose table is full over to the block
+ * pointer format. The data blocks stay where they are; only the
+ * indirect blocks needed to map them are allocated. If that fails,
+ * the inode is put back the way it was.
+ */
+static
+int
+sfs_ext_convert(struct sfs_vnode *sv)
+{
+	struct sfs_dinode *saved;
+	struct sfs_extent *ext;
+	daddr_t block;
+	uint32_t i, j;
+	int result;
+
+	saved = kmalloc(sizeof(*saved));
+	if (saved == NULL) {
+		return ENOMEM;
+	}
+	memcpy(saved, &sv->sv_i, sizeof(*saved));
+
+	sv->sv_i.sfi_flags &= ~SFS_IF_EXTENTS;
+	sv->sv_i.sfi_nextents = 0;
+	bzero(sv->sv_i.sfi_extents, sizeof(sv->sv_i.sfi_extents));
+	sv->sv_ibhint = 0;
+
+	result = 0;
+	for (i=0; i<saved->sfi_nextents && result == 0; i++) {
+		ext = &saved->sfi_extents[i];
+		for (j=0; j<ext->sfe_len && result == 0; j++) {
+			result = sfs_bmap_ind(sv, ext->sfe_fileblock + j, true,
+					      ext->sfe_block + j, &block);
+		}
+	}
+
+	if (result) {
+		/*
+		 * Give back the indirect blocks; the data blocks still
+		 * belong to the extents. (If this fails too, the
+		 * indirect blocks it didn't get to are lost until
+		 * sfsck finds them.)
+		 */
+		sv->sv_ibhint = 0;
+		(void)sfs_itrunc_ind(sv, 0, false);
+		memcpy(&sv->sv_i, saved, sizeof(*saved));
+	}
+	sv->sv_dirty = true;
+	kfree(saved);
+	return result;
+}
+
+/*
+ * Discard the blocks of an extent inode from file block BLOCKLEN on.
+ */
+static
+void
+sfs_ext_trunc(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *sfi = &sv->sv_i;
+	struct sfs_extent *ext;
+	uint32_t keep, j;
+
+	while (sfi->sfi_nextents > 0) {
+		ext = &sfi->sfi_extents[sfi->sfi_nextents - 1];
+		if (ext->sfe_fileblock + ext->sfe_len <= blocklen) {
+			break;
+		}
+		keep = ext->sfe_fileblock < blocklen ?
+			blocklen - ext->sfe_fileblock : 0;
+		for (j=keep; j<ext->sfe_len; j++) {
+			sfs_bfree(sfs, ext->sfe_block + j);
+		}
+		sv->sv_dirty = true;
+		if (keep > 0) {
+			ext->sfe_len = keep;
+			break;
+		}
+		sfs_ext_remove(sfi, sfi->sfi_nextents - 1);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Look up the disk block number (from 0 up to the number of blocks on
+ * the disk) given a file and the logical block number within that
+ * file. If DOALLOC is set, and no such block exists, one will be
+ * allocated.
+ */
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	 daddr_t *diskblock)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+		result = sfs_ext_bmap(sv, fileblock, doalloc, diskblock);
+		if (result != EFBIG) {
+			return result;
+		}
+		/* The extent table is full. */
+		result = sfs_ext_convert(sv);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
+	}
+	return sfs_bmap_ind(sv, fileblock, doalloc, 0, diskblock);
+}
 
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
+/*
+ * Look up file block FILEBLOCK like sfs_bmap (without allocating),
+ * and also find out how many blocks starting there, up to MAX, are
+ * consecutive on disk; hand that back in *NBLOCKS. For a hole,
+ * *DISKBLOCK is 0 and *NBLOCKS is 1.
+ */
+int
+sfs_bmaprun(struct sfs_vnode *sv, uint32_t fileblock, uint32_t max,
+	    daddr_t *diskblock, uint32_t *nblocks)
+{
+	struct sfs_extent *ext;
+	daddr_t next;
+	unsigned i;
+	uint32_t n;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(max > 0);
+
+	if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+		i = sfs_ext_search(&sv->sv_i, fileblock);
+		ext = &sv->sv_i.sfi_extents[i];
+		if (i == sv->sv_i.sfi_nextents ||
+		    ext->sfe_fileblock > fileblock) {
+			*diskblock = 0;
+			*nblocks = 1;
+			return 0;
+		}
+		n = ext->sfe_fileblock + ext->sfe_len - fileblock;
+		*diskblock = ext->sfe_block + (fileblock - ext->sfe_fileblock);
+		*nblocks = n < max ? n : max;
+		return 0;
+	}
+
+	result = sfs_bmap_ind(sv, fileblock, false, 0, diskblock);
+	if (result) {
+		return result;
+	}
+	n = 1;
+	if (*diskblock != 0) {
+		for (; n < max; n++) {
+			result = sfs_bmap_ind(sv, fileblock + n, false, 0,
+					      &next);
+			if (result || next != *diskblock + n) {
+				break;
 			}
 		}
+	}
+	*nblocks = n;
+	return 0;
+}
 
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
+/*
+ * Called for ftruncate() and from sfs_reclaim, with the vnode locked.
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	/* Length in blocks (divide rounding up) */
+	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/* The indirect block hint may be about to be freed. */
+	sv->sv_ibhint = 0;
+
+	if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+		sfs_ext_trunc(sv, blocklen);
+	}
+	else {
+		result = sfs_itrunc_ind(sv, blocklen, true);
+		if (result) {
+			return result;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
+		/*
+		 * A file that was converted from extents and is now
+		 * empty can go back to them.
+		 */
+		if (blocklen == 0 &&
+		    (sfs->sfs_sb.sb_flags & SFS_SBF_EXTENTS)) {
+			sv->sv_i.sfi_flags |= SFS_IF_EXTENTS;
 		}
 	}
 
@@ -297,7 +837,5 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
-
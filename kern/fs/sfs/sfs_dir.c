@@ -35,25 +35,14 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Read the directory entry out of slot SLOT of a directory vnode.
- * The "slot" is the index of the directory entry, starting at 0.
+ * Everything in here must be called with the directory locked.
  */
-static
-int
-sfs_readdir(struct sfs_vnode *sv, int slot, struct sfs_direntry *sd)
-{
-	off_t actualpos;
-
-	/* Compute the actual position in the directory to read. */
-	actualpos = slot * sizeof(struct sfs_direntry);
-
-	return sfs_metaio(sv, actualpos, sd, sizeof(*sd), UIO_READ);
-}
 
 /*
  * Write (overwrite) the directory entry in slot SLOT of a directory
@@ -95,55 +84,354 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+////////////////////////////////////////////////////////////
+// Directory index
+
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * The first lookup in a directory reads the whole directory and
+ * builds an index of it in memory: a hash table of the names in it,
+ * and a table saying which entry is in each slot, so free slots can be
+ * found without going to the disk. sfs_dir_link and sfs_dir_unlink
+ * keep it up to date. It lasts as long as the vnode does, and like the
+ * rest of the directory is protected by the vnode's lock.
+ */
+
+struct sfs_dirent {
+	struct sfs_dirent *de_next;	/* hash chain */
+	uint32_t de_ino;
+	unsigned de_slot;
+	char de_name[SFS_NAMELEN];
+};
+
+struct sfs_dirindex {
+	struct sfs_dirent **di_hash;	/* hash chains */
+	unsigned di_hashsize;		/* number of chains (power of 2) */
+	unsigned di_count;		/* number of names */
+	struct sfs_dirent **di_slots;	/* entry in each slot, or NULL */
+	unsigned di_nslots;		/* number of slots in the directory */
+	unsigned di_maxslots;		/* size of di_slots */
+	unsigned di_freehint;		/* no free slot below this one */
+};
+
+static
+unsigned
+sfs_dir_hashname(const char *name)
+{
+	unsigned h = 0;
+
+	for (; *name; name++) {
+		h = h*31 + (unsigned char)*name;
+	}
+	return h;
+}
+
+static
+void
+sfs_dirindex_destroy(struct sfs_dirindex *di)
+{
+	unsigned i;
+
+	for (i=0; i<di->di_nslots; i++) {
+		if (di->di_slots[i] != NULL) {
+			kfree(di->di_slots[i]);
+		}
+	}
+	kfree(di->di_slots);
+	kfree(di->di_hash);
+	kfree(di);
+}
+
+/*
+ * Make room in the slot table for at least WANT slots.
  */
+static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		uint32_t *ino, int *slot, int *emptyslot)
+sfs_dirindex_growslots(struct sfs_dirindex *di, unsigned want)
+{
+	struct sfs_dirent **newslots;
+	unsigned i, newmax;
+
+	if (want <= di->di_maxslots) {
+		return 0;
+	}
+	newmax = di->di_maxslots ? di->di_maxslots * 2 : SFS_DIRHASH_INITSIZE;
+	if (newmax < want) {
+		newmax = want;
+	}
+	newslots = kmalloc(newmax * sizeof(newslots[0]));
+	if (newslots == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<newmax; i++) {
+		newslots[i] = i < di->di_maxslots ? di->di_slots[i] : NULL;
+	}
+	kfree(di->di_slots);
+	di->di_slots = newslots;
+	di->di_maxslots = newmax;
+	return 0;
+}
+
+/*
+ * Double the number of hash chains. If there isn't memory to, just
+ * carry on with the chains we have.
+ */
+static
+void
+sfs_dirindex_growhash(struct sfs_dirindex *di)
+{
+	struct sfs_dirent **newhash;
+	struct sfs_dirent *de, *next;
+	unsigned i, newsize, ix;
+
+	newsize = di->di_hashsize * 2;
+	newhash = kmalloc(newsize * sizeof(newhash[0]));
+	if (newhash == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newhash[i] = NULL;
+	}
+	for (i=0; i<di->di_hashsize; i++) {
+		for (de = di->di_hash[i]; de != NULL; de = next) {
+			next = de->de_next;
+			ix = sfs_dir_hashname(de->de_name) & (newsize - 1);
+			de->de_next = newhash[ix];
+			newhash[ix] = de;
+		}
+	}
+	kfree(di->di_hash);
+	di->di_hash = newhash;
+	di->di_hashsize = newsize;
+}
+
+static
+struct sfs_dirent *
+sfs_dirindex_find(struct sfs_dirindex *di, const char *name)
+{
+	struct sfs_dirent *de;
+
+	de = di->di_hash[sfs_dir_hashname(name) & (di->di_hashsize - 1)];
+	for (; de != NULL; de = de->de_next) {
+		if (!strcmp(de->de_name, name)) {
+			return de;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add an entry. The slot table must already have room for its slot.
+ */
+static
+void
+sfs_dirindex_insert(struct sfs_dirindex *di, struct sfs_dirent *de)
+{
+	unsigned ix;
+
+	KASSERT(de->de_slot < di->di_maxslots);
+	KASSERT(di->di_slots[de->de_slot] == NULL);
+
+	if (di->di_count >= di->di_hashsize * SFS_DIRHASH_LOAD) {
+		sfs_dirindex_growhash(di);
+	}
+	ix = sfs_dir_hashname(de->de_name) & (di->di_hashsize - 1);
+	de->de_next = di->di_hash[ix];
+	di->di_hash[ix] = de;
+	di->di_count++;
+
+	di->di_slots[de->de_slot] = de;
+	if (de->de_slot >= di->di_nslots) {
+		di->di_nslots = de->de_slot + 1;
+	}
+}
+
+static
+void
+sfs_dirindex_remove(struct sfs_dirindex *di, struct sfs_dirent *de)
 {
-	struct sfs_direntry tsd;
-	int found, nentries, i, result;
+	struct sfs_dirent **dep;
+
+	dep = &di->di_hash[sfs_dir_hashname(de->de_name) &
+			   (di->di_hashsize - 1)];
+	while (*dep != de) {
+		KASSERT(*dep != NULL);
+		dep = &(*dep)->de_next;
+	}
+	*dep = de->de_next;
+	di->di_count--;
+
+	di->di_slots[de->de_slot] = NULL;
+	if (de->de_slot < di->di_freehint) {
+		di->di_freehint = de->de_slot;
+	}
+}
+
+/*
+ * Find a free slot, or return -1 if there isn't one.
+ */
+static
+int
+sfs_dirindex_freeslot(struct sfs_dirindex *di)
+{
+	while (di->di_freehint < di->di_nslots &&
+	       di->di_slots[di->di_freehint] != NULL) {
+		di->di_freehint++;
+	}
+	if (di->di_freehint < di->di_nslots) {
+		return di->di_freehint;
+	}
+	return -1;
+}
+
+/*
+ * Get a directory's index, reading the directory (a block at a time)
+ * to build it if this is the first time.
+ */
+static
+int
+sfs_dir_getindex(struct sfs_vnode *sv, struct sfs_dirindex **ret)
+{
+	struct sfs_dirindex *di;
+	struct sfs_direntry *sds;
+	struct sfs_dirent *de;
+	unsigned nentries, perblock, i, j, n;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_dirindex != NULL) {
+		*ret = sv->sv_dirindex;
+		return 0;
+	}
 
 	nentries = sfs_dir_nentries(sv);
+	perblock = SFS_BLOCKSIZE / sizeof(struct sfs_direntry);
+
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return ENOMEM;
+	}
+	di->di_hashsize = SFS_DIRHASH_INITSIZE;
+	di->di_count = 0;
+	di->di_slots = NULL;
+	di->di_nslots = 0;
+	di->di_maxslots = 0;
+	di->di_freehint = 0;
+	di->di_hash = kmalloc(di->di_hashsize * sizeof(di->di_hash[0]));
+	if (di->di_hash == NULL) {
+		kfree(di);
+		return ENOMEM;
+	}
+	for (i=0; i<di->di_hashsize; i++) {
+		di->di_hash[i] = NULL;
+	}
+	result = sfs_dirindex_growslots(di, nentries);
+	if (result) {
+		sfs_dirindex_destroy(di);
+		return result;
+	}
 
-	/* For each slot... */
-	found = 0;
-	for (i=0; i<nentries; i++) {
+	sds = kmalloc(SFS_BLOCKSIZE);
+	if (sds == NULL) {
+		sfs_dirindex_destroy(di);
+		return ENOMEM;
+	}
 
-		/* Read the entry from that slot */
-		result = sfs_readdir(sv, i, &tsd);
+	for (i=0; i<nentries; i+=perblock) {
+		n = nentries - i < perblock ? nentries - i : perblock;
+		result = sfs_metaio(sv, i * sizeof(struct sfs_direntry), sds,
+				    n * sizeof(struct sfs_direntry), UIO_READ);
 		if (result) {
-			return result;
+			goto fail;
 		}
-		if (tsd.sfd_ino == SFS_NOINO) {
-			/* Free slot - report it back if one was requested */
-			if (emptyslot != NULL) {
-				*emptyslot = i;
+		for (j=0; j<n; j++) {
+			if (sds[j].sfd_ino == SFS_NOINO) {
+				continue;
 			}
-		}
-		else {
+
 			/* Ensure null termination, just in case */
-			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
-			if (!strcmp(tsd.sfd_name, name)) {
-
-				/* Each name may legally appear only once... */
-				KASSERT(found==0);
-
-				found = 1;
-				if (slot != NULL) {
-					*slot = i;
-				}
-				if (ino != NULL) {
-					*ino = tsd.sfd_ino;
-				}
+			sds[j].sfd_name[sizeof(sds[j].sfd_name)-1] = 0;
+
+			/* Each name may legally appear only once... */
+			KASSERT(sfs_dirindex_find(di, sds[j].sfd_name)==NULL);
+
+			de = kmalloc(sizeof(*de));
+			if (de == NULL) {
+				result = ENOMEM;
+				goto fail;
 			}
+			de->de_ino = sds[j].sfd_ino;
+			de->de_slot = i + j;
+			strcpy(de->de_name, sds[j].sfd_name);
+			sfs_dirindex_insert(di, de);
 		}
 	}
+	di->di_nslots = nentries;
 
-	return found ? 0 : ENOENT;
+	kfree(sds);
+	sv->sv_dirindex = di;
+	*ret = di;
+	return 0;
+
+ fail:
+	kfree(sds);
+	di->di_nslots = nentries;
+	sfs_dirindex_destroy(di);
+	return result;
+}
+
+/*
+ * Throw away a directory's index; called when the vnode goes away.
+ */
+void
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	if (sv->sv_dirindex != NULL) {
+		sfs_dirindex_destroy(sv->sv_dirindex);
+		sv->sv_dirindex = NULL;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Directory operations
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ */
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dirindex *di;
+	struct sfs_dirent *de;
+	int freeslot, result;
+
+	result = sfs_dir_getindex(sv, &di);
+	if (result) {
+		return result;
+	}
+
+	/* Report back a free slot if one was requested */
+	if (emptyslot != NULL) {
+		freeslot = sfs_dirindex_freeslot(di);
+		if (freeslot >= 0) {
+			*emptyslot = freeslot;
+		}
+	}
+
+	de = sfs_dirindex_find(di, name);
+	if (de == NULL) {
+		return ENOENT;
+	}
+	if (slot != NULL) {
+		*slot = de->de_slot;
+	}
+	if (ino != NULL) {
+		*ino = de->de_ino;
+	}
+	return 0;
 }
 
 /*
@@ -156,6 +444,8 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	int emptyslot = -1;
 	int result;
 	struct sfs_direntry sd;
+	struct sfs_dirent *de;
+	struct sfs_dirindex *di;
 
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
@@ -175,18 +465,43 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		emptyslot = sfs_dir_nentries(sv);
 	}
 
+	/*
+	 * Get the index entry ready first, so that once the directory
+	 * entry is written the index can't fail to be updated.
+	 */
+	di = sv->sv_dirindex;
+	KASSERT(di != NULL);
+	result = sfs_dirindex_growslots(di, emptyslot + 1);
+	if (result) {
+		return result;
+	}
+	de = kmalloc(sizeof(*de));
+	if (de == NULL) {
+		return ENOMEM;
+	}
+	de->de_ino = ino;
+	de->de_slot = emptyslot;
+	strcpy(de->de_name, name);
+
 	/* Set up the entry. */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = ino;
 	strcpy(sd.sfd_name, name);
 
+	/* Write the entry. */
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		kfree(de);
+		return result;
+	}
+	sfs_dirindex_insert(di, de);
+
 	/* Hand back the slot, if so requested. */
 	if (slot) {
 		*slot = emptyslot;
 	}
 
-	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	return 0;
 }
 
 /*
@@ -196,13 +511,31 @@ int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_direntry sd;
+	struct sfs_dirindex *di;
+	struct sfs_dirent *de;
+	int result;
+
+	result = sfs_dir_getindex(sv, &di);
+	if (result) {
+		return result;
+	}
+	KASSERT(slot >= 0 && (unsigned)slot < di->di_nslots);
+	de = di->di_slots[slot];
+	KASSERT(de != NULL);
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	sfs_dirindex_remove(di, de);
+	kfree(de);
+	return 0;
 }
 
 /*
@@ -228,11 +561,13 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		return result;
 	}
 
+	lock_acquire((*ret)->sv_lock);
 	if ((*ret)->sv_i.sfi_linkcount == 0) {
 		panic("sfs: %s: name %s (inode %u) in dir %u has "
 		      "linkcount 0\n", sfs->sfs_sb.sb_volname,
 		      name, (*ret)->sv_ino, sv->sv_ino);
 	}
+	lock_release((*ret)->sv_lock);
 
 	return 0;
 }
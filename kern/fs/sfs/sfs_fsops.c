@@ -39,8 +39,10 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -66,6 +68,10 @@
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
+ *
+ * Reading is only done at mount time, when nobody else can see the
+ * freemap. Writing copies each block out under the freemap lock and
+ * writes the copy, so allocation can go on during the I/O.
  */
 static
 int
@@ -73,7 +79,8 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
 	uint32_t j, freemapblocks;
 	char *freemapdata;
-	int result;
+	void *copy = NULL;
+	int result = 0;
 
 	/* Number of blocks in the free block bitmap. */
 	freemapblocks = SFS_FS_FREEMAPBLOCKS(sfs);
@@ -81,6 +88,13 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 	/* Pointer to our freemap data in memory. */
 	freemapdata = bitmap_getdata(sfs->sfs_freemap);
 
+	if (rw == UIO_WRITE) {
+		copy = kmalloc(SFS_BLOCKSIZE);
+		if (copy == NULL) {
+			return ENOMEM;
+		}
+	}
+
 	/* For each block in the free block bitmap... */
 	for (j=0; j<freemapblocks; j++) {
 
@@ -93,16 +107,23 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 					       SFS_BLOCKSIZE);
 		}
 		else {
-			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
+			lock_acquire(sfs->sfs_freemaplock);
+			memcpy(copy, ptr, SFS_BLOCKSIZE);
+			lock_release(sfs->sfs_freemaplock);
+			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, copy,
 						SFS_BLOCKSIZE);
 		}
 
 		/* If we failed, stop. */
 		if (result) {
-			return result;
+			break;
 		}
 	}
-	return 0;
+
+	if (copy != NULL) {
+		kfree(copy);
+	}
+	return result;
 }
 
 /*
@@ -112,14 +133,53 @@ static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
-	unsigned i, num;
+	struct vnodearray *vnodes;
+	struct vnode *v;
+	struct sfs_vnode *sv;
+	unsigned i, n, num;
+	int result;
+
+	/*
+	 * Syncing a vnode needs its lock, which comes before the table
+	 * lock, so take a reference to each vnode in the table and then
+	 * go over them with the table unlocked. This only moves the
+	 * inodes into the buffer cache; sfs_sync flushes the buffers
+	 * afterwards, once for all of them.
+	 */
+	vnodes = vnodearray_create();
+	if (vnodes == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_nvnodes;
+	result = vnodearray_setsize(vnodes, num);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		vnodearray_destroy(vnodes);
+		return result;
+	}
+	n = 0;
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnodes[i]; sv != NULL; sv = sv->sv_hashnext) {
+			VOP_INCREF(&sv->sv_absvn);
+			vnodearray_set(vnodes, n++, &sv->sv_absvn);
+		}
+	}
+	KASSERT(n == num);
+	lock_release(sfs->sfs_vnlock);
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		v = vnodearray_get(vnodes, i);
+		sv = v->vn_data;
+		lock_acquire(sv->sv_lock);
+		sfs_sync_inode(sv);
+		lock_release(sv->sv_lock);
+		VOP_DECREF(v);
 	}
+
+	vnodearray_setsize(vnodes, 0);
+	vnodearray_destroy(vnodes);
 	return 0;
 }
 
@@ -130,14 +190,26 @@ static
 int
 sfs_sync_freemap(struct sfs_fs *sfs)
 {
+	bool dirty;
 	int result;
 
-	if (sfs->sfs_freemapdirty) {
+	/*
+	 * Clear the dirty flag before writing, so changes made during
+	 * the write set it again.
+	 */
+	lock_acquire(sfs->sfs_freemaplock);
+	dirty = sfs->sfs_freemapdirty;
+	sfs->sfs_freemapdirty = false;
+	lock_release(sfs->sfs_freemaplock);
+
+	if (dirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
+			lock_acquire(sfs->sfs_freemaplock);
+			sfs->sfs_freemapdirty = true;
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
-		sfs->sfs_freemapdirty = false;
 	}
 
 	return 0;
@@ -174,8 +246,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -208,28 +278,41 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
+	/*
+	 * One sync at a time, so one can't write an older copy of the
+	 * freemap over what another just wrote.
+	 */
+	lock_acquire(sfs->sfs_synclock);
+
 	/* If any vnodes need to be written, write them. */
 	result = sfs_sync_vnodes(sfs);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_synclock);
+		return result;
+	}
+
+	/* Write back the dirty buffers. */
+	result = buffer_syncfs(fs);
+	if (result) {
+		lock_release(sfs->sfs_synclock);
 		return result;
 	}
 
 	/* If the free block map needs to be written, write it. */
 	result = sfs_sync_freemap(sfs);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_synclock);
 		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	result = sfs_sync_superblock(sfs);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_synclock);
 		return result;
 	}
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_synclock);
 	return 0;
 }
 
@@ -237,19 +320,16 @@ sfs_sync(struct fs *fs)
  * Routine to retrieve the volume name. Filesystems can be referred
  * to by their volume name followed by a colon as well as the name
  * of the device they're mounted on.
+ *
+ * The superblock doesn't change after mount, so no lock is needed.
  */
 static
 const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
 
-	return ret;
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -262,7 +342,12 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_vnhash_destroy(sfs);
+	KASSERT(sfs->sfs_loading == NULL);
+	cv_destroy(sfs->sfs_loadcv);
+	lock_destroy(sfs->sfs_synclock);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -278,18 +363,25 @@ sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
 
-	vfs_biglock_acquire();
-
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. (The VFS
+	 * layer holds its big lock across the unmount, so nobody can
+	 * come in through getroot and load a vnode once this passes.)
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* ...so all our buffers are clean; forget them. */
+	buffer_dropfs(fs);
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -297,7 +389,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -309,6 +400,7 @@ static const struct fs_ops sfs_fsops = {
 	.fsop_getvolname = sfs_getvolname,
 	.fsop_getroot = sfs_getroot,
 	.fsop_unmount = sfs_unmount,
+	.fsop_blockio = sfs_fs_blockio,
 };
 
 /*
@@ -351,17 +443,43 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
 		goto cleanup_object;
 	}
+	if (sfs_vnhash_create(sfs)) {
+		goto cleanup_vnlock;
+	}
+	sfs->sfs_loading = NULL;
+	sfs->sfs_loadcv = cv_create("sfs_loadcv");
+	if (sfs->sfs_loadcv == NULL) {
+		goto cleanup_vnodes;
+	}
 
 	/* freemap */
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_loadcv;
+	}
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
 
+	/* sync */
+	sfs->sfs_synclock = lock_create("sfs_synclock");
+	if (sfs->sfs_synclock == NULL) {
+		goto cleanup_freemaplock;
+	}
+
 	return sfs;
 
+cleanup_freemaplock:
+	lock_destroy(sfs->sfs_freemaplock);
+cleanup_loadcv:
+	cv_destroy(sfs->sfs_loadcv);
+cleanup_vnodes:
+	sfs_vnhash_destroy(sfs);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -388,8 +506,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -402,7 +518,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -410,7 +525,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -423,7 +537,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -436,7 +549,14 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			SFS_MAGIC);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
+		return EINVAL;
+	}
+
+	if (sfs->sfs_sb.sb_flags & ~SFS_SBF_EXTENTS) {
+		kprintf("sfs: Unknown flags in superblock (0x%x)\n",
+			sfs->sfs_sb.sb_flags);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
 		return EINVAL;
 	}
 
@@ -453,21 +573,18 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (sfs->sfs_freemap == NULL) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
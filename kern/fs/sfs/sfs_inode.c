@@ -35,31 +35,203 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Write an on-disk inode structure back out to its buffer. (It gets
+ * to disk when the buffer does.) The vnode must be locked.
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
 	int result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
-		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
-					sizeof(sv->sv_i));
+		result = buffer_get(&sfs->sfs_absfs, sv->sv_ino,
+				    SFS_BLOCKSIZE, &buf);
 		if (result) {
 			return result;
 		}
+		memcpy(buffer_map(buf), &sv->sv_i, sizeof(sv->sv_i));
+		buffer_mark_valid(buf);
+		buffer_mark_dirty(buf);
+		buffer_release(buf);
 		sv->sv_dirty = false;
 	}
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+// Vnode table
+
+/*
+ * The vnode table is a hash table keyed by inode number, chained
+ * through sv_hashnext. Inode numbers are block numbers, so the low
+ * bits are as good a hash as any. The table doubles in size when the
+ * chains get longer than SFS_VNHASH_LOAD on average.
+ */
+
+/*
+ * Set up an empty table.
+ */
+int
+sfs_vnhash_create(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	sfs->sfs_vnhashsize = SFS_VNHASH_INITSIZE;
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_vnodes = kmalloc(sfs->sfs_vnhashsize *
+				  sizeof(sfs->sfs_vnodes[0]));
+	if (sfs->sfs_vnodes == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		sfs->sfs_vnodes[i] = NULL;
+	}
+	return 0;
+}
+
+/*
+ * Destroy the table, which must be empty.
+ */
+void
+sfs_vnhash_destroy(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_nvnodes == 0);
+	kfree(sfs->sfs_vnodes);
+	sfs->sfs_vnodes = NULL;
+}
+
+/*
+ * Double the number of chains. If there isn't memory to, just carry
+ * on with the chains we have.
+ */
+static
+void
+sfs_vnhash_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **newtable;
+	struct sfs_vnode *sv, *next;
+	unsigned i, newsize, ix;
+
+	newsize = sfs->sfs_vnhashsize * 2;
+	newtable = kmalloc(newsize * sizeof(newtable[0]));
+	if (newtable == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newtable[i] = NULL;
+	}
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnodes[i]; sv != NULL; sv = next) {
+			next = sv->sv_hashnext;
+			ix = sv->sv_ino & (newsize - 1);
+			sv->sv_hashnext = newtable[ix];
+			newtable[ix] = sv;
+		}
+	}
+	kfree(sfs->sfs_vnodes);
+	sfs->sfs_vnodes = newtable;
+	sfs->sfs_vnhashsize = newsize;
+}
+
+/*
+ * Find a vnode in the vnode table, or return NULL. The table must be
+ * locked.
+ */
+static
+struct sfs_vnode *
+sfs_findvnode(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	sv = sfs->sfs_vnodes[ino & (sfs->sfs_vnhashsize - 1)];
+	for (; sv != NULL; sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			/* Every inode in memory must be in an allocated block */
+			if (!sfs_bused(sfs, sv->sv_ino)) {
+				panic("sfs: %s: Found inode %u in unallocated "
+				      "block\n", sfs->sfs_sb.sb_volname,
+				      sv->sv_ino);
+			}
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add a vnode to the table, which must be locked.
+ */
+static
+void
+sfs_vnhash_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned ix;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	if (sfs->sfs_nvnodes >= sfs->sfs_vnhashsize * SFS_VNHASH_LOAD) {
+		sfs_vnhash_grow(sfs);
+	}
+	ix = sv->sv_ino & (sfs->sfs_vnhashsize - 1);
+	sv->sv_hashnext = sfs->sfs_vnodes[ix];
+	sfs->sfs_vnodes[ix] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+/*
+ * Remove a vnode from the table, which must be locked.
+ */
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	svp = &sfs->sfs_vnodes[sv->sv_ino & (sfs->sfs_vnhashsize - 1)];
+	for (; *svp != NULL; svp = &(*svp)->sv_hashnext) {
+		if (*svp == sv) {
+			*svp = sv->sv_hashnext;
+			sv->sv_hashnext = NULL;
+			sfs->sfs_nvnodes--;
+			return;
+		}
+	}
+	panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+	      sfs->sfs_sb.sb_volname, sv->sv_ino);
+}
+
+////////////////////////////////////////////////////////////
+// Vnode lifecycle
+
+/*
+ * Destroy a vnode structure that isn't (or is no longer) in the table.
+ */
+static
+void
+sfs_vnode_destroy(struct sfs_vnode *sv)
+{
+	sfs_dir_dropindex(sv);
+	vnode_cleanup(&sv->sv_absvn);
+	lock_destroy(sv->sv_lock);
+	kfree(sv);
+}
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
@@ -70,34 +242,22 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/*
-	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * If there are no on-disk references to the file either, erase
+	 * it; then get the inode into its buffer. This is done before
+	 * locking the vnode table, so the I/O doesn't hold up everyone
+	 * else. It's safe even if someone picks up the vnode meanwhile:
+	 * they can't change it until we unlock it, and an unlinked file
+	 * can only be picked up by sfs_sync_vnodes, which just syncs it.
 	 */
-	spinlock_acquire(&v->vn_countlock);
-	if (v->vn_refcount != 1) {
-
-		/* consume the reference VOP_DECREF gave us */
-		KASSERT(v->vn_refcount>1);
-		v->vn_refcount--;
-
-		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
-		return EBUSY;
-	}
-	spinlock_release(&v->vn_countlock);
-
-	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 	}
@@ -105,88 +265,149 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
+	/*
+	 * Make sure someone else hasn't picked up the vnode since the
+	 * decision was made to reclaim it. sfs_loadvnode only picks up
+	 * vnodes with the table locked, so checking under the table
+	 * lock settles it.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount>1);
+		v->vn_refcount--;
+
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_vnhash_remove(sfs, sv);
+	lock_release(sfs->sfs_vnlock);
 
-	vnode_cleanup(&sv->sv_absvn);
+	/*
+	 * If there are no on-disk references, discard the inode. Nobody
+	 * can be loading it again, since nothing refers to it.
+	 */
+	if (sv->sv_i.sfi_linkcount==0) {
+		sfs_bfree(sfs, sv->sv_ino);
+	}
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	sfs_vnode_destroy(sv);
 
 	/* Done */
 	return 0;
 }
 
+/*
+ * An inode being read in by sfs_loadvnode. These live on the loader's
+ * stack and are linked on sfs_loading.
+ */
+struct sfs_loading {
+	uint32_t sl_ino;
+	struct sfs_loading *sl_next;
+};
+
+static
+bool
+sfs_isloading(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_loading *sl;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sl = sfs->sfs_loading; sl != NULL; sl = sl->sl_next) {
+		if (sl->sl_ino == ino) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Take SL off the loading list and wake up anyone waiting for it.
+ */
+static
+void
+sfs_doneloading(struct sfs_fs *sfs, struct sfs_loading *sl)
+{
+	struct sfs_loading **slp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (slp = &sfs->sfs_loading; *slp != sl; slp = &(*slp)->sl_next) {
+		KASSERT(*slp != NULL);
+	}
+	*slp = sl->sl_next;
+	cv_broadcast(sfs->sfs_loadcv, sfs->sfs_vnlock);
+}
+
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
+ *
+ * The vnode table is not locked while reading the inode, so the inode
+ * number goes on sfs_loading first; anyone else who wants it waits
+ * for us to finish and then finds our vnode in the table. That way
+ * the inode can't be loaded, changed and reclaimed by someone else
+ * while we read it, and what we read is current: a vnode being
+ * reclaimed syncs its inode to the buffer cache before it leaves the
+ * table, and nobody can pick it up again after that.
  */
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
+	struct sfs_loading loading;
 	struct sfs_vnode *sv;
+	struct buf *buf;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: %s: Found inode %u in unallocated block\n",
-			      sfs->sfs_sb.sb_volname, sv->sv_ino);
-		}
-
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
-		}
+	/* Look in the vnodes table, waiting out anyone loading it */
+	lock_acquire(sfs->sfs_vnlock);
+	while ((sv = sfs_findvnode(sfs, ino)) == NULL &&
+	       sfs_isloading(sfs, ino)) {
+		cv_wait(sfs->sfs_loadcv, sfs->sfs_vnlock);
+	}
+	if (sv != NULL) {
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
+
+		VOP_INCREF(&sv->sv_absvn);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
+	loading.sl_ino = ino;
+	loading.sl_next = sfs->sfs_loading;
+	sfs->sfs_loading = &loading;
+	lock_release(sfs->sfs_vnlock);
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
-		return ENOMEM;
+		result = ENOMEM;
+		goto fail;
+	}
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		result = ENOMEM;
+		goto fail;
 	}
 
 	/* Must be in an allocated block */
@@ -196,11 +417,14 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
+	result = buffer_read(&sfs->sfs_absfs, ino, SFS_BLOCKSIZE, &buf);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
-		return result;
+		goto fail;
 	}
+	memcpy(&sv->sv_i, buffer_map(buf), sizeof(sv->sv_i));
+	buffer_release(buf);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
@@ -213,6 +437,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
+		if (sfs->sfs_sb.sb_flags & SFS_SBF_EXTENTS) {
+			sv->sv_i.sfi_flags = SFS_IF_EXTENTS;
+		}
 		sv->sv_dirty = true;
 	}
 
@@ -235,24 +462,38 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
-		return result;
+		goto fail;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
-
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
-	}
+	sv->sv_hashnext = NULL;
+	sv->sv_ranext = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_raissued = 0;
+	sv->sv_ibhint = 0;
+	sv->sv_ibhintbase = 0;
+	sv->sv_dirindex = NULL;
+
+	/* Add it to our table and let anyone waiting for it have it */
+	lock_acquire(sfs->sfs_vnlock);
+	KASSERT(sfs_findvnode(sfs, ino) == NULL);
+	sfs_vnhash_add(sfs, sv);
+	sfs_doneloading(sfs, &loading);
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
 	return 0;
+
+ fail:
+	/* Let the next one try */
+	lock_acquire(sfs->sfs_vnlock);
+	sfs_doneloading(sfs, &loading);
+	lock_release(sfs->sfs_vnlock);
+	return result;
 }
 
 /*
@@ -296,25 +537,19 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
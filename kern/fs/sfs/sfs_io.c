@@ -36,8 +36,10 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -50,6 +52,10 @@
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
  * except sfs_device.
+ *
+ * None of these take any locks: sfs_device and the volume name
+ * don't change while the volume is mounted, and the device does
+ * its own synchronization.
  */
 
 /*
@@ -62,8 +68,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -131,15 +135,31 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	return sfs_rwblock(sfs, &ku);
 }
 
+/*
+ * Buffer cache hook: read or write one or more consecutive blocks for
+ * the buffer cache, bypassing it. This must not take any SFS locks:
+ * the flusher calls it with buffers pinned that a thread holding a
+ * vnode lock may be waiting for.
+ */
+int
+sfs_fs_blockio(struct fs *fs, struct uio *uio)
+{
+	KASSERT(uio->uio_segflg == UIO_SYSSPACE);
+	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
+	KASSERT(uio->uio_resid % SFS_BLOCKSIZE == 0);
+
+	return sfs_rwblock(fs->fs_data, uio);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
 
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * need the original contents of the block first, even if we're
+ * writing, so we don't clobber the portion of the block we're not
+ * intending to write over.
  *
  * SKIPSTART is the number of bytes to skip past at the beginning of
  * the sector; LEN is the number of bytes to actually read or write.
@@ -150,16 +170,9 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
+	char *ioptr;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -169,9 +182,6 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
@@ -184,64 +194,77 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE,
+			     &iobuf);
 	if (result) {
 		return result;
 	}
+	ioptr = buffer_map(iobuf);
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 */
+	result = uiomove(ioptr+skipstart, len, uio);
+
+	/*
+	 * If it was a write, the block is now dirty. (Even if uiomove
+	 * failed, part of the new data may have gone in.)
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		buffer_mark_dirty(iobuf);
 	}
+	buffer_release(iobuf);
 
-	return 0;
+	return result;
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Do I/O (either read or write) of whole blocks, at most MAXBLOCKS of
+ * them; the number done is handed back in DONE. Writes are done one
+ * block at a time (the buffer cache clusters them when it writes them
+ * back), but a read covers as many blocks as are contiguous on disk.
  */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio, uint32_t maxblocks,
+	    uint32_t *done)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
+	struct buf *run[BUFFER_MAXRUN];
 	daddr_t diskblock;
-	uint32_t fileblock;
+	uint32_t fileblock, n, i;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+
+	*done = 1;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/*
+	 * Look up the disk block number. For a read, also see how many
+	 * of the following file blocks are the following disk blocks,
+	 * so that whatever of them isn't in the buffer cache can be
+	 * read in one request.
+	 */
+	if (doalloc) {
+		n = 1;
+		result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	}
+	else {
+		n = maxblocks < BUFFER_MAXRUN ? maxblocks : BUFFER_MAXRUN;
+		result = sfs_bmaprun(sv, fileblock, n, &diskblock, &n);
+	}
 	if (result) {
 		return result;
 	}
@@ -257,46 +280,117 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
 
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_readrun(&sfs->sfs_absfs, diskblock, n,
+					SFS_BLOCKSIZE, run);
+		if (result) {
+			return result;
+		}
+		for (i=0; i<n; i++) {
+			if (result == 0) {
+				result = uiomove(buffer_map(run[i]),
+						 SFS_BLOCKSIZE, uio);
+			}
+			buffer_release(run[i]);
+		}
+		*done = n;
+		return result;
+	}
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
+	 * We're overwriting the whole block, so there's no need to
+	 * read it first.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
-
+	result = buffer_get(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE, &iobuf);
+	if (result) {
+		return result;
+	}
+	result = uiomove(buffer_map(iobuf), SFS_BLOCKSIZE, uio);
+	if (result && !buffer_is_valid(iobuf)) {
+		/* Only part of the block got filled in; throw it away. */
+		buffer_release_and_invalidate(iobuf);
+		return result;
+	}
+	buffer_mark_valid(iobuf);
+	buffer_mark_dirty(iobuf);
+	buffer_release(iobuf);
 	return result;
 }
 
+/*
+ * Sequential read-ahead. Called after reading file blocks FIRST up to
+ * (but not including) END. If this read picks up where the last one
+ * left off (or in the same block, for reads smaller than a block), the
+ * read-ahead window opens to SFS_RAMIN blocks and doubles on each
+ * further sequential read up to SFS_RAMAX; otherwise it closes. Blocks
+ * in the window not already requested are handed to the buffer cache
+ * to read in the background.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t first, uint32_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t block, stop, fileblocks, n, i;
+	daddr_t diskblock;
+
+	if (first == sv->sv_ranext || first + 1 == sv->sv_ranext) {
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RAMIN;
+		}
+		else if (end > sv->sv_ranext && sv->sv_rawindow < SFS_RAMAX) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_raissued = end;
+	}
+	sv->sv_ranext = end;
+
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	stop = end + sv->sv_rawindow;
+	if (stop > fileblocks) {
+		stop = fileblocks;
+	}
+	block = sv->sv_raissued > end ? sv->sv_raissued : end;
+
+	while (block < stop) {
+		if (sfs_bmaprun(sv, block, stop - block, &diskblock, &n)) {
+			break;
+		}
+		if (diskblock != 0) {
+			for (i=0; i<n; i++) {
+				buffer_readahead(&sfs->sfs_absfs,
+						 diskblock + i, SFS_BLOCKSIZE);
+			}
+		}
+		block += n;
+	}
+	if (block > sv->sv_raissued) {
+		sv->sv_raissued = block;
+	}
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
+ * The vnode must be locked.
  */
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
 	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t nblocks, done;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	uint32_t firstblock;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	origresid = uio->uio_resid;
+	firstblock = uio->uio_offset / SFS_BLOCKSIZE;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -352,11 +446,12 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+	while (nblocks > 0) {
+		result = sfs_blockio(sv, uio, nblocks, &done);
 		if (result) {
 			goto out;
 		}
+		nblocks -= done;
 	}
 
 	/*
@@ -381,6 +476,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		sv->sv_dirty = true;
 	}
 
+	/* If reading, keep ahead of the reader */
+	if (uio->uio_resid != origresid &&
+	    uio->uio_rw == UIO_READ && result == 0) {
+		sfs_readahead(sv, firstblock,
+			      DIVROUNDUP(uio->uio_offset, SFS_BLOCKSIZE));
+	}
+
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
 
@@ -407,6 +509,8 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
+	char *ioptr;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,17 +518,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -446,26 +540,23 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = buffer_read(&sfs->sfs_absfs, diskblock, SFS_BLOCKSIZE, &iobuf);
 	if (result) {
 		return result;
 	}
+	ioptr = buffer_map(iobuf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, ioptr + blockoffset, len);
+		buffer_release(iobuf);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		memcpy(ioptr + blockoffset, data, len);
+		buffer_mark_dirty(iobuf);
+		buffer_release(iobuf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
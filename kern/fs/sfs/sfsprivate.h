@@ -37,6 +37,21 @@
 extern const struct vnode_ops sfs_fileops;
 extern const struct vnode_ops sfs_dirops;
 
+/* Vnode table sizing (see sfs_inode.c) */
+#define SFS_VNHASH_INITSIZE  32   /* initial number of chains */
+#define SFS_VNHASH_LOAD      2    /* grow past this many vnodes per chain */
+
+/* Directory index sizing (see sfs_dir.c) */
+#define SFS_DIRHASH_INITSIZE 16   /* initial number of chains */
+#define SFS_DIRHASH_LOAD     2    /* grow past this many names per chain */
+
+/* Read-ahead window limits, in blocks (see sfs_io.c) */
+#define SFS_RAMIN  4
+#define SFS_RAMAX  32
+
+/* Free run a new extent looks for, in blocks (see sfs_bmap.c) */
+#define SFS_EXTRUN 16
+
 /* Macro for initializing a uio structure */
 #define SFSUIO(iov, uio, ptr, block, rw) \
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
@@ -44,12 +59,17 @@ extern const struct vnode_ops sfs_dirops;
 
 /* Functions in sfs_balloc.c */
 int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_balloc_at(struct sfs_fs *sfs, daddr_t block);
+int sfs_balloc_near(struct sfs_fs *sfs, daddr_t goal, unsigned run,
+		daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		daddr_t *diskblock);
+int sfs_bmaprun(struct sfs_vnode *sv, uint32_t fileblock, uint32_t max,
+		daddr_t *diskblock, uint32_t *nblocks);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
 /* Functions in sfs_dir.c */
@@ -58,11 +78,14 @@ int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
 		int *slot);
 int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
+void sfs_dir_dropindex(struct sfs_vnode *sv);
 int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
 /* Functions in sfs_inode.c */
+int sfs_vnhash_create(struct sfs_fs *sfs);
+void sfs_vnhash_destroy(struct sfs_fs *sfs);
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
@@ -73,6 +96,7 @@ int sfs_getroot(struct fs *fs, struct vnode **ret);
 /* Functions in sfs_io.c */
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
+int sfs_fs_blockio(struct fs *fs, struct uio *uio);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
@@ -0,0 +1,31 @@
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+/*
+ * Atomic operations for lock-free data structures.
+ *
+ * atomic_cas32 compares the word at P with OLDVAL and, if they are
+ * equal, replaces it with NEWVAL. It returns true if the store was
+ * made. It may also fail spuriously (e.g. if an interrupt arrives in
+ * the middle) so it should always be used in a retry loop.
+ *
+ * atomic_casptr is the same thing for pointers.
+ *
+ * Both are full memory barriers, so a successful CAS may be used to
+ * publish data written beforehand.
+ */
+
+/* Inlining support - for making sure an out-of-line copy gets built */
+#ifndef ATOMIC_INLINE
+#define ATOMIC_INLINE INLINE
+#endif
+
+ATOMIC_INLINE bool atomic_cas32(volatile uint32_t *p,
+				uint32_t oldval, uint32_t newval);
+ATOMIC_INLINE bool atomic_casptr(void *volatile *p,
+				 void *oldval, void *newval);
+
+/* Get the implementation. */
+#include <machine/atomic.h>
+
+#endif /* _ATOMIC_H_ */
@@ -0,0 +1,110 @@
+/*
+ * Buffer cache.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+struct fs;   /* from <fs.h> */
+
+/*
+ * The buffer cache holds recently used filesystem blocks in memory,
+ * keyed by filesystem and block number. It grows on demand up to
+ * 1/BUFFER_RAMFRACTION of physical memory; after that the least
+ * recently used buffer is reused, being written back first if dirty.
+ *
+ * A buffer handed out by buffer_get or buffer_read is pinned: it is
+ * held by the caller, who may read and change its contents through
+ * buffer_map, and nobody else can get it (they wait) or evict it
+ * until the caller calls buffer_release. Dirty buffers are written
+ * back on eviction, by buffer_sync and buffer_syncfs, and by the
+ * flusher thread, which wakes once a second and writes buffers that
+ * have been dirty for BUFFER_MAXAGE seconds or more. If more than
+ * 1/BUFFER_DIRTYHIGH of the cache is dirty, the flusher instead writes
+ * everything it can until less than 1/BUFFER_DIRTYLOW is.
+ *
+ * buffer_readahead queues a block to be read into the cache by the
+ * read-ahead thread, so a reader that's about to want it can find it
+ * there. Requests are dropped if the queue (BUFFER_RAQUEUE entries) is
+ * full; they're only hints.
+ *
+ * The cache does its I/O through the filesystem's fsop_blockio.
+ * Writing back a dirty buffer also writes any dirty neighbors on the
+ * disk in the same request, up to BUFFER_MAXRUN blocks.
+ *
+ * Functions:
+ *     buffer_bootstrap - set up the cache at boot time.
+ *     buffer_get       - get the buffer for a block without reading
+ *                        it; for callers about to overwrite all of it.
+ *                        The contents are garbage unless the buffer
+ *                        happens to be valid already; once they've
+ *                        been filled in call buffer_mark_valid.
+ *     buffer_read      - get the buffer for a block, reading it from
+ *                        disk if it isn't already in memory.
+ *     buffer_readrun   - same, for N (at most BUFFER_MAXRUN) consecutive
+ *                        blocks; the ones that need reading are read in
+ *                        as few device requests as possible. Release
+ *                        each buffer separately.
+ *     buffer_release   - unpin a buffer.
+ *     buffer_release_and_invalidate - unpin a buffer and forget its
+ *                        contents; for error paths where the contents
+ *                        were left half-filled.
+ *     buffer_map       - get a pointer to the buffer's data.
+ *     buffer_is_valid  - check if the contents are valid.
+ *     buffer_mark_valid - record that the contents are now valid.
+ *     buffer_mark_dirty - record that the contents need to be written
+ *                        back. The buffer must be valid.
+ *     buffer_sync      - write a pinned buffer back if it's dirty.
+ *     buffer_readahead - start reading a block into the cache in the
+ *                        background, if it isn't there already.
+ *     buffer_drop      - forget a block (without writing it back),
+ *                        because the filesystem has freed it.
+ *     buffer_syncfs    - write back all dirty buffers of a filesystem.
+ *     buffer_dropfs    - forget all buffers of a filesystem, which
+ *                        must already be synced, and any read-ahead
+ *                        requests for it; used at unmount.
+ *     buffer_dropclean - forget the buffers of a filesystem that are
+ *                        clean and not pinned, leaving the rest; for
+ *                        benchmarks that want a cold cache.
+ *     buffer_printstats - print hit and miss counts and such.
+ *
+ * BLOCK numbers are in units of the filesystem's block size, SIZE is
+ * the block size in bytes and must be the same every time for a given
+ * filesystem.
+ */
+
+#define BUFFER_RAMFRACTION  16
+#define BUFFER_MINBUFS      32
+#define BUFFER_MAXAGE       2	/* seconds */
+#define BUFFER_DIRTYHIGH    2
+#define BUFFER_DIRTYLOW     4
+#define BUFFER_RAQUEUE      64
+#define BUFFER_MAXRUN       16
+
+struct buf;
+
+void buffer_bootstrap(void);
+
+int buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret);
+int buffer_read(struct fs *fs, daddr_t block, size_t size, struct buf **ret);
+int buffer_readrun(struct fs *fs, daddr_t block, unsigned n, size_t size,
+		   struct buf **bufs);
+void buffer_release(struct buf *buf);
+void buffer_release_and_invalidate(struct buf *buf);
+
+void *buffer_map(struct buf *buf);
+bool buffer_is_valid(struct buf *buf);
+void buffer_mark_valid(struct buf *buf);
+void buffer_mark_dirty(struct buf *buf);
+int buffer_sync(struct buf *buf);
+
+void buffer_readahead(struct fs *fs, daddr_t block, size_t size);
+void buffer_drop(struct fs *fs, daddr_t block, size_t size);
+int buffer_syncfs(struct fs *fs);
+void buffer_dropfs(struct fs *fs);
+void buffer_dropclean(struct fs *fs);
+
+void buffer_printstats(void);
+
+
+#endif /* _BUF_H_ */
@@ -56,8 +56,16 @@ void timerclock(void);
 
 /*
  * gettime() may be used to fetch the current time of day.
+ *
+ * clocktime() returns the kernel's own copy of the time of day, which
+ * hardclock() on cpu 0 advances and timerclock() resynchronizes with
+ * the clock device once a second. It takes no lock and doesn't touch
+ * the device, so it is cheap enough to call anywhere, but it only
+ * moves once per hardclock (1/HZ seconds). Use gettime() to time
+ * short intervals.
  */
 void gettime(struct timespec *ret);
+void clocktime(struct timespec *ret);
 
 /*
  * arithmetic on times
@@ -31,6 +31,7 @@
 #define _CPU_H_
 
 
+#include <kern/cpustats.h>
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
@@ -61,6 +62,26 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	struct kmalloc_cpucache *c_kmalloc; /* kmalloc's per-cpu caches */
+	vaddr_t c_intrpc;		/* PC the current interrupt came from */
+	struct kprof_ring *c_prof;	/* Profiler samples (see <kprof.h>) */
+	struct ktrace_ring *c_trace;	/* Event trace (see <ktrace.h>) */
+
+	/*
+	 * Written only by this cpu; read by others without locking.
+	 * See <cpustats.h>.
+	 */
+	unsigned c_stats[CPUSTAT_NUM];	/* Event counters */
+
+	/*
+	 * Set once in thread_start_cpus.
+	 *
+	 * A thread that has to leave this cpu right away (see
+	 * thread_setaffinity) Vs c_migratesem to wake this cpu's
+	 * migration thread and then yields; the migration thread runs
+	 * ahead of it and sends it to its cpu once it's off this one.
+	 */
+	struct semaphore *c_migratesem;
 
 	/*
 	 * Accessed by other cpus.
@@ -70,6 +91,16 @@ struct cpu {
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Accessed by other cpus without locking.
+	 *
+	 * Other cpus making one of our threads runnable push it onto
+	 * c_inbox (a lock-free stack linked through t_inboxnext)
+	 * instead of taking c_runqueue_lock; we move the threads onto
+	 * c_runqueue ourselves in thread_switch.
+	 */
+	struct thread *volatile c_inbox;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -112,6 +143,12 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Look up a cpu by its (software) cpu number. Returns NULL if there
+ * is no such cpu.
+ */
+struct cpu *cpu_bynumber(unsigned software_number);
+
 /*
  * Produce a string describing the CPU type.
  */
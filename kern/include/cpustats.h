@@ -0,0 +1,55 @@
+#ifndef _CPUSTATS_H_
+#define _CPUSTATS_H_
+
+/*
+ * Per-cpu event counters.
+ *
+ * Each cpu has its own array of counters (c_stats in struct cpu),
+ * which only that cpu writes, so counting an event needs no lock and
+ * no atomic operation; we only go to splhigh so that an interrupt on
+ * this cpu, or being preempted and moved to another cpu, can't get in
+ * between the load and the store. Readers add up all the cpus'
+ * counters without locking; the totals may be a few events behind.
+ *
+ * The counter numbers are in <kern/cpustats.h>.
+ *
+ * Functions:
+ *     cpustat_add   - add AMOUNT to counter WHICH on the current cpu.
+ *     CPUSTAT_INC   - add one.
+ *     cpustats_get  - copy the counters of one cpu, or the sum over
+ *                     all cpus if CPUNUM is CPUSTAT_ALLCPUS, into
+ *                     COUNTS (which has CPUSTAT_NUM entries).
+ *                     Returns EINVAL if there's no such cpu.
+ *     cpustats_print - print everything.
+ */
+
+#include <kern/cpustats.h>
+#include <cpu.h>
+#include <current.h>
+#include <spl.h>
+
+#ifndef CPUSTATS_INLINE
+#define CPUSTATS_INLINE INLINE
+#endif
+
+CPUSTATS_INLINE void cpustat_add(unsigned which, unsigned amount);
+
+#define CPUSTAT_INC(which) cpustat_add(which, 1)
+
+int cpustats_get(int cpunum, unsigned *counts);
+void cpustats_print(void);
+
+
+CPUSTATS_INLINE
+void
+cpustat_add(unsigned which, unsigned amount)
+{
+	int s;
+
+	s = splhigh();
+	curcpu->c_stats[which] += amount;
+	splx(s);
+}
+
+
+#endif /* _CPUSTATS_H_ */
@@ -0,0 +1,75 @@
+/*
+ * Name lookup cache.
+ */
+
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+struct fs;      /* from <fs.h> */
+struct vnode;   /* from <vnode.h> */
+
+/*
+ * The name cache remembers the results of looking up single path
+ * components, keyed by (directory vnode, name), so vfs_lookup and
+ * vfs_lookparent can walk a path without calling VOP_LOOKUP for
+ * components they've seen recently. A failed lookup (ENOENT) is
+ * cached too, as a negative entry, so searches along a PATH don't
+ * keep asking the filesystem about names that aren't there.
+ *
+ * Each entry holds a reference to its directory and, unless it's
+ * negative, to the vnode the name leads to. The cache has room for
+ * DCACHE_SIZE entries; past that the least recently used is reused.
+ * Names longer than DCACHE_NAMELEN-1 characters aren't cached.
+ *
+ * The cache doesn't know what the filesystems are doing, so whatever
+ * changes a directory has to tell it: vfs_remove, vfs_rename and the
+ * rest call dcache_invalidate for each name they create or destroy,
+ * after the filesystem operation. To keep a lookup that raced with
+ * such a change from putting the old answer back, the caller takes
+ * dcache_getgen before calling VOP_LOOKUP and passes it to
+ * dcache_enter, which drops the entry if anything was invalidated in
+ * between.
+ *
+ * "." and ".." are never cached; vfs_lookup sends them straight to
+ * the filesystem.
+ *
+ * Functions:
+ *     dcache_bootstrap  - set up the cache at boot time.
+ *     dcache_lookup     - look up NAME in DIR. Returns false on a miss.
+ *                         On a hit, returns true and sets *RET to the
+ *                         vnode, with a reference added, or to NULL
+ *                         if the entry is negative.
+ *     dcache_getgen     - get the invalidation count to hand to
+ *                         dcache_enter.
+ *     dcache_enter      - record that NAME in DIR is VN, or doesn't
+ *                         exist if VN is NULL, unless something was
+ *                         invalidated since dcache_getgen returned GEN.
+ *     dcache_invalidate - forget NAME in DIR. (It's actually forgotten
+ *                         in every directory on DIR's filesystem, since
+ *                         emufs can have several vnodes for the same
+ *                         directory.)
+ *     dcache_purgevnode - forget every entry for names in VN and every
+ *                         name leading to VN; for rmdir.
+ *     dcache_purgefs    - forget everything on FS; used at unmount.
+ *     dcache_printstats - print hit and miss counts.
+ */
+
+#define DCACHE_SIZE      128
+#define DCACHE_HASHSIZE  64	/* power of 2 */
+#define DCACHE_NAMELEN   32
+#define DCACHE_DROPBATCH 8	/* references dropped per lock hold */
+
+void dcache_bootstrap(void);
+
+bool dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret);
+unsigned dcache_getgen(void);
+void dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		  unsigned gen);
+void dcache_invalidate(struct vnode *dir, const char *name);
+void dcache_purgevnode(struct vnode *vn);
+void dcache_purgefs(struct fs *fs);
+
+void dcache_printstats(void);
+
+
+#endif /* _DCACHE_H_ */
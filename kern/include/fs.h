@@ -31,6 +31,7 @@
 #define _FS_H_
 
 struct vnode; /* in vnode.h */
+struct uio;   /* in uio.h */
 
 
 /*
@@ -51,6 +52,7 @@ struct fs {
  *      fsop_getvolname - Return volume name of filesystem.
  *      fsop_getroot    - Return root vnode of filesystem.
  *      fsop_unmount    - Attempt unmount of filesystem.
+ *      fsop_blockio    - Read or write blocks on the underlying device.
  *
  * fsop_getvolname may return NULL on filesystem types that don't
  * support the concept of a volume name. The string returned is
@@ -68,12 +70,20 @@ struct fs {
  * consequently the struct fs instance should remain valid. On success,
  * however, the filesystem object and all storage associated with the
  * filesystem should have been discarded/released.
+ *
+ * fsop_blockio is used by the buffer cache (see buf.h) and bypasses
+ * it; filesystems that don't use the buffer cache may leave it NULL.
+ * The uio is in kernel space; its uio_offset is the byte offset on the
+ * device and its uio_resid a multiple of the block size. It may have
+ * several iovecs, so a run of consecutive blocks can be transferred in
+ * one request.
  */
 struct fs_ops {
 	int           (*fsop_sync)(struct fs *);
 	const char   *(*fsop_getvolname)(struct fs *);
 	int           (*fsop_getroot)(struct fs *, struct vnode **);
 	int           (*fsop_unmount)(struct fs *);
+	int           (*fsop_blockio)(struct fs *, struct uio *);
 };
 
 /*
@@ -83,6 +93,7 @@ struct fs_ops {
 #define FSOP_GETVOLNAME(fs)  ((fs)->fs_ops->fsop_getvolname(fs))
 #define FSOP_GETROOT(fs, ret) ((fs)->fs_ops->fsop_getroot(fs, ret))
 #define FSOP_UNMOUNT(fs)     ((fs)->fs_ops->fsop_unmount(fs))
+#define FSOP_BLOCKIO(fs, uio) ((fs)->fs_ops->fsop_blockio(fs, uio))
 
 /* Initialization functions for builtin fake file systems. */
 void semfs_bootstrap(void);
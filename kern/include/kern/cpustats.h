@@ -0,0 +1,24 @@
+#ifndef _KERN_CPUSTATS_H_
+#define _KERN_CPUSTATS_H_
+
+/*
+ * Per-cpu event counters, as returned by the cpustats() system call
+ * (and the cpustats menu command). Each is a 32-bit count that wraps;
+ * take differences between two snapshots.
+ */
+
+#define CPUSTAT_INTERRUPTS   0    /* Hardware interrupts taken */
+#define CPUSTAT_TLBFAULTS    1    /* TLB miss and modify exceptions */
+#define CPUSTAT_PAGEFAULTS   2    /* vm_fault calls that added a page */
+#define CPUSTAT_SYSCALLS     3    /* System calls */
+#define CPUSTAT_SWITCHES     4    /* Context switches */
+#define CPUSTAT_DISKREADS    5    /* Disk sectors read */
+#define CPUSTAT_DISKWRITES   6    /* Disk sectors written */
+
+#define CPUSTAT_NUM          7    /* Number of counters */
+
+/* Pass as the cpu number to get the sum over all cpus. */
+#define CPUSTAT_ALLCPUS      (-1)
+
+
+#endif /* _KERN_CPUSTATS_H_ */
@@ -0,0 +1,46 @@
+#ifndef _KERN_KTRACE_H_
+#define _KERN_KTRACE_H_
+
+/*
+ * Format of the kernel event trace files written by the "trace dump"
+ * menu command. Everything is in the kernel's byte order (big-endian
+ * on System/161); testscripts/ktrace.py decodes it.
+ *
+ * The file is a struct ktrace_header followed by kh_nrecords
+ * records. The records for each cpu come together, oldest first.
+ * Timestamps count cycles on the cpu that took the record; the
+ * counters on different cpus are not synchronized, so only compare
+ * times from the same cpu.
+ */
+
+#define KTRACE_MAGIC    0x6b747263   /* "ktrc" */
+#define KTRACE_VERSION  1
+
+struct ktrace_header {
+	uint32_t kh_magic;		/* KTRACE_MAGIC */
+	uint32_t kh_version;		/* KTRACE_VERSION */
+	uint32_t kh_cyclerate;		/* cycles per second */
+	uint32_t kh_ncpus;		/* number of cpus */
+	uint32_t kh_nrecords;		/* number of records that follow */
+	uint32_t kh_lost;		/* records overwritten before dump */
+};
+
+struct ktrace_record {
+	uint64_t kr_time;		/* cycle count */
+	uint32_t kr_arg;		/* depends on kr_event */
+	uint16_t kr_pid;		/* current process, or 0 */
+	uint8_t kr_event;		/* KTRACE_* */
+	uint8_t kr_cpu;			/* cpu number */
+};
+
+/* Events; the argument recorded with each is shown. */
+#define KTRACE_FAULT         1    /* vm_fault entry; fault address */
+#define KTRACE_FAULTDONE     2    /* vm_fault exit; error code */
+#define KTRACE_SYSCALL       3    /* syscall entry; call number */
+#define KTRACE_SYSCALLDONE   4    /* syscall exit; error code */
+#define KTRACE_SWITCH        5    /* thread switch; previous pid */
+#define KTRACE_DISKSTART     6    /* disk request issued; sector */
+#define KTRACE_DISKDONE      7    /* disk request finished; error code */
+
+
+#endif /* _KERN_KTRACE_H_ */
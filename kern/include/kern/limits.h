@@ -63,11 +63,7 @@
 #define __PATH_MAX      1024
 
 /* Max bytes for an exec function (should be at least 16K) */
-/*
- * UNSW Note: We use max 4K to avoid the frametable allocator needing
- * to deal with greater than 4K allocations
- */
-#define __ARG_MAX       (4 * 1024)
+#define __ARG_MAX       (64 * 1024)
 
 /*
  * Important for system behavior, but not a big part of the API.
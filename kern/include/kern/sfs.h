@@ -41,9 +41,10 @@
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define SFS_NEXTENTS      32            /* # of extents in extent inode */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
@@ -62,6 +63,12 @@
 /* Size of free block bitmap (in blocks) */
 #define SFS_FREEMAPBLOCKS(nblocks)  (SFS_FREEMAPBITS(nblocks)/SFS_BITSPERBLOCK)
 
+/* Superblock flags for sb_flags */
+#define SFS_SBF_EXTENTS   0x1     /* Create new inodes with extents */
+
+/* Inode flags for sfi_flags */
+#define SFS_IF_EXTENTS    0x1     /* Blocks are mapped by sfi_extents */
+
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
@@ -74,11 +81,27 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_flags;			/* SFS_SBF_* above */
+	uint32_t reserved[117];			/* unused, set to 0 */
+};
+
+/*
+ * On-disk extent: LEN disk blocks starting at BLOCK, holding the file
+ * blocks starting at FILEBLOCK.
+ */
+struct sfs_extent {
+	uint32_t sfe_fileblock;			/* First file block */
+	uint32_t sfe_block;			/* First disk block */
+	uint32_t sfe_len;			/* Number of blocks */
 };
 
 /*
  * On-disk inode
+ *
+ * If SFS_IF_EXTENTS is set in sfi_flags, the direct and indirect block
+ * pointers are all zero and the file's blocks are mapped instead by
+ * the first sfi_nextents entries of sfi_extents, which are sorted by
+ * file block and don't overlap; the rest of sfi_extents is zero.
  */
 struct sfs_dinode {
 	uint32_t sfi_size;			/* Size of this file (bytes) */
@@ -86,7 +109,13 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_flags;			/* SFS_IF_* above */
+	uint32_t sfi_nextents;			/* # of extents in use */
+	struct sfs_extent sfi_extents[SFS_NEXTENTS];	/* Extent map */
+	uint32_t sfi_waste[128-7-SFS_NDIRECT-3*SFS_NEXTENTS];
+						/* unused space, set to 0 */
 };
 
 /*
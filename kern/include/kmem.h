@@ -0,0 +1,51 @@
+/*
+ * Typed object caches.
+ */
+
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+/*
+ * A kmem_cache hands out objects of one fixed size, packed exactly
+ * into whole pages ("slabs") rather than rounded up to one of
+ * kmalloc's block sizes.
+ *
+ * If a constructor is given, it's run on each object the first time
+ * the object is handed out, and the destructor is run only when the
+ * slab holding it is given back to the VM system. In between, objects
+ * are expected to be freed in their constructed state, so that things
+ * like embedded locks and wait channels don't have to be created and
+ * destroyed on every use. The constructor returns 0 or an error; if it
+ * fails, kmem_cache_alloc returns NULL.
+ *
+ * Objects must be no larger than KMEM_MAXOBJSIZE; use kmalloc for
+ * anything bigger.
+ *
+ * Functions:
+ *     kmem_cache_create  - create a cache. Returns NULL on failure.
+ *                          The name is copied.
+ *     kmem_cache_destroy - destroy a cache. All its objects must have
+ *                          been freed.
+ *     kmem_cache_alloc   - get an object. Returns NULL if out of memory.
+ *     kmem_cache_free    - give back an object. Must be the same cache
+ *                          it came from.
+ *     kmem_cache_reclaim - give back all spare empty slabs; used
+ *                          when memory is short.
+ *     kmem_cache_printstats - print usage counts for all caches.
+ */
+
+#define KMEM_MAXOBJSIZE 1024
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_cache_reclaim(void);
+void kmem_cache_printstats(void);
+
+
+#endif /* _KMEM_H_ */
@@ -0,0 +1,36 @@
+/*
+ * Sampling kernel profiler.
+ */
+
+#ifndef _KPROF_H_
+#define _KPROF_H_
+
+/*
+ * While the profiler is running, every hardclock() on every cpu
+ * records the PC the timer interrupt came from, along with the pid of
+ * the process that was running, into that cpu's ring buffer. Each
+ * ring holds the most recent KPROF_NSAMPLES samples (about 20 seconds
+ * at HZ=100); older ones are overwritten.
+ *
+ * The kernel has no symbol table, so kprof_dump prints raw addresses
+ * with their sample counts, one "kprof-pc" line per distinct PC per
+ * cpu. Capture the console output and feed it, with the kernel image,
+ * to testscripts/kprof.py to get a histogram by function.
+ *
+ * Functions:
+ *     kprof_start  - clear the buffers and start sampling.
+ *                    Returns ENOMEM or EBUSY on failure.
+ *     kprof_stop   - stop sampling. The samples are kept.
+ *     kprof_dump   - stop sampling if necessary and print the samples.
+ *     kprof_sample - take one sample; called from hardclock().
+ */
+
+#define KPROF_NSAMPLES 2048
+
+int kprof_start(void);
+void kprof_stop(void);
+void kprof_dump(void);
+void kprof_sample(void);
+
+
+#endif /* _KPROF_H_ */
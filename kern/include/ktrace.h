@@ -0,0 +1,46 @@
+/*
+ * Kernel event tracing.
+ */
+
+#ifndef _KTRACE_H_
+#define _KTRACE_H_
+
+/*
+ * Static tracepoints in the fault, syscall, scheduler and disk paths
+ * record binary events (see <kern/ktrace.h>) into a per-cpu ring of
+ * KTRACE_NRECORDS entries, timestamped with the cycle counter. Unlike
+ * DEBUG() or kprintf, nothing goes to the console, so tracing barely
+ * disturbs the timing it is measuring. When tracing is off each
+ * tracepoint costs one load and branch.
+ *
+ * Each ring keeps the most recent KTRACE_NRECORDS events; older ones
+ * are overwritten (and counted as lost when dumped).
+ *
+ * Functions:
+ *     KTRACE       - tracepoint: record EVENT with argument ARG if
+ *                    tracing is on.
+ *     ktrace_start - clear the rings and start tracing. Returns
+ *                    EBUSY or ENOMEM on failure.
+ *     ktrace_stop  - stop tracing. The records are kept.
+ *     ktrace_dump  - stop tracing if necessary and write the records
+ *                    to the file PATH (which is created or truncated).
+ *                    Returns an error code.
+ */
+
+#include <kern/ktrace.h>
+
+#define KTRACE_NRECORDS 2048
+
+extern volatile bool ktrace_enabled;
+
+void ktrace_record(unsigned event, uint32_t arg);
+
+#define KTRACE(event, arg) \
+	do { if (ktrace_enabled) ktrace_record(event, arg); } while (0)
+
+int ktrace_start(void);
+void ktrace_stop(void);
+int ktrace_dump(const char *path);
+
+
+#endif /* _KTRACE_H_ */
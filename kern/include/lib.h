@@ -123,8 +123,8 @@ uint32_t random(void);
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
  *
- * kheap_nextgeneration, dump, and dumpall do nothing unless heap
- * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ * kheap_nextgeneration, dump, dumpall, and profile do nothing unless
+ * heap labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
@@ -132,6 +132,19 @@ void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_profile(void);
+
+/*
+ * Give unused kernel heap pages back to the VM system. Called when
+ * physical memory runs short.
+ */
+void kheap_reclaim(void);
+
+/*
+ * Per-cpu kmalloc state; set up by cpu_create.
+ */
+struct kmalloc_cpucache;
+struct kmalloc_cpucache *kmalloc_cpucache_create(void);
 
 /*
  * C string functions.
@@ -55,6 +55,13 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Cycle counter of the current CPU, and the number of cycles per
+ * second. The counters of different CPUs are not synchronized.
+ */
+uint64_t mainbus_cycles(void);
+uint32_t mainbus_cyclerate(void);
+
 /* Request breaking into the debugger, where available. */
 void mainbus_debugger(void);
 
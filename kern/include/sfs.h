@@ -48,27 +48,66 @@
  */
 #include <kern/sfs.h>
 
+struct sfs_dirindex;	/* private to sfs_dir.c */
+struct sfs_loading;	/* private to sfs_inode.c */
+
 /*
  * In-memory inode
+ *
+ * sv_lock protects sv_i, sv_dirty, the read-ahead state, the indirect
+ * block hint, and (for a directory) the directory's contents and its
+ * index. sv_ino and the type in sv_i don't change once the vnode is
+ * loaded. sv_hashnext belongs to the
+ * vnode table and is protected by its lock.
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
+	struct lock *sv_lock;           /* lock for the above */
+	struct sfs_vnode *sv_hashnext;  /* vnode table chain */
 	bool sv_dirty;                  /* true if sv_i modified */
+	uint32_t sv_ranext;             /* read-ahead: next expected block */
+	uint32_t sv_rawindow;           /* read-ahead: blocks to stay ahead */
+	uint32_t sv_raissued;           /* read-ahead: issued up to here */
+	uint32_t sv_ibhint;             /* last indirect block used, or 0 */
+	uint32_t sv_ibhintbase;         /* first file block it maps */
+	struct sfs_dirindex *sv_dirindex; /* directory: name index, or NULL */
 };
 
 /*
  * In-memory info for a whole fs volume
+ *
+ * Locking: sfs_vnlock protects the vnode table and the list of inodes
+ * being loaded (sfs_loadcv waits for changes to that), and
+ * sfs_freemaplock the freemap; sfs_synclock keeps two syncs from writing out the freemap
+ * at once. The superblock and device don't change after mount. The
+ * lock order is:
+ *
+ *     sfs_synclock
+ *     sv_lock of a directory
+ *     sv_lock of a file in it
+ *     sfs_vnlock
+ *     sfs_freemaplock
+ *
+ * and buffer cache pins come after all the vnode locks. sfs_vnlock
+ * and sfs_freemaplock are never held across disk I/O.
  */
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* lock for the vnode table */
+	struct sfs_vnode **sfs_vnodes;  /* vnodes loaded, hashed by inode */
+	unsigned sfs_vnhashsize;        /* number of chains (power of 2) */
+	unsigned sfs_nvnodes;           /* number of vnodes loaded */
+	struct sfs_loading *sfs_loading; /* inodes being read in */
+	struct cv *sfs_loadcv;          /* to wait for a load to finish */
+	struct lock *sfs_freemaplock;   /* lock for the freemap */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct lock *sfs_synclock;      /* one sfs_sync at a time */
 };
 
 /*
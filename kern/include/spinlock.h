@@ -37,6 +37,7 @@
 
 #include <cdefs.h>
 #include <hangman.h>
+#include "opt-spinstats.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -59,28 +60,46 @@ struct spinlock {
 	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
 	HANGMAN_LOCKABLE(splk_hangman);     /* Deadlock detector hook. */
+#if OPT_SPINSTATS
+	/* Contention statistics; updated only by the holder. */
+	unsigned splk_acquires;		    /* Times acquired. */
+	unsigned splk_contended;	    /* Times we had to spin. */
+	uint64_t splk_spincycles;	    /* Cycles spent spinning. */
+	vaddr_t splk_site;		    /* Caller of first spin. */
+	unsigned splk_slot;		    /* Index+1 in the stats table. */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
+ * (The statistics fields, if any, are left to be zeroed.)
  */
-#ifdef OPT_HANGMAN
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, \
-				  HANGMAN_LOCKABLE_INITIALIZER }
+#if OPT_HANGMAN
+#define SPINLOCK_INITIALIZER	{ .splk_lock = SPINLOCK_DATA_INITIALIZER, \
+				  .splk_holder = NULL, \
+				  .splk_hangman = HANGMAN_LOCKABLE_INITIALIZER }
 #else
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ .splk_lock = SPINLOCK_DATA_INITIALIZER, \
+				  .splk_holder = NULL }
 #endif
 
 /*
  * Spinlock functions.
  *
  * init		Initialize the contents of a spinlock.
- * cleanup	Opposite of init. Lock must be unlocked.
+ * cleanup	Opposite of init. Lock must be unlocked. With
+ *		"options spinstats" this must be called before the
+ *		lock's memory is freed, or the statistics table is
+ *		left pointing at it.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * printstats	Print contention statistics for every spinlock that has
+ *		ever had to spin, busiest first. These are only kept
+ *		if the kernel is configured with "options spinstats".
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -91,5 +110,7 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+void spinlock_printstats(void);
+
 
 #endif /* _SPINLOCK_H_ */
@@ -69,6 +69,14 @@ void V(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
+ * The lock is adaptive: if it is held by a thread that is currently
+ * running on another CPU, lock_acquire spins for a bounded time
+ * waiting for it to be released before going to sleep.
+ *
+ * Contention statistics are kept per lock (under lk_lock) and every
+ * lock is on a global list so they can be dumped with
+ * lock_printstats.
+ *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
  */
@@ -78,6 +86,16 @@ struct lock {
         struct wchan *lk_wchan;
         struct spinlock lk_lock;
         struct thread *volatile lk_holder;
+
+        /* Statistics. */
+        unsigned lk_acquires;           /* Total acquisitions */
+        unsigned lk_contended;          /* Acquisitions that had to wait */
+        unsigned lk_spinacquires;       /* ...of which spinning sufficed */
+        uint64_t lk_waitcycles;         /* Total cycles spent waiting */
+
+        /* Link for the list of all locks. */
+        struct lock *lk_next;
+        struct lock **lk_prevp;
 };
 
 struct lock *lock_create(const char *name);
@@ -98,6 +116,12 @@ void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+/*
+ * Print the contention statistics of all locks. If ALL is false,
+ * only locks that have seen contention are shown.
+ */
+void lock_printstats(bool all);
+
 
 /*
  * Condition variable.
@@ -140,4 +164,98 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers block
+ * until it has had its turn, so a steady stream of readers cannot
+ * starve writers out.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+        char *rw_name;
+        struct wchan *rw_readwchan;     /* Readers sleep here */
+        struct wchan *rw_writewchan;    /* Writers sleep here */
+        struct spinlock rw_lock;
+        volatile unsigned rw_readers;   /* Number of readers holding */
+        volatile unsigned rw_waitingwriters; /* Number of writers waiting */
+        struct thread *volatile rw_writer; /* Writer holding, if any */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. Other threads
+ *                           may be reading at the same time.
+ *    rwlock_release_read  - Free the lock after reading.
+ *    rwlock_acquire_write - Get the lock for writing. Only one thread
+ *                           can hold the lock for writing, and then
+ *                           no thread can hold it for reading.
+ *    rwlock_release_write - Free the lock after writing. Only the
+ *                           thread holding it for writing may do this.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing.
+ *
+ * A thread may not acquire the same rwlock twice, in either mode.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
+/*
+ * Sequence lock.
+ *
+ * For small, frequently read data (such as the time of day) that
+ * readers should be able to snapshot without taking any lock or
+ * making the writer wait. The sequence number is odd while a write is
+ * in progress. A reader notes the number before copying the data and
+ * checks it afterwards; if it changed, the copy may be torn and the
+ * reader goes around again. Writers are serialized by a spinlock, so
+ * they may write from interrupt handlers, but the data must then be
+ * small enough that copying it is quick.
+ *
+ * Seqlocks are not allocated; embed them or use SEQLOCK_INITIALIZER.
+ */
+struct seqlock {
+        struct spinlock sl_lock;        /* Serializes writers */
+        volatile unsigned sl_seq;       /* Odd while writing */
+};
+
+#define SEQLOCK_INITIALIZER { .sl_lock = SPINLOCK_INITIALIZER, .sl_seq = 0 }
+
+void seqlock_init(struct seqlock *);
+void seqlock_cleanup(struct seqlock *);
+
+/*
+ * Operations:
+ *    seqlock_write_begin - Start changing the data. Acquires the
+ *                          spinlock (and so disables interrupts).
+ *    seqlock_write_end   - Done changing the data.
+ *    seqlock_read_begin  - Start reading. Returns a value to pass to
+ *                          seqlock_read_retry.
+ *    seqlock_read_retry  - Returns true if the data may have changed
+ *                          since the matching seqlock_read_begin, in
+ *                          which case the reader must read it again.
+ *
+ * The usual read loop is:
+ *
+ *      do {
+ *              seq = seqlock_read_begin(&sl);
+ *              copy = data;
+ *      } while (seqlock_read_retry(&sl, seq));
+ */
+void seqlock_write_begin(struct seqlock *);
+void seqlock_write_end(struct seqlock *);
+unsigned seqlock_read_begin(struct seqlock *);
+bool seqlock_read_retry(struct seqlock *, unsigned seq);
+
+
 #endif /* _SYNCH_H_ */
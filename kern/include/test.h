@@ -57,6 +57,10 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int rwtest(int, char **);
+int rwbench(int, char **);
+int lockconvoy(int, char **);
+int seqtest(int, char **);
 
 /* semaphore unit tests */
 int semu1(int, char **);
@@ -89,6 +93,8 @@ int writestress(int, char **);
 int writestress2(int, char **);
 int longstress(int, char **);
 int createstress(int, char **);
+int fsbench(int, char **);
+int openbench(int, char **);
 int printfile(int, char **);
 
 /* other tests */
@@ -96,8 +102,16 @@ int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int kmalloctest5(int, char **);
+int kmalloctest6(int, char **);
 int nettest(int, char **);
 
+/* Timing report for the benchmarks. */
+struct timespec;
+void bench_report(const struct timespec *before, const struct timespec *after,
+		  uint64_t count, const char *units, const char *fmt, ...)
+	__PF(5,6);
+
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
 
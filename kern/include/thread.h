@@ -82,6 +82,20 @@ struct thread {
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
+	struct thread *t_inboxnext;	/* Link for cpu's wakeup inbox */
+	bool t_runnext;			/* Put at head of run queue */
+
+	/*
+	 * Scheduling affinity.
+	 *
+	 * t_lastcpu and t_lastran record where and when (in that cpu's
+	 * hardclocks) the thread was last switched out, so migration
+	 * can prefer threads whose cache footprint has gone cold.
+	 * t_affinity, if not NULL, pins the thread to one cpu.
+	 */
+	struct cpu *t_lastcpu;		/* CPU thread last ran on */
+	unsigned t_lastran;		/* When it last ran there */
+	struct cpu *t_affinity;		/* CPU thread is pinned to */
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
@@ -136,7 +150,9 @@ void thread_shutdown(void);
  * will belong to the process "proc", or to the current thread's
  * process if "proc" is null. The "data" arguments (one pointer, one
  * number) are passed to the function. The current thread is used as a
- * prototype for creating the new one. Returns an error code. The
+ * prototype for creating the new one; in particular the new thread
+ * inherits its cpu affinity. Unless pinned, the new thread is placed
+ * on the least loaded cpu. Returns an error code. The
  * thread structure for the new thread is not returned; it is not in
  * general safe to refer to it as the new thread may exit and
  * disappear at any time without notice.
@@ -169,5 +185,12 @@ void schedule(void);
  */
 void thread_consider_migration(void);
 
+/*
+ * Pin the current thread to cpu number CPUNUM, or unpin it if CPUNUM
+ * is -1. If the thread is on the wrong cpu it is moved there before
+ * this returns. Returns EINVAL if there is no such cpu.
+ */
+int thread_setaffinity(int cpunum);
+
 
 #endif /* _THREAD_H_ */
@@ -40,6 +40,7 @@ struct addrspace;
 struct frame_table_entry {
         int ref_count;
         struct frame_table_entry *next_free;
+        unsigned run;   // pages in the allocation this frame starts, if > 1
 };
 
 struct page_table_entry {
@@ -76,5 +76,28 @@ void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeone(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeall(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Wake up one thread and put it at the front of its cpu's run queue,
+ * so it runs as soon as that cpu next switches, instead of waiting
+ * behind everything else that is runnable. Returns the thread woken,
+ * or NULL if there was none. The caller may use the returned thread
+ * to hand over ownership of something protected by LK (e.g. a lock):
+ * the thread may start running right away, but it has to take LK
+ * before it can look, so whatever the caller sets up before releasing
+ * LK is in place by then. (A thread moved here by wchan_requeueone
+ * sleeps under another spinlock and must take LK itself after waking;
+ * cv_wait does.) The thread must not be touched after LK is released.
+ */
+struct thread *wchan_wakeone_handoff(struct wchan *wc, struct spinlock *lk);
+
+/*
+ * Move one thread from WC, protected by LK, to TOWC, protected by
+ * TOLK, without waking it; it wakes when TOWC is woken. The thread
+ * stays asleep in wchan_sleep(WC, LK) and reacquires LK on the way
+ * out, as usual. Both spinlocks must be held.
+ */
+void wchan_requeueone(struct wchan *wc, struct spinlock *lk,
+		      struct wchan *towc, struct spinlock *tolk);
+
 
 #endif /* _WCHAN_H_ */
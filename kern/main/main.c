@@ -45,6 +45,9 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
+#include <buf.h>
+#include <dcache.h>
+#include <openfile.h>
 #include <device.h>
 #include <pid.h>
 #include <syscall.h>
@@ -114,6 +117,9 @@ boot(void)
 	pid_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	buffer_bootstrap();
+	dcache_bootstrap();
+	openfile_bootstrap();
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
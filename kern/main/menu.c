@@ -34,6 +34,12 @@
 #include <kern/wait.h>
 #include <limits.h>
 #include <lib.h>
+#include <kmem.h>
+#include <cpustats.h>
+#include <kprof.h>
+#include <buf.h>
+#include <dcache.h>
+#include <ktrace.h>
 #include <uio.h>
 #include <clock.h>
 #include <mainbus.h>
@@ -467,6 +473,7 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_cache_printstats();
 
 	return 0;
 }
@@ -500,6 +507,137 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_cpustats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	cpustats_print();
+
+	return 0;
+}
+
+static
+int
+cmd_kheapprofile(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_profile();
+
+	return 0;
+}
+
+static
+int
+cmd_kprof(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2 && !strcmp(args[1], "start")) {
+		result = kprof_start();
+		if (result) {
+			kprintf("kprof: %s\n", strerror(result));
+			return result;
+		}
+	}
+	else if (nargs == 2 && !strcmp(args[1], "stop")) {
+		kprof_stop();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "dump")) {
+		kprof_dump();
+	}
+	else {
+		kprintf("Usage: prof start|stop|dump\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_ktrace(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2 && !strcmp(args[1], "start")) {
+		result = ktrace_start();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "stop")) {
+		ktrace_stop();
+		result = 0;
+	}
+	else if (nargs == 3 && !strcmp(args[1], "dump")) {
+		result = ktrace_dump(args[2]);
+	}
+	else {
+		kprintf("Usage: trace start|stop|dump file\n");
+		return EINVAL;
+	}
+
+	if (result) {
+		kprintf("trace: %s\n", strerror(result));
+	}
+	return result;
+}
+
+static
+int
+cmd_spinstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	spinlock_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buffer_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_dcstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	dcache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lock_printstats(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "all")) {
+		lock_printstats(true);
+	}
+	else {
+		kprintf("Usage: lockstats [all]\n");
+	}
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -566,6 +704,8 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] kmalloc scaling benchmark     ",
+	"[km6] Object cache test             ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -576,6 +716,10 @@ static const char *testmenu[] = {
 	"[sy2] Lock test                     ",
 	"[sy3] CV test                       ",
 	"[sy4] CV test #2                    ",
+	"[sy5] RW lock test                  ",
+	"[sy6] RW lock reader benchmark      ",
+	"[sy7] Lock convoy benchmark         ",
+	"[sy8] Seqlock test                  ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[wt]  waitpid test                  ",
 	"[fs1] Filesystem test               ",
@@ -584,6 +728,8 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+	"[fs7] FS throughput benchmark       ",
+	"[fs8] FS open benchmark             ",
 	NULL
 };
 
@@ -606,6 +752,14 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khprof] Kernel heap use by caller  ",
+	"[lockstats] Lock contention stats   ",
+	"[spinstats] Spinlock contention     ",
+	"[cpustats] Per-cpu event counters   ",
+	"[bufstats] Buffer cache stats       ",
+	"[dcstats] Name cache stats          ",
+	"[prof] Sampling profiler            ",
+	"[trace] Kernel event trace          ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +811,14 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khprof",     cmd_kheapprofile },
+	{ "cpustats",   cmd_cpustats },
+	{ "prof",       cmd_kprof },
+	{ "trace",      cmd_ktrace },
+	{ "lockstats",  cmd_lockstats },
+	{ "spinstats",  cmd_spinstats },
+	{ "bufstats",   cmd_bufstats },
+	{ "dcstats",    cmd_dcstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -667,6 +829,8 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
+	{ "km6",	kmalloctest6 },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -679,6 +843,10 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	rwtest },
+	{ "sy6",	rwbench },
+	{ "sy7",	lockconvoy },
+	{ "sy8",	seqtest },
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
@@ -715,6 +883,8 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+	{ "fs7",	fsbench },
+	{ "fs8",	openbench },
 
 	{ NULL, NULL }
 };
@@ -157,3 +157,13 @@ sys_waitpid(pid_t pid, userptr_t retstatus, int flags, pid_t *retval)
 	}
 	return result;
 }
+
+/*
+ * sys_setaffinity
+ * pin the calling thread to one cpu, or unpin it with -1.
+ */
+int
+sys_setaffinity(int cpunum)
+{
+	return thread_setaffinity(cpunum);
+}
@@ -29,6 +29,7 @@
 
 #include <types.h>
 #include <clock.h>
+#include <cpustats.h>
 #include <copyinout.h>
 #include <syscall.h>
 
@@ -41,6 +42,10 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 	struct timespec ts;
 	int result;
 
+	/*
+	 * Not clocktime(): that only moves once per hardclock, and
+	 * user programs use this to time short things.
+	 */
 	gettime(&ts);
 
 	result = copyout(&ts.tv_sec, user_seconds_ptr, sizeof(ts.tv_sec));
@@ -56,3 +61,20 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Snapshot the per-cpu event counters, for benchmarking.
+ */
+int
+sys_cpustats(int cpunum, userptr_t user_counts)
+{
+	unsigned counts[CPUSTAT_NUM];
+	int result;
+
+	result = cpustats_get(cpunum, counts);
+	if (result) {
+		return result;
+	}
+
+	return copyout(counts, user_counts, sizeof(counts));
+}
@@ -0,0 +1,36 @@
+/*
+ * Timing report shared by the benchmarks.
+ */
+
+#include <types.h>
+#include <stdarg.h>
+#include <lib.h>
+#include <clock.h>
+#include <test.h>
+
+/*
+ * Print a line saying what was measured (formatted from FMT), how
+ * long it took from BEFORE to AFTER, and COUNT divided by that time
+ * as UNITS per second.
+ */
+void
+bench_report(const struct timespec *before, const struct timespec *after,
+	     uint64_t count, const char *units, const char *fmt, ...)
+{
+	struct timespec duration;
+	uint64_t nsecs;
+	char what[64];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(what, sizeof(what), fmt, ap);
+	va_end(ap);
+
+	timespec_sub(after, before, &duration);
+	nsecs = (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+	kprintf("%s: %llu.%09lu s, %llu %s/sec\n", what,
+		(unsigned long long)duration.tv_sec,
+		(unsigned long)duration.tv_nsec,
+		(unsigned long long)(nsecs ? count * 1000000000 / nsecs : 0),
+		units);
+}
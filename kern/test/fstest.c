@@ -43,11 +43,13 @@
 #include <kern/fcntl.h>
 #include <lib.h>
 #include <uio.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <buf.h>
 #include <test.h>
 
 #define SLOGAN   "HODIE MIHI - CRAS TIBI\n"
@@ -57,6 +59,11 @@
 #define NLONG    32
 #define NCREATE  24
 
+#define FSBENCH_KB     512		/* default file size for fsbench */
+#define FSBENCH_CHUNK  4096		/* bytes per read/write call */
+#define OPENBENCH_FILES   400		/* default file count for openbench */
+#define OPENBENCH_ROUNDS  4		/* times each file is reopened */
+
 static struct semaphore *threadsem = NULL;
 
 static
@@ -717,6 +724,266 @@ DEFTEST(createstress);
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Sequential throughput benchmark: write a file in FSBENCH_CHUNK-byte
+ * pieces and fsync it, then read it back twice, first with the
+ * filesystem's buffers dropped so it comes off the disk and then
+ * again from the buffer cache. Prints the rate for each pass.
+ */
+
+/*
+ * Read or write the whole file in chunks.
+ */
+static
+int
+fsbench_pass(struct vnode *vn, char *buf, unsigned kbytes, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	off_t pos, end;
+	int err;
+
+	end = (off_t)kbytes * 1024;
+	for (pos = 0; pos < end; pos += FSBENCH_CHUNK) {
+		uio_kinit(&iov, &ku, buf, FSBENCH_CHUNK, pos, rw);
+		err = (rw == UIO_READ) ? VOP_READ(vn, &ku) : VOP_WRITE(vn, &ku);
+		if (err) {
+			return err;
+		}
+		if (ku.uio_resid > 0) {
+			return EIO;
+		}
+	}
+	return 0;
+}
+
+static
+void
+dofsbench(const char *filesys, unsigned kbytes)
+{
+	struct timespec before, after;
+	struct vnode *vn;
+	char name[32];
+	char name2[32];
+	char *buf;
+	int err;
+
+	buf = kmalloc(FSBENCH_CHUNK);
+	if (buf == NULL) {
+		kprintf("fsbench: Out of memory\n");
+		return;
+	}
+	memset(buf, 'f', FSBENCH_CHUNK);
+	kbytes = ROUNDUP(kbytes, FSBENCH_CHUNK / 1024);
+
+	fstest_makename(name, sizeof(name), filesys, "");
+
+	kprintf("*** Starting fs benchmark on %s:\n", filesys);
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(name2, name);
+	err = vfs_open(name2, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s: %s\n", name, strerror(err));
+		kfree(buf);
+		return;
+	}
+
+	gettime(&before);
+	err = fsbench_pass(vn, buf, kbytes, UIO_WRITE);
+	if (!err) {
+		err = VOP_FSYNC(vn);
+	}
+	gettime(&after);
+	if (err) {
+		kprintf("fsbench: write: %s\n", strerror(err));
+		goto done;
+	}
+	bench_report(&before, &after, kbytes, "KB",
+		     "fsbench: %-10s %u KB", "write", kbytes);
+
+	/*
+	 * Flush and forget the cached blocks so the next pass hits disk.
+	 * (If something else is writing to the volume, whatever it has
+	 * dirtied in between stays cached.)
+	 */
+	err = FSOP_SYNC(vn->vn_fs);
+	if (!err && vn->vn_fs->fs_ops->fsop_blockio != NULL) {
+		buffer_dropclean(vn->vn_fs);
+	}
+	if (err) {
+		kprintf("fsbench: sync: %s\n", strerror(err));
+		goto done;
+	}
+
+	gettime(&before);
+	err = fsbench_pass(vn, buf, kbytes, UIO_READ);
+	gettime(&after);
+	if (err) {
+		kprintf("fsbench: read: %s\n", strerror(err));
+		goto done;
+	}
+	bench_report(&before, &after, kbytes, "KB",
+		     "fsbench: %-10s %u KB", "cold read", kbytes);
+
+	gettime(&before);
+	err = fsbench_pass(vn, buf, kbytes, UIO_READ);
+	gettime(&after);
+	if (err) {
+		kprintf("fsbench: read: %s\n", strerror(err));
+		goto done;
+	}
+	bench_report(&before, &after, kbytes, "KB",
+		     "fsbench: %-10s %u KB", "warm read", kbytes);
+
+ done:
+	vfs_close(vn);
+	strcpy(name2, name);
+	vfs_remove(name2);
+	kfree(buf);
+	kprintf("*** fs benchmark done\n");
+}
+
+int
+fsbench(int nargs, char **args)
+{
+	unsigned kbytes = FSBENCH_KB;
+	char *device;
+
+	if (nargs != 2 && nargs != 3) {
+		kprintf("Usage: fs7 filesystem: [kbytes]\n");
+		return EINVAL;
+	}
+	if (nargs == 3) {
+		kbytes = atoi(args[2]);
+		if (kbytes == 0) {
+			kprintf("Usage: fs7 filesystem: [kbytes]\n");
+			return EINVAL;
+		}
+	}
+
+	device = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	dofsbench(device, kbytes);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Open benchmark: create NFILES files and keep them all open, so the
+ * filesystem has that many vnodes loaded, then open and close each of
+ * them OPENBENCH_ROUNDS more times. The reopens are name lookups that
+ * find a vnode already in memory. Prints the rate for each phase.
+ */
+
+static
+void
+openbench_makename(char *buf, size_t buflen, const char *fs, unsigned num)
+{
+	char suffix[16];
+
+	snprintf(suffix, sizeof(suffix), "-%u", num);
+	fstest_makename(buf, buflen, fs, suffix);
+}
+
+static
+void
+doopenbench(const char *filesys, unsigned nfiles)
+{
+	struct timespec before, after;
+	struct vnode **vns, *vn;
+	char name[32];
+	unsigned i, j, made;
+	int err = 0;
+
+	vns = kmalloc(nfiles * sizeof(vns[0]));
+	if (vns == NULL) {
+		kprintf("openbench: Out of memory\n");
+		return;
+	}
+
+	kprintf("*** Starting open benchmark on %s:\n", filesys);
+
+	gettime(&before);
+	for (made=0; made<nfiles; made++) {
+		/* vfs_open destroys the string it's passed */
+		openbench_makename(name, sizeof(name), filesys, made);
+		err = vfs_open(name, O_RDWR|O_CREAT|O_TRUNC, 0664, &vns[made]);
+		if (err) {
+			kprintf("openbench: create %u: %s\n", made,
+				strerror(err));
+			goto done;
+		}
+	}
+	gettime(&after);
+	bench_report(&before, &after, nfiles, "opens",
+		     "openbench: %-8s %u files", "create", nfiles);
+
+	gettime(&before);
+	for (j=0; j<OPENBENCH_ROUNDS; j++) {
+		for (i=0; i<nfiles; i++) {
+			openbench_makename(name, sizeof(name), filesys, i);
+			err = vfs_open(name, O_RDONLY, 0, &vn);
+			if (err) {
+				kprintf("openbench: open %u: %s\n", i,
+					strerror(err));
+				goto done;
+			}
+			vfs_close(vn);
+		}
+	}
+	gettime(&after);
+	bench_report(&before, &after, nfiles * OPENBENCH_ROUNDS, "opens",
+		     "openbench: %-8s %u files", "reopen",
+		     nfiles * OPENBENCH_ROUNDS);
+
+ done:
+	for (i=0; i<made; i++) {
+		vfs_close(vns[i]);
+		openbench_makename(name, sizeof(name), filesys, i);
+		vfs_remove(name);
+	}
+	kfree(vns);
+	kprintf("*** open benchmark done\n");
+}
+
+int
+openbench(int nargs, char **args)
+{
+	unsigned nfiles = OPENBENCH_FILES;
+	char *device;
+
+	if (nargs != 2 && nargs != 3) {
+		kprintf("Usage: fs8 filesystem: [nfiles]\n");
+		return EINVAL;
+	}
+	if (nargs == 3) {
+		nfiles = atoi(args[2]);
+		if (nfiles == 0) {
+			kprintf("Usage: fs8 filesystem: [nfiles]\n");
+			return EINVAL;
+		}
+	}
+
+	device = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	doopenbench(device, nfiles);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
 int
 printfile(int nargs, char **args)
 {
@@ -33,9 +33,11 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
+#include <kmem.h>
 #include <test.h>
 
 #include "opt-dumbvm.h"
@@ -378,3 +380,194 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * kmalloc scaling benchmark. Each thread repeatedly allocates a
+ * handful of small blocks of assorted sizes and frees them again,
+ * which is about what the rest of the kernel does with kmalloc. The
+ * aggregate rate is printed for 1, 2, 4, ... NTHREADS threads; with
+ * the per-cpu magazines it should keep going up until the threads
+ * outnumber the cpus. Run with different cpu counts in sys161.conf
+ * to compare.
+ */
+
+#define KM5_LOOPS  2000
+#define KM5_BATCH  8
+
+static
+void
+kmalloctest5thread(void *sm, unsigned long num)
+{
+	static const unsigned sizes[KM5_BATCH] = {
+		12, 24, 40, 64, 100, 200, 500, 1000
+	};
+	struct semaphore *sem = sm;
+	void *ptrs[KM5_BATCH];
+	unsigned i, j;
+
+	for (i=0; i<KM5_LOOPS; i++) {
+		for (j=0; j<KM5_BATCH; j++) {
+			ptrs[j] = kmalloc(sizes[(j + num) % KM5_BATCH]);
+			if (ptrs[j] == NULL) {
+				panic("kmalloctest5: thread %lu: "
+				      "kmalloc returned NULL\n", num);
+			}
+		}
+		for (j=0; j<KM5_BATCH; j++) {
+			kfree(ptrs[j]);
+		}
+	}
+	V(sem);
+}
+
+int
+kmalloctest5(int nargs, char **args)
+{
+	struct semaphore *sem;
+	struct timespec before, after;
+	unsigned nthreads, i;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	sem = sem_create("kmalloctest5", 0);
+	if (sem == NULL) {
+		panic("kmalloctest5: sem_create failed\n");
+	}
+
+	kprintf("Starting kmalloc scaling benchmark...\n");
+
+	for (nthreads=1; nthreads<=NTHREADS; nthreads*=2) {
+		gettime(&before);
+		for (i=0; i<nthreads; i++) {
+			result = thread_fork("kmalloctest5", NULL,
+					     kmalloctest5thread, sem, i);
+			if (result) {
+				panic("kmalloctest5: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (i=0; i<nthreads; i++) {
+			P(sem);
+		}
+		gettime(&after);
+
+		/* each loop is KM5_BATCH kmallocs and KM5_BATCH kfrees */
+		bench_report(&before, &after,
+			     (uint64_t)nthreads * KM5_LOOPS * KM5_BATCH * 2,
+			     "ops", "%2u threads", nthreads);
+	}
+
+	sem_destroy(sem);
+	kprintf("kmalloc scaling benchmark done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// km6
+
+/*
+ * Object cache test. Allocates enough odd-sized objects to fill
+ * several slabs, checks they don't overlap, frees them, and does it
+ * again, checking that the constructor ran exactly once per object
+ * and that reused objects come back still constructed.
+ */
+
+#define KM6_NOBJS  300
+#define KM6_MAGIC  0x6b6d3621
+
+struct km6obj {
+	uint32_t magic;		/* set by the constructor */
+	unsigned num;
+	char junk[36];
+};
+
+static unsigned km6_ctors;
+
+static
+int
+km6_ctor(void *obj)
+{
+	struct km6obj *ko = obj;
+
+	ko->magic = KM6_MAGIC;
+	km6_ctors++;
+	return 0;
+}
+
+static
+void
+km6_dtor(void *obj)
+{
+	struct km6obj *ko = obj;
+
+	KASSERT(ko->magic == KM6_MAGIC);
+	ko->magic = 0;
+}
+
+int
+kmalloctest6(int nargs, char **args)
+{
+	struct kmem_cache *kc;
+	struct km6obj **objs;
+	unsigned pass, i, firstctors;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting object cache test...\n");
+
+	objs = kmalloc(KM6_NOBJS * sizeof(*objs));
+	if (objs == NULL) {
+		panic("kmalloctest6: Out of memory\n");
+	}
+	kc = kmem_cache_create("km6", sizeof(struct km6obj),
+			       km6_ctor, km6_dtor);
+	if (kc == NULL) {
+		panic("kmalloctest6: kmem_cache_create failed\n");
+	}
+
+	km6_ctors = firstctors = 0;
+	for (pass=0; pass<2; pass++) {
+		for (i=0; i<KM6_NOBJS; i++) {
+			objs[i] = kmem_cache_alloc(kc);
+			if (objs[i] == NULL) {
+				panic("kmalloctest6: kmem_cache_alloc failed\n");
+			}
+			KASSERT(objs[i]->magic == KM6_MAGIC);
+			objs[i]->num = i;
+		}
+		for (i=0; i<KM6_NOBJS; i++) {
+			if (objs[i]->num != i) {
+				panic("kmalloctest6: object %u overwritten\n",
+				      i);
+			}
+		}
+		if (pass == 0) {
+			firstctors = km6_ctors;
+		}
+		kmem_cache_printstats();
+		/* free in a different order than we allocated */
+		for (i=0; i<KM6_NOBJS; i++) {
+			kmem_cache_free(kc, objs[(i * 7) % KM6_NOBJS]);
+		}
+	}
+
+	kmem_cache_destroy(kc);
+	kfree(objs);
+
+	if (firstctors != KM6_NOBJS) {
+		kprintf("%u constructor calls for %u objects\n",
+			firstctors, KM6_NOBJS);
+		kprintf("Object cache test FAILED\n");
+		return 0;
+	}
+	kprintf("%u further constructor calls on reuse\n",
+		km6_ctors - firstctors);
+	kprintf("Object cache test done\n");
+	return 0;
+}
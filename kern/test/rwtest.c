@@ -0,0 +1,373 @@
+/*
+ * Reader-writer lock test code.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define NRWTHREADS      32
+#define NRWLOOPS        60
+#define NREADYIELDS     3
+
+/* Thread counts and iterations for the seqlock test. */
+#define NSEQREADERS     8
+#define NSEQWRITERS     2
+#define NSEQLOOPS       2000
+#define SEQWRITEWORK    50
+
+/* Thread counts and iterations for the reader scaling benchmark. */
+#define RWBENCH_MAXTHREADS  8
+#define RWBENCH_LOOPS       4000
+#define RWBENCH_WORK        200
+
+static struct rwlock *testrw;
+static struct lock *benchlock;
+static struct semaphore *donesem;
+
+static volatile unsigned long testval1;
+static volatile unsigned long testval2;
+
+static struct seqlock testseq = SEQLOCK_INITIALIZER;
+static volatile unsigned seqretries;
+
+/* Who is inside the lock right now; protected by counts_lock. */
+static struct spinlock counts_lock = SPINLOCK_INITIALIZER;
+static unsigned nreading, nwriting, maxreading;
+static volatile bool testfailed;
+
+static
+void
+inititems(void)
+{
+	if (testrw == NULL) {
+		testrw = rwlock_create("testrw");
+		if (testrw == NULL) {
+			panic("rwtest: rwlock_create failed\n");
+		}
+	}
+	if (benchlock == NULL) {
+		benchlock = lock_create("rwbench");
+		if (benchlock == NULL) {
+			panic("rwtest: lock_create failed\n");
+		}
+	}
+	if (donesem == NULL) {
+		donesem = sem_create("donesem", 0);
+		if (donesem == NULL) {
+			panic("rwtest: sem_create failed\n");
+		}
+	}
+}
+
+static
+void
+enter(bool writer)
+{
+	spinlock_acquire(&counts_lock);
+	if (writer) {
+		if (nwriting != 0 || nreading != 0) {
+			testfailed = true;
+		}
+		nwriting++;
+	}
+	else {
+		if (nwriting != 0) {
+			testfailed = true;
+		}
+		nreading++;
+		if (nreading > maxreading) {
+			maxreading = nreading;
+		}
+	}
+	spinlock_release(&counts_lock);
+}
+
+static
+void
+leave(bool writer)
+{
+	spinlock_acquire(&counts_lock);
+	if (writer) {
+		nwriting--;
+	}
+	else {
+		nreading--;
+	}
+	spinlock_release(&counts_lock);
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i, j;
+	bool writer;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		/* One thread in four writes on any given pass. */
+		writer = (num + i) % 4 == 0;
+		if (writer) {
+			rwlock_acquire_write(testrw);
+			enter(true);
+			testval1 = num;
+			thread_yield();
+			testval2 = num * num;
+			leave(true);
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			enter(false);
+			for (j=0; j<NREADYIELDS; j++) {
+				if (testval2 != testval1 * testval1) {
+					kprintf("thread %lu: torn write seen\n",
+						num);
+					testfailed = true;
+				}
+				/* give other readers a chance to pile in */
+				thread_yield();
+			}
+			leave(false);
+			rwlock_release_read(testrw);
+		}
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting rwlock test...\n");
+
+	testval1 = testval2 = 0;
+	nreading = nwriting = maxreading = 0;
+	testfailed = false;
+
+	for (i=0; i<NRWTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NRWTHREADS; i++) {
+		P(donesem);
+	}
+
+	kprintf("Up to %u readers held the lock at once\n", maxreading);
+	if (maxreading < 2) {
+		kprintf("Readers never shared the lock\n");
+		testfailed = true;
+	}
+	kprintf("rwlock test %s\n", testfailed ? "FAILED" : "done");
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Reader scaling benchmark.
+ *
+ * Each thread repeatedly takes the lock for reading, does a short
+ * stretch of work standing in for a table lookup, and lets go. With
+ * an rwlock, the aggregate rate should scale with the number of CPUs;
+ * with a plain lock it cannot. Run with different cpu counts in
+ * sys161.conf to see the difference.
+ */
+
+static
+void
+rwbenchthread(void *uselock, unsigned long num)
+{
+	volatile unsigned j;
+	unsigned i;
+
+	(void)num;
+
+	for (i=0; i<RWBENCH_LOOPS; i++) {
+		if (uselock != NULL) {
+			lock_acquire(benchlock);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+		}
+		for (j=0; j<RWBENCH_WORK; j++);
+		if (uselock != NULL) {
+			lock_release(benchlock);
+		}
+		else {
+			rwlock_release_read(testrw);
+		}
+	}
+	V(donesem);
+}
+
+static
+void
+rwbench_run(const char *what, bool uselock, unsigned nthreads)
+{
+	struct timespec before, after;
+	unsigned i;
+	int result;
+
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("rwbench", NULL, rwbenchthread,
+				     uselock ? benchlock : NULL, i);
+		if (result) {
+			panic("rwbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(donesem);
+	}
+	gettime(&after);
+	bench_report(&before, &after, (uint64_t)nthreads * RWBENCH_LOOPS,
+		     "ops", "%-6s %2u threads", what, nthreads);
+}
+
+int
+rwbench(int nargs, char **args)
+{
+	unsigned n;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting rwlock reader scaling benchmark...\n");
+
+	for (n=1; n<=RWBENCH_MAXTHREADS; n*=2) {
+		rwbench_run("rwlock", false, n);
+		rwbench_run("lock", true, n);
+	}
+
+	kprintf("rwlock benchmark done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Seqlock test.
+ *
+ * Writers store pairs (n, n*n) under the seqlock, dawdling between
+ * the two halves; readers copy the pair without any lock and check
+ * that they never accept a torn copy. They should have to retry now
+ * and then, at least with more than one cpu.
+ */
+
+static
+void
+seqwriterthread(void *junk, unsigned long num)
+{
+	volatile unsigned j;
+	unsigned long n;
+	unsigned i;
+
+	(void)junk;
+
+	for (i=0; i<NSEQLOOPS; i++) {
+		n = i * NSEQWRITERS + num;
+		seqlock_write_begin(&testseq);
+		testval1 = n;
+		for (j=0; j<SEQWRITEWORK; j++);
+		testval2 = n * n;
+		seqlock_write_end(&testseq);
+		if (i % 64 == 0) {
+			thread_yield();
+		}
+	}
+	V(donesem);
+}
+
+static
+void
+seqreaderthread(void *junk, unsigned long num)
+{
+	unsigned long v1, v2;
+	unsigned i, seq, tries;
+
+	(void)junk;
+
+	for (i=0; i<NSEQLOOPS; i++) {
+		tries = 0;
+		do {
+			seq = seqlock_read_begin(&testseq);
+			v1 = testval1;
+			v2 = testval2;
+			tries++;
+		} while (seqlock_read_retry(&testseq, seq));
+
+		if (v2 != v1 * v1) {
+			kprintf("thread %lu: torn read (%lu, %lu)\n",
+				num, v1, v2);
+			testfailed = true;
+		}
+		if (tries > 1) {
+			spinlock_acquire(&counts_lock);
+			seqretries += tries - 1;
+			spinlock_release(&counts_lock);
+		}
+		if (i % 64 == 0) {
+			thread_yield();
+		}
+	}
+	V(donesem);
+}
+
+int
+seqtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting seqlock test...\n");
+
+	testval1 = testval2 = 0;
+	seqretries = 0;
+	testfailed = false;
+
+	for (i=0; i<NSEQWRITERS; i++) {
+		result = thread_fork("seqwriter", NULL, seqwriterthread,
+				     NULL, i);
+		if (result) {
+			panic("seqtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NSEQREADERS; i++) {
+		result = thread_fork("seqreader", NULL, seqreaderthread,
+				     NULL, i);
+		if (result) {
+			panic("seqtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NSEQWRITERS + NSEQREADERS; i++) {
+		P(donesem);
+	}
+
+	kprintf("Readers retried %u times\n", seqretries);
+	kprintf("seqlock test %s\n", testfailed ? "FAILED" : "done");
+
+	return 0;
+}
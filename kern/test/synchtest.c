@@ -300,6 +300,98 @@ cvtest(int nargs, char **args)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Lock convoy benchmark.
+ *
+ * A pile of threads repeatedly take the same lock for a short
+ * critical section and do a bit of work outside it. Report how long
+ * the whole thing took and how long lock_acquire made threads wait,
+ * on average and at worst. The worst case is what gets out of hand
+ * when woken waiters have to queue behind every other runnable
+ * thread before they get to try for the lock.
+ */
+
+#define NCONVOYTHREADS  16
+#define NCONVOYLOOPS    200
+#define CONVOY_INSIDE   100
+#define CONVOY_OUTSIDE  500
+
+/* Protected by testlock. */
+static uint64_t convoy_totalwait;
+static uint64_t convoy_maxwait;
+
+static
+void
+convoythread(void *junk, unsigned long num)
+{
+	struct timespec ts1, ts2;
+	volatile unsigned j;
+	uint64_t wait;
+	unsigned i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NCONVOYLOOPS; i++) {
+		gettime(&ts1);
+		lock_acquire(testlock);
+		gettime(&ts2);
+		timespec_sub(&ts2, &ts1, &ts2);
+		wait = (uint64_t)ts2.tv_sec * 1000000000 + ts2.tv_nsec;
+		convoy_totalwait += wait;
+		if (wait > convoy_maxwait) {
+			convoy_maxwait = wait;
+		}
+		for (j=0; j<CONVOY_INSIDE; j++);
+		lock_release(testlock);
+
+		for (j=0; j<CONVOY_OUTSIDE; j++);
+	}
+	V(donesem);
+}
+
+int
+lockconvoy(int nargs, char **args)
+{
+	struct timespec before, after;
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting lock convoy benchmark...\n");
+
+	convoy_totalwait = convoy_maxwait = 0;
+	gettime(&before);
+	for (i=0; i<NCONVOYTHREADS; i++) {
+		result = thread_fork("convoy", NULL, convoythread, NULL, i);
+		if (result) {
+			panic("lockconvoy: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NCONVOYTHREADS; i++) {
+		P(donesem);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+
+	kprintf("%u acquires in %llu.%09lu seconds\n",
+		NCONVOYTHREADS * NCONVOYLOOPS,
+		(unsigned long long)after.tv_sec,
+		(unsigned long)after.tv_nsec);
+	kprintf("Average wait %llu ns, worst wait %llu ns\n",
+		(unsigned long long)(convoy_totalwait /
+				     (NCONVOYTHREADS * NCONVOYLOOPS)),
+		(unsigned long long)convoy_maxwait);
+	kprintf("Lock convoy benchmark done.\n");
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Try to find out if going to sleep is really atomic.
  *
@@ -30,10 +30,12 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <synch.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <kprof.h>
 
 /*
  * Time handling.
@@ -59,6 +61,16 @@
 static struct wchan *lbolt;
 static struct spinlock lbolt_lock;
 
+/*
+ * The kernel's copy of the time of day, for clocktime(). Readers use
+ * the seqlock and never block the writers, which are hardclock on cpu
+ * 0 and timerclock. Until timerclock first runs it is not valid and
+ * clocktime falls back to asking the device.
+ */
+static struct seqlock kerneltime_seqlock = SEQLOCK_INITIALIZER;
+static struct timespec kerneltime;
+static bool kerneltime_valid;
+
 /*
  * Setup.
  */
@@ -79,7 +91,24 @@ hardclock_bootstrap(void)
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
+	struct timespec now;
+
+	/*
+	 * Resynchronize the kernel time with the clock device, but
+	 * never step it backwards.
+	 */
+	gettime(&now);
+	seqlock_write_begin(&kerneltime_seqlock);
+	if (!kerneltime_valid ||
+	    now.tv_sec > kerneltime.tv_sec ||
+	    (now.tv_sec == kerneltime.tv_sec &&
+	     now.tv_nsec > kerneltime.tv_nsec)) {
+		kerneltime = now;
+	}
+	kerneltime_valid = true;
+	seqlock_write_end(&kerneltime_seqlock);
+
+	/* Broadcast on lbolt */
 	spinlock_acquire(&lbolt_lock);
 	wchan_wakeall(lbolt, &lbolt_lock);
 	spinlock_release(&lbolt_lock);
@@ -97,6 +126,17 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+	kprof_sample();
+	if (curcpu->c_number == 0) {
+		/* Advance the kernel time by one tick. */
+		seqlock_write_begin(&kerneltime_seqlock);
+		kerneltime.tv_nsec += 1000000000 / HZ;
+		if (kerneltime.tv_nsec >= 1000000000) {
+			kerneltime.tv_nsec -= 1000000000;
+			kerneltime.tv_sec++;
+		}
+		seqlock_write_end(&kerneltime_seqlock);
+	}
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
@@ -106,6 +146,26 @@ hardclock(void)
 	thread_yield();
 }
 
+/*
+ * Get the kernel's copy of the time of day.
+ */
+void
+clocktime(struct timespec *ret)
+{
+	unsigned seq;
+	bool valid;
+
+	do {
+		seq = seqlock_read_begin(&kerneltime_seqlock);
+		valid = kerneltime_valid;
+		*ret = kerneltime;
+	} while (seqlock_read_retry(&kerneltime_seqlock, seq));
+
+	if (!valid) {
+		gettime(ret);
+	}
+}
+
 /*
  * Suspend execution for n seconds.
  */
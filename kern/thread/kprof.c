@@ -0,0 +1,203 @@
+/*
+ * Sampling kernel profiler (see kprof.h).
+ *
+ * Each cpu has its own ring, written only from that cpu's hardclock()
+ * with interrupts off, so sampling never contends with anything. The
+ * per-ring spinlock exists only so kprof_stop can wait out a sample
+ * that is in progress on another cpu before the rings are read.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <thread.h>
+#include <proc.h>
+#include <current.h>
+#include <pid.h>
+#include <vm.h>
+#include <kprof.h>
+
+struct kprof_sample {
+	vaddr_t ks_pc;			/* interrupted PC */
+	pid_t ks_pid;			/* process running at the time */
+};
+
+struct kprof_ring {
+	struct spinlock kr_lock;
+	unsigned kr_total;		/* samples taken since start */
+	struct kprof_sample kr_samples[KPROF_NSAMPLES];
+};
+
+/* Number of distinct pids kprof_dump reports separately. */
+#define KPROF_MAXPIDS 32
+
+static volatile bool kprof_running;
+
+/*
+ * Called from hardclock() on every tick.
+ */
+void
+kprof_sample(void)
+{
+	struct kprof_ring *kr;
+	struct kprof_sample *ks;
+
+	if (!kprof_running) {
+		return;
+	}
+	kr = curcpu->c_prof;
+	if (kr == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&kr->kr_lock);
+	if (kprof_running) {
+		ks = &kr->kr_samples[kr->kr_total % KPROF_NSAMPLES];
+		ks->ks_pc = curcpu->c_intrpc;
+		ks->ks_pid = curproc != NULL ? curproc->p_pid : INVALID_PID;
+		kr->kr_total++;
+	}
+	spinlock_release(&kr->kr_lock);
+}
+
+int
+kprof_start(void)
+{
+	struct kprof_ring *kr;
+	struct cpu *c;
+	unsigned i;
+
+	if (kprof_running) {
+		return EBUSY;
+	}
+
+	for (i=0; (c = cpu_bynumber(i)) != NULL; i++) {
+		kr = c->c_prof;
+		if (kr == NULL) {
+			/* Samplers don't look at c_prof until we start. */
+			kr = kmalloc(sizeof(*kr));
+			if (kr == NULL) {
+				return ENOMEM;
+			}
+			spinlock_init(&kr->kr_lock);
+			kr->kr_total = 0;
+			c->c_prof = kr;
+		}
+		spinlock_acquire(&kr->kr_lock);
+		kr->kr_total = 0;
+		spinlock_release(&kr->kr_lock);
+	}
+
+	membar_store_store();
+	kprof_running = true;
+	return 0;
+}
+
+void
+kprof_stop(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	kprof_running = false;
+	membar_any_any();
+
+	/* Wait for any sample already under way to finish. */
+	for (i=0; (c = cpu_bynumber(i)) != NULL; i++) {
+		if (c->c_prof != NULL) {
+			spinlock_acquire(&c->c_prof->kr_lock);
+			spinlock_release(&c->c_prof->kr_lock);
+		}
+	}
+}
+
+/*
+ * Sort samples by PC (shell sort; no qsort in the kernel).
+ */
+static
+void
+kprof_sort(struct kprof_sample *s, unsigned n)
+{
+	struct kprof_sample tmp;
+	unsigned gap, i, j;
+
+	for (gap = n/2; gap > 0; gap /= 2) {
+		for (i=gap; i<n; i++) {
+			tmp = s[i];
+			for (j=i; j>=gap && s[j-gap].ks_pc > tmp.ks_pc; j-=gap) {
+				s[j] = s[j-gap];
+			}
+			s[j] = tmp;
+		}
+	}
+}
+
+void
+kprof_dump(void)
+{
+	struct {
+		pid_t pid;
+		unsigned count;
+	} pids[KPROF_MAXPIDS];
+	struct kprof_ring *kr;
+	struct kprof_sample *s;
+	struct cpu *c;
+	unsigned i, j, k, n, npids;
+	unsigned total, kept, user, otherpids;
+
+	if (kprof_running) {
+		kprof_stop();
+	}
+
+	total = kept = user = otherpids = 0;
+	npids = 0;
+	for (i=0; (c = cpu_bynumber(i)) != NULL; i++) {
+		kr = c->c_prof;
+		if (kr == NULL) {
+			continue;
+		}
+		n = kr->kr_total < KPROF_NSAMPLES ? kr->kr_total
+			: KPROF_NSAMPLES;
+		total += kr->kr_total;
+		kept += n;
+
+		s = kr->kr_samples;
+		kprof_sort(s, n);
+		for (j=0; j<n; j=k) {
+			for (k=j+1; k<n && s[k].ks_pc == s[j].ks_pc; k++);
+			if (s[j].ks_pc < USERSPACETOP) {
+				user += k - j;
+				continue;
+			}
+			kprintf("kprof-pc %u 0x%08lx %u\n", c->c_number,
+				(unsigned long)s[j].ks_pc, k - j);
+		}
+
+		for (j=0; j<n; j++) {
+			for (k=0; k<npids && pids[k].pid != s[j].ks_pid; k++);
+			if (k == npids) {
+				if (npids == KPROF_MAXPIDS) {
+					otherpids++;
+					continue;
+				}
+				pids[k].pid = s[j].ks_pid;
+				pids[k].count = 0;
+				npids++;
+			}
+			pids[k].count++;
+		}
+	}
+
+	for (k=0; k<npids; k++) {
+		kprintf("kprof-pid %d %u%s\n", pids[k].pid, pids[k].count,
+			pids[k].pid == KERNEL_PID ? " (kernel)" : "");
+	}
+	if (otherpids > 0) {
+		kprintf("kprof-pid other %u\n", otherpids);
+	}
+	kprintf("kprof: %u samples, %u kept, %u in user mode\n",
+		total, kept, user);
+}
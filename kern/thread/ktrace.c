@@ -0,0 +1,215 @@
+/*
+ * Kernel event tracing (see ktrace.h).
+ *
+ * Each cpu has its own ring of records. Tracepoints normally write
+ * only the ring of the cpu they run on, but a thread can be moved to
+ * another cpu between looking up curcpu and taking the ring's lock,
+ * so the ring is written under its spinlock rather than merely at
+ * splhigh. The lock also lets ktrace_stop wait out a record that is
+ * being written on another cpu.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <thread.h>
+#include <proc.h>
+#include <current.h>
+#include <mainbus.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <ktrace.h>
+
+struct ktrace_ring {
+	struct spinlock tr_lock;
+	unsigned tr_total;		/* records taken since start */
+	struct ktrace_record tr_records[KTRACE_NRECORDS];
+};
+
+volatile bool ktrace_enabled;
+
+/*
+ * Tracepoint body; called via KTRACE().
+ */
+void
+ktrace_record(unsigned event, uint32_t arg)
+{
+	struct ktrace_ring *tr;
+	struct ktrace_record *r;
+
+	tr = curcpu->c_trace;
+	if (tr == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&tr->tr_lock);
+	if (ktrace_enabled) {
+		r = &tr->tr_records[tr->tr_total % KTRACE_NRECORDS];
+		r->kr_time = mainbus_cycles();
+		r->kr_arg = arg;
+		r->kr_pid = curproc != NULL ? curproc->p_pid : 0;
+		r->kr_event = event;
+		r->kr_cpu = curcpu->c_number;
+		tr->tr_total++;
+	}
+	spinlock_release(&tr->tr_lock);
+}
+
+int
+ktrace_start(void)
+{
+	struct ktrace_ring *tr;
+	struct cpu *c;
+	unsigned i;
+
+	if (ktrace_enabled) {
+		return EBUSY;
+	}
+
+	for (i=0; (c = cpu_bynumber(i)) != NULL; i++) {
+		tr = c->c_trace;
+		if (tr == NULL) {
+			/* Tracepoints don't look at c_trace until we start. */
+			tr = kmalloc(sizeof(*tr));
+			if (tr == NULL) {
+				return ENOMEM;
+			}
+			spinlock_init(&tr->tr_lock);
+			tr->tr_total = 0;
+			c->c_trace = tr;
+		}
+		spinlock_acquire(&tr->tr_lock);
+		tr->tr_total = 0;
+		spinlock_release(&tr->tr_lock);
+	}
+
+	membar_store_store();
+	ktrace_enabled = true;
+	return 0;
+}
+
+void
+ktrace_stop(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	ktrace_enabled = false;
+	membar_any_any();
+
+	/* Wait for any record already being written to finish. */
+	for (i=0; (c = cpu_bynumber(i)) != NULL; i++) {
+		if (c->c_trace != NULL) {
+			spinlock_acquire(&c->c_trace->tr_lock);
+			spinlock_release(&c->c_trace->tr_lock);
+		}
+	}
+}
+
+/*
+ * Append LEN bytes to the dump file.
+ */
+static
+int
+ktrace_write(struct vnode *vn, off_t *pos, const void *buf, size_t len)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, (void *)buf, len, *pos, UIO_WRITE);
+	result = VOP_WRITE(vn, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return ENOSPC;
+	}
+	*pos += len;
+	return 0;
+}
+
+int
+ktrace_dump(const char *path)
+{
+	struct ktrace_header kh;
+	struct ktrace_ring *tr;
+	struct vnode *vn;
+	struct cpu *c;
+	char *pathcopy;
+	unsigned i, n, first;
+	off_t pos;
+	int result;
+
+	if (ktrace_enabled) {
+		ktrace_stop();
+	}
+
+	kh.kh_magic = KTRACE_MAGIC;
+	kh.kh_version = KTRACE_VERSION;
+	kh.kh_cyclerate = mainbus_cyclerate();
+	kh.kh_ncpus = 0;
+	kh.kh_nrecords = 0;
+	kh.kh_lost = 0;
+	for (i=0; (c = cpu_bynumber(i)) != NULL; i++) {
+		kh.kh_ncpus++;
+		tr = c->c_trace;
+		if (tr == NULL) {
+			continue;
+		}
+		if (tr->tr_total > KTRACE_NRECORDS) {
+			kh.kh_nrecords += KTRACE_NRECORDS;
+			kh.kh_lost += tr->tr_total - KTRACE_NRECORDS;
+		}
+		else {
+			kh.kh_nrecords += tr->tr_total;
+		}
+	}
+
+	/* vfs_open destroys the path it's given */
+	pathcopy = kstrdup(path);
+	if (pathcopy == NULL) {
+		return ENOMEM;
+	}
+	result = vfs_open(pathcopy, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+	kfree(pathcopy);
+	if (result) {
+		return result;
+	}
+
+	pos = 0;
+	result = ktrace_write(vn, &pos, &kh, sizeof(kh));
+	for (i=0; result == 0 && (c = cpu_bynumber(i)) != NULL; i++) {
+		tr = c->c_trace;
+		if (tr == NULL || tr->tr_total == 0) {
+			continue;
+		}
+		if (tr->tr_total <= KTRACE_NRECORDS) {
+			n = tr->tr_total;
+			result = ktrace_write(vn, &pos, tr->tr_records,
+					      n * sizeof(tr->tr_records[0]));
+			continue;
+		}
+
+		/* The ring has wrapped; the oldest record is at FIRST. */
+		first = tr->tr_total % KTRACE_NRECORDS;
+		result = ktrace_write(vn, &pos, &tr->tr_records[first],
+			(KTRACE_NRECORDS - first) * sizeof(tr->tr_records[0]));
+		if (result == 0) {
+			result = ktrace_write(vn, &pos, tr->tr_records,
+				first * sizeof(tr->tr_records[0]));
+		}
+	}
+
+	vfs_close(vn);
+	if (result == 0) {
+		kprintf("trace: %u records written to %s (%u lost)\n",
+			kh.kh_nrecords, path, kh.kh_lost);
+	}
+	return result;
+}
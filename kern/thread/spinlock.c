@@ -30,6 +30,7 @@
 /* Make sure to build out-of-line versions of inline functions */
 #define SPINLOCK_INLINE   /* empty */
 #define MEMBAR_INLINE     /* empty */
+#define ATOMIC_INLINE     /* empty */
 
 #include <types.h>
 #include <lib.h>
@@ -37,12 +38,71 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <membar.h>
+#include <atomic.h>
 #include <current.h>	/* for curcpu */
+#include <mainbus.h>	/* for mainbus_cycles */
 
 /*
  * Spinlocks.
  */
 
+/*
+ * Bounds, in iterations of an empty loop, for the exponential backoff
+ * after seeing the lock held. Backing off keeps waiting cpus from
+ * hammering the lock word (and the bus) while the holder is trying to
+ * get its work done.
+ */
+#define SPINLOCK_BACKOFF_MIN  4
+#define SPINLOCK_BACKOFF_MAX  1024
+
+#if OPT_SPINSTATS
+/*
+ * Table of every spinlock that has ever had to spin, for
+ * spinlock_printstats. Slots are claimed with compare-and-swap since
+ * we can't very well take a spinlock in here; a lock whose slot
+ * number is SPINSTATS_NOSLOT found the table full and isn't shown.
+ * spinlock_cleanup empties a lock's slot, so every spinlock must be
+ * cleaned up before its memory is freed or reused; otherwise the
+ * table points at garbage and spinlock_printstats reads it.
+ */
+#define SPINSTATS_MAX     256
+#define SPINSTATS_NOSLOT  ((unsigned)-1)
+
+static struct spinlock *volatile spinstats_table[SPINSTATS_MAX];
+
+static
+void
+spinstats_register(struct spinlock *splk, vaddr_t site)
+{
+	unsigned i;
+
+	splk->splk_site = site;
+	for (i=0; i<SPINSTATS_MAX; i++) {
+		if (spinstats_table[i] == NULL &&
+		    atomic_casptr((void *volatile *)&spinstats_table[i],
+				  NULL, splk)) {
+			splk->splk_slot = i + 1;
+			return;
+		}
+	}
+	splk->splk_slot = SPINSTATS_NOSLOT;
+}
+#endif
+
+/*
+ * Wait a while before looking at the lock again.
+ */
+static
+void
+spinlock_backoff(unsigned iterations)
+{
+	volatile unsigned i;
+
+	for (i=0; i<iterations; i++) {
+		/* nothing */
+	}
+}
+
 
 /*
  * Initialize spinlock.
@@ -53,6 +113,13 @@ spinlock_init(struct spinlock *splk)
 	spinlock_data_set(&splk->splk_lock, 0);
 	splk->splk_holder = NULL;
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
+#if OPT_SPINSTATS
+	splk->splk_acquires = 0;
+	splk->splk_contended = 0;
+	splk->splk_spincycles = 0;
+	splk->splk_site = 0;
+	splk->splk_slot = 0;
+#endif
 }
 
 /*
@@ -63,6 +130,11 @@ spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
 	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+#if OPT_SPINSTATS
+	if (splk->splk_slot != 0 && splk->splk_slot != SPINSTATS_NOSLOT) {
+		spinstats_table[splk->splk_slot - 1] = NULL;
+	}
+#endif
 }
 
 /*
@@ -70,12 +142,18 @@ spinlock_cleanup(struct spinlock *splk)
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
  * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * atomic operation to wait for the lock to be free, backing off a
+ * little longer each time we find it taken.
  */
 void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	unsigned backoff;
+#if OPT_SPINSTATS
+	uint64_t spinstart = 0;
+	bool spun = false;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -93,6 +171,7 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
+	backoff = SPINLOCK_BACKOFF_MIN;
 	while (1) {
 		/*
 		 * Do test-test-and-set, that is, read first before
@@ -104,18 +183,39 @@ spinlock_acquire(struct spinlock *splk)
 		 * previously unheld and we now own it. If it was 1,
 		 * we don't.
 		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
+		if (spinlock_data_get(&splk->splk_lock) == 0 &&
+		    spinlock_data_testandset(&splk->splk_lock) == 0) {
+			break;
 		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
+
+#if OPT_SPINSTATS
+		if (!spun && mycpu != NULL) {
+			spun = true;
+			spinstart = mainbus_cycles();
+		}
+#endif
+		spinlock_backoff(backoff);
+		if (backoff < SPINLOCK_BACKOFF_MAX) {
+			backoff *= 2;
 		}
-		break;
 	}
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
 
+#if OPT_SPINSTATS
+	/* We hold the lock now, so we can update its counters. */
+	splk->splk_acquires++;
+	if (spun) {
+		splk->splk_contended++;
+		splk->splk_spincycles += mainbus_cycles() - spinstart;
+		if (splk->splk_slot == 0) {
+			spinstats_register(splk,
+				(vaddr_t)__builtin_return_address(0));
+		}
+	}
+#endif
+
 	if (CURCPU_EXISTS()) {
 		HANGMAN_ACQUIRE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
@@ -154,3 +254,52 @@ spinlock_do_i_hold(struct spinlock *splk)
 	/* Assume we can read splk_holder atomically enough for this to work */
 	return (splk->splk_holder == curcpu->c_self);
 }
+
+/*
+ * Print the contention statistics.
+ */
+void
+spinlock_printstats(void)
+{
+#if OPT_SPINSTATS
+	struct spinlock *locks[SPINSTATS_MAX], *tmp;
+	unsigned i, j, n;
+
+	/* Copy the table out, then sort by time spent spinning. */
+	n = 0;
+	for (i=0; i<SPINSTATS_MAX; i++) {
+		/* (skip slots freed by spinlock_cleanup) */
+		if (spinstats_table[i] != NULL &&
+		    spinstats_table[i]->splk_contended > 0) {
+			locks[n++] = spinstats_table[i];
+		}
+	}
+	for (i=1; i<n; i++) {
+		tmp = locks[i];
+		for (j=i; j>0 && locks[j-1]->splk_spincycles <
+			     tmp->splk_spincycles; j--) {
+			locks[j] = locks[j-1];
+		}
+		locks[j] = tmp;
+	}
+
+	/*
+	 * Locks have no names; resolve the lock and first-spin caller
+	 * addresses against the kernel with nm.
+	 */
+	kprintf("%-10s %-10s %10s %10s %14s %10s\n", "spinlock", "site",
+		"acquires", "contended", "spin cycles", "avg spin");
+	for (i=0; i<n; i++) {
+		kprintf("%p 0x%08lx %10u %10u %14llu %10llu\n",
+			locks[i], (unsigned long)locks[i]->splk_site,
+			locks[i]->splk_acquires, locks[i]->splk_contended,
+			(unsigned long long)locks[i]->splk_spincycles,
+			(unsigned long long)(locks[i]->splk_spincycles /
+					     locks[i]->splk_contended));
+	}
+	kprintf("%u spinlocks have spun\n", n);
+#else
+	kprintf("Spinlock statistics are not enabled; "
+		"configure the kernel with \"options spinstats\".\n");
+#endif
+}
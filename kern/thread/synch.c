@@ -35,7 +35,10 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <membar.h>
+#include <cpu.h>
 #include <wchan.h>
+#include <mainbus.h>	/* for mainbus_cycles */
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
@@ -138,6 +141,19 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Maximum number of times around the spin loop in lock_acquire
+ * before giving up and going to sleep. At 25 MHz this is on the order
+ * of the cost of a context switch.
+ */
+#define LOCK_MAXSPINS  1000
+
+/*
+ * List of all locks, for lock_printstats.
+ */
+static struct lock *alllocks;
+static struct spinlock alllocks_lock = SPINLOCK_INITIALIZER;
+
 struct lock *
 lock_create(const char *name)
 {
@@ -165,6 +181,20 @@ lock_create(const char *name)
 	spinlock_init(&lock->lk_lock);
 	lock->lk_holder = NULL;
 
+	lock->lk_acquires = 0;
+	lock->lk_contended = 0;
+	lock->lk_spinacquires = 0;
+	lock->lk_waitcycles = 0;
+
+	spinlock_acquire(&alllocks_lock);
+	lock->lk_next = alllocks;
+	if (alllocks != NULL) {
+		alllocks->lk_prevp = &lock->lk_next;
+	}
+	lock->lk_prevp = &alllocks;
+	alllocks = lock;
+	spinlock_release(&alllocks_lock);
+
 	return lock;
 }
 
@@ -174,6 +204,14 @@ lock_destroy(struct lock *lock)
 	KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
+
+	spinlock_acquire(&alllocks_lock);
+	*lock->lk_prevp = lock->lk_next;
+	if (lock->lk_next != NULL) {
+		lock->lk_next->lk_prevp = lock->lk_prevp;
+	}
+	spinlock_release(&alllocks_lock);
+
 	spinlock_cleanup(&lock->lk_lock);
 	wchan_destroy(lock->lk_wchan);
 
@@ -181,9 +219,33 @@ lock_destroy(struct lock *lock)
 	kfree(lock);
 }
 
+/*
+ * Check if the holder of a lock is running on some other cpu, in
+ * which case it is likely to release the lock soon and it is worth
+ * spinning for it. Must hold lk_lock, which keeps the holder from
+ * going away underneath us.
+ */
+static
+bool
+lock_holder_oncpu(struct lock *lock)
+{
+	struct thread *holder;
+
+	KASSERT(spinlock_do_i_hold(&lock->lk_lock));
+
+	holder = lock->lk_holder;
+	return holder != NULL && holder->t_state == S_RUN &&
+		holder->t_cpu != curcpu->c_self;
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+	uint64_t before, after;
+	unsigned spins;
+	bool slept;
+
 	DEBUGASSERT(lock != NULL);
 	KASSERT(curthread->t_in_interrupt == false);
 
@@ -193,11 +255,54 @@ lock_acquire(struct lock *lock)
 	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 
 	KASSERT(lock->lk_holder != curthread);
-	while (lock->lk_holder != NULL) {
-		/* As in the semaphore. */
-		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+	if (lock->lk_holder != NULL) {
+		/*
+		 * Time the wait with the cycle counter; it's cheap,
+		 * unlike the clock device. If we migrated while asleep
+		 * the two readings come from different (unsynchronized)
+		 * counters, so don't count the wait if it looks negative.
+		 */
+		before = mainbus_cycles();
+		spins = 0;
+		slept = false;
+		/*
+		 * lock_release may hand the lock straight to us while
+		 * we sleep, in which case we find ourselves the holder.
+		 */
+		while (lock->lk_holder != NULL &&
+		       lock->lk_holder != curthread) {
+			if (spins < LOCK_MAXSPINS && lock_holder_oncpu(lock)) {
+				/*
+				 * Spin (without the spinlock, and
+				 * with interrupts on) until the
+				 * holder changes or we run out of
+				 * patience, then look again.
+				 */
+				holder = lock->lk_holder;
+				spinlock_release(&lock->lk_lock);
+				while (lock->lk_holder == holder &&
+				       spins < LOCK_MAXSPINS) {
+					spins++;
+				}
+				spinlock_acquire(&lock->lk_lock);
+				continue;
+			}
+			/* As in the semaphore. */
+			wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+			slept = true;
+		}
+		after = mainbus_cycles();
+
+		lock->lk_contended++;
+		if (!slept) {
+			lock->lk_spinacquires++;
+		}
+		if (after > before) {
+			lock->lk_waitcycles += after - before;
+		}
 	}
 	lock->lk_holder = curthread;
+	lock->lk_acquires++;
 
 	/* Call this (atomically) once the lock is acquired */
 	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
@@ -213,8 +318,14 @@ lock_release(struct lock *lock)
 	spinlock_acquire(&lock->lk_lock);
 
 	KASSERT(lock->lk_holder == curthread);
-	lock->lk_holder = NULL;
-	wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
+	/*
+	 * If anyone is waiting, give the lock directly to the first
+	 * waiter and have it run next, rather than letting it queue
+	 * up behind everything else only to find the lock taken again
+	 * when it finally runs. This keeps convoys from building up.
+	 */
+	lock->lk_holder = wchan_wakeone_handoff(lock->lk_wchan,
+						&lock->lk_lock);
 
 	/* Call this (atomically) when the lock is released */
 	HANGMAN_RELEASE(&curthread->t_hangman, &lock->lk_hangman);
@@ -236,6 +347,38 @@ lock_do_i_hold(struct lock *lock)
 	return ret;
 }
 
+/*
+ * Print lock statistics. The counters are read without their locks;
+ * this is only a diagnostic, so slightly stale numbers are fine.
+ */
+void
+lock_printstats(bool all)
+{
+	struct lock *lock;
+	unsigned shown = 0, total = 0;
+
+	/* print the whole thing with interrupts off */
+	spinlock_acquire(&alllocks_lock);
+
+	kprintf("%-10s %-20s %10s %10s %10s %14s\n", "lock", "name",
+		"acquires", "contended", "spun", "wait (cycles)");
+	for (lock = alllocks; lock != NULL; lock = lock->lk_next) {
+		total++;
+		if (lock->lk_contended == 0 &&
+		    !(all && lock->lk_acquires > 0)) {
+			continue;
+		}
+		shown++;
+		kprintf("%p %-20.20s %10u %10u %10u %14llu\n",
+			lock, lock->lk_name, lock->lk_acquires,
+			lock->lk_contended, lock->lk_spinacquires,
+			(unsigned long long)lock->lk_waitcycles);
+	}
+	kprintf("%u of %u locks shown\n", shown, total);
+
+	spinlock_release(&alllocks_lock);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
@@ -280,6 +423,31 @@ cv_destroy(struct cv *cv)
 	kfree(cv);
 }
 
+/*
+ * Finish reacquiring LOCK at the end of cv_wait. If cv_signal moved
+ * us onto the lock's wait channel, lock_release has already made us
+ * the holder, so there's only the bookkeeping lock_acquire would have
+ * done. (That doesn't count as contended: we don't know how much of
+ * the sleep was spent waiting for the lock rather than the CV, so
+ * there's no wait time to go with it.) Otherwise we were woken
+ * directly and acquire it as usual.
+ */
+static
+void
+lock_reacquire(struct lock *lock)
+{
+	spinlock_acquire(&lock->lk_lock);
+	if (lock->lk_holder == curthread) {
+		HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+		lock->lk_acquires++;
+		HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+		spinlock_release(&lock->lk_lock);
+		return;
+	}
+	spinlock_release(&lock->lk_lock);
+	lock_acquire(lock);
+}
+
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
@@ -295,15 +463,28 @@ cv_wait(struct cv *cv, struct lock *lock)
 	 * logic to make that work cleanly.
 	 */
 	spinlock_release(&cv->cv_wchanlock);
-	lock_acquire(lock);
+	lock_reacquire(lock);
 }
 
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-	(void)lock;
 	spinlock_acquire(&cv->cv_wchanlock);
-	wchan_wakeone(cv->cv_wchan, &cv->cv_wchanlock);
+	spinlock_acquire(&lock->lk_lock);
+	if (lock->lk_holder == curthread) {
+		/*
+		 * Waking the thread now would only have it run into
+		 * the lock we hold. Move it to the lock's wait channel
+		 * instead; lock_release hands it the lock and runs it
+		 * next.
+		 */
+		wchan_requeueone(cv->cv_wchan, &cv->cv_wchanlock,
+				 lock->lk_wchan, &lock->lk_lock);
+	}
+	else {
+		wchan_wakeone(cv->cv_wchan, &cv->cv_wchanlock);
+	}
+	spinlock_release(&lock->lk_lock);
 	spinlock_release(&cv->cv_wchanlock);
 }
 
@@ -315,3 +496,204 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
 	spinlock_release(&cv->cv_wchanlock);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rw_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_writewchan = wchan_create(rw->rw_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_waitingwriters = 0;
+	rw->rw_writer = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_waitingwriters == 0);
+	KASSERT(rw->rw_writer == NULL);
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	/*
+	 * Stand aside not only for an active writer but also for any
+	 * waiting ones; this is what keeps writers from starving.
+	 */
+	while (rw->rw_writer != NULL || rw->rw_waitingwriters > 0) {
+		wchan_sleep(rw->rw_readwchan, &rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0) {
+		/* Last reader out lets a writer in. */
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	rw->rw_waitingwriters++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		wchan_sleep(rw->rw_writewchan, &rw->rw_lock);
+	}
+	rw->rw_waitingwriters--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+	rw->rw_writer = NULL;
+	if (rw->rw_waitingwriters > 0) {
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+	}
+	else {
+		wchan_wakeall(rw->rw_readwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	bool ret;
+
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	ret = (rw->rw_writer == curthread);
+	spinlock_release(&rw->rw_lock);
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Sequence lock.
+
+void
+seqlock_init(struct seqlock *sl)
+{
+	spinlock_init(&sl->sl_lock);
+	sl->sl_seq = 0;
+}
+
+void
+seqlock_cleanup(struct seqlock *sl)
+{
+	KASSERT((sl->sl_seq & 1) == 0);
+	spinlock_cleanup(&sl->sl_lock);
+}
+
+void
+seqlock_write_begin(struct seqlock *sl)
+{
+	spinlock_acquire(&sl->sl_lock);
+	sl->sl_seq++;
+	/* make the odd count visible before any of the data changes */
+	membar_store_store();
+}
+
+void
+seqlock_write_end(struct seqlock *sl)
+{
+	KASSERT(spinlock_do_i_hold(&sl->sl_lock));
+	KASSERT((sl->sl_seq & 1) == 1);
+	/* and all the data changes visible before the even count */
+	membar_store_store();
+	sl->sl_seq++;
+	spinlock_release(&sl->sl_lock);
+}
+
+unsigned
+seqlock_read_begin(struct seqlock *sl)
+{
+	unsigned seq;
+
+	/* Wait out a write in progress; it can't take long. */
+	while ((seq = sl->sl_seq) & 1) {
+		/* spin */
+	}
+	membar_load_load();
+	return seq;
+}
+
+bool
+seqlock_read_retry(struct seqlock *sl, unsigned seq)
+{
+	membar_load_load();
+	return sl->sl_seq != seq;
+}
@@ -32,6 +32,7 @@
  */
 
 #define THREADINLINE
+#define CPUSTATS_INLINE
 
 #include <types.h>
 #include <kern/errno.h>
@@ -42,6 +43,8 @@
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <membar.h>
+#include <atomic.h>
 #include <wchan.h>
 #include <thread.h>
 #include <threadlist.h>
@@ -53,6 +56,8 @@
 #include <mainbus.h>
 #include <vnode.h>
 #include <pid.h>
+#include <cpustats.h>
+#include <ktrace.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -72,6 +77,15 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Set once all CPUs are running and can be given threads. */
+static bool cpus_started;
+
+static int thread_fork_on(struct cpu *pin, const char *name,
+			  struct proc *proc,
+			  void (*entrypoint)(void *data1, unsigned long data2),
+			  void *data1, unsigned long data2);
+static void thread_migrator(void *cpu, unsigned long junk);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -142,6 +156,11 @@ thread_create(const char *name)
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
+	thread->t_inboxnext = NULL;
+	thread->t_runnext = false;
+	thread->t_lastcpu = NULL;
+	thread->t_lastran = 0;
+	thread->t_affinity = NULL;
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
 
@@ -167,6 +186,7 @@ struct cpu *
 cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
+	unsigned i;
 	int result;
 	char namebuf[16];
 
@@ -182,10 +202,19 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_kmalloc = NULL;
+	c->c_intrpc = 0;
+	c->c_prof = NULL;
+	c->c_trace = NULL;
+	for (i=0; i<CPUSTAT_NUM; i++) {
+		c->c_stats[i] = 0;
+	}
+	c->c_migratesem = NULL;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_inbox = NULL;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -220,6 +249,11 @@ cpu_create(unsigned hardware_number)
 		thread_checkstack_init(c->c_curthread);
 	}
 
+	c->c_kmalloc = kmalloc_cpucache_create();
+	if (c->c_kmalloc == NULL) {
+		panic("cpu_create: couldn't allocate kmalloc cache");
+	}
+
 	/*
 	 * If there is no curcpu (or curthread) yet, we are creating
 	 * the first (boot) cpu. Initialize curcpu and curthread as
@@ -255,6 +289,18 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Find a cpu by number.
+ */
+struct cpu *
+cpu_bynumber(unsigned software_number)
+{
+	if (software_number >= cpuarray_num(&allcpus)) {
+		return NULL;
+	}
+	return cpuarray_get(&allcpus, software_number);
+}
+
 /*
  * Destroy a thread.
  *
@@ -334,6 +380,7 @@ thread_panic(void)
 	curcpu->c_runqueue.tl_count = 0;
 	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
 	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	curcpu->c_inbox = NULL;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -424,13 +471,16 @@ cpu_hatch(unsigned software_number)
 }
 
 /*
- * Start up secondary cpus. Called from boot().
+ * Start up secondary cpus, and then a migration thread on each cpu.
+ * Called from boot().
  */
 void
 thread_start_cpus(void)
 {
 	char buf[64];
+	struct cpu *c;
 	unsigned i;
+	int result;
 
 	cpu_identify(buf, sizeof(buf));
 	kprintf("cpu0: %s\n", buf);
@@ -443,12 +493,108 @@ thread_start_cpus(void)
 	}
 	sem_destroy(cpu_startup_sem);
 	cpu_startup_sem = NULL;
+	cpus_started = true;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		c->c_migratesem = sem_create("migrate", 0);
+		if (c->c_migratesem == NULL) {
+			panic("thread_start_cpus: sem_create failed\n");
+		}
+		snprintf(buf, sizeof(buf), "<migrate #%u>", c->c_number);
+		result = thread_fork_on(c, buf, NULL, thread_migrator, c, 0);
+		if (result) {
+			panic("thread_start_cpus: thread_fork: %s\n",
+			      strerror(result));
+		}
+	}
+}
+
+/*
+ * Hand a thread to another cpu by pushing it onto that cpu's inbox.
+ * This does not need any locks; the target cpu picks the thread up
+ * the next time it goes through thread_switch.
+ *
+ * Only the target cpu touches t_state, when it drains the inbox under
+ * its run queue lock: a thread going to sleep sets its own t_state
+ * after releasing the wchan lock, so we might get here before it has.
+ */
+static
+void
+thread_push_inbox(struct cpu *targetcpu, struct thread *target)
+{
+	struct thread *head;
+
+	do {
+		head = targetcpu->c_inbox;
+		target->t_inboxnext = head;
+	} while (!atomic_casptr((void *volatile *)&targetcpu->c_inbox,
+				head, target));
+
+	/*
+	 * The target cpu sets c_isidle and then checks its inbox; we
+	 * have pushed onto the inbox (the CAS is a full barrier) and
+	 * now check c_isidle. So either it sees our thread or we see
+	 * that it is idle (or going idle) and poke it. A spurious
+	 * poke is harmless.
+	 */
+	if (targetcpu->c_isidle) {
+		ipi_send(targetcpu, IPI_UNIDLE);
+	}
+}
+
+/*
+ * Move everything in the current cpu's inbox onto its run queue.
+ * The inbox is a stack, so reverse it to keep wakeups in order.
+ */
+static
+void
+thread_drain_inbox(void)
+{
+	struct thread *list, *rev, *t;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	do {
+		list = curcpu->c_inbox;
+		if (list == NULL) {
+			return;
+		}
+	} while (!atomic_casptr((void *volatile *)&curcpu->c_inbox,
+				list, NULL));
+
+	rev = NULL;
+	while (list != NULL) {
+		t = list;
+		list = t->t_inboxnext;
+		t->t_inboxnext = rev;
+		rev = t;
+	}
+	while (rev != NULL) {
+		t = rev;
+		rev = t->t_inboxnext;
+		t->t_inboxnext = NULL;
+		KASSERT(t->t_cpu == curcpu->c_self);
+		t->t_state = S_READY;
+		if (t->t_runnext) {
+			t->t_runnext = false;
+			threadlist_addhead(&curcpu->c_runqueue, t);
+		}
+		else {
+			threadlist_addtail(&curcpu->c_runqueue, t);
+		}
+	}
 }
 
 /*
  * Make a thread runnable.
  *
- * targetcpu might be curcpu; it might not be, too.
+ * targetcpu might be curcpu; it might not be, too. If it isn't, and
+ * we don't already hold its run queue lock, go through its inbox
+ * rather than contending for the lock.
+ *
+ * If target->t_runnext is set, the thread goes at the head of the
+ * run queue rather than the tail.
  */
 static
 void
@@ -463,13 +609,23 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		/* The target thread's cpu should be already locked. */
 		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
 	}
+	else if (targetcpu != curcpu->c_self) {
+		thread_push_inbox(targetcpu, target);
+		return;
+	}
 	else {
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
 	}
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	if (target->t_runnext) {
+		target->t_runnext = false;
+		threadlist_addhead(&targetcpu->c_runqueue, target);
+	}
+	else {
+		threadlist_addtail(&targetcpu->c_runqueue, target);
+	}
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -484,6 +640,38 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 }
 
+/*
+ * Pick the cpu with the least work queued, for placing a new thread.
+ * The counts are read without locking; this is only a heuristic and
+ * it doesn't matter if they are slightly out of date. Ties go to the
+ * current cpu, whose cache has whatever the parent just touched.
+ */
+static
+struct cpu *
+thread_leastloaded_cpu(void)
+{
+	struct cpu *c, *best;
+	unsigned i, load, bestload;
+
+	best = curcpu->c_self;
+	if (!cpus_started) {
+		return best;
+	}
+	bestload = best->c_runqueue.tl_count + 1;
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		load = c->c_runqueue.tl_count;
+		if (!c->c_isidle) {
+			load++;
+		}
+		if (load < bestload) {
+			best = c;
+			bestload = load;
+		}
+	}
+	return best;
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -491,14 +679,29 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
  * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
  *
  * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * process is inherited from the caller. It will start on the caller's
+ * pinned CPU if there is one, and otherwise on the least loaded CPU.
  */
 int
 thread_fork(const char *name,
 	    struct proc *proc,
 	    void (*entrypoint)(void *data1, unsigned long data2),
 	    void *data1, unsigned long data2)
+{
+	return thread_fork_on(curthread->t_affinity, name, proc,
+			      entrypoint, data1, data2);
+}
+
+/*
+ * Common code for thread_fork: the new thread is pinned to PIN, or
+ * not pinned if PIN is NULL.
+ */
+static
+int
+thread_fork_on(struct cpu *pin, const char *name,
+	       struct proc *proc,
+	       void (*entrypoint)(void *data1, unsigned long data2),
+	       void *data1, unsigned long data2)
 {
 	struct thread *newthread;
 	int result;
@@ -521,7 +724,13 @@ thread_fork(const char *name,
 	 */
 
 	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_affinity = pin;
+	if (newthread->t_affinity != NULL) {
+		newthread->t_cpu = newthread->t_affinity;
+	}
+	else {
+		newthread->t_cpu = thread_leastloaded_cpu();
+	}
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -544,7 +753,7 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
-	/* Lock the current cpu's run queue and make the new thread runnable */
+	/* Put the new thread on its cpu's run queue */
 	thread_make_runnable(newthread, false);
 
 	return 0;
@@ -587,9 +796,16 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	/* Remember where and when we ran, for migration. */
+	cur->t_lastcpu = curcpu->c_self;
+	cur->t_lastran = curcpu->c_hardclocks;
+
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
+	/* Pick up threads other cpus have woken for us. */
+	thread_drain_inbox();
+
 	/* Micro-optimization: if nothing to do, just return */
 	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
 		spinlock_release(&curcpu->c_runqueue_lock);
@@ -643,7 +859,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
+	/* Make sure wakers see c_isidle before we look at the inbox. */
+	membar_any_any();
 	do {
+		thread_drain_inbox();
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
@@ -663,6 +882,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	curcpu->c_curthread = next;
 	curthread = next;
 
+	if (next != cur) {
+		CPUSTAT_INC(CPUSTAT_SWITCHES);
+		KTRACE(KTRACE_SWITCH,
+		       cur->t_proc != NULL ? cur->t_proc->p_pid : 0);
+	}
+
 	/* do the switch (in assembler in switch.S) */
 	switchframe_switch(&cur->t_context, &next->t_context);
 
@@ -834,6 +1059,86 @@ schedule(void)
 	 */
 }
 
+/*
+ * Choose a thread on the current cpu's run queue to migrate away.
+ *
+ * Pinned threads are not eligible, nor is curthread (see below).
+ * Among the rest, prefer threads that did not last run here, and
+ * then the ones that ran here longest ago, as their working set is
+ * least likely to still be in this cpu's cache.
+ */
+static
+struct thread *
+thread_pick_migrant(void)
+{
+	struct thread *t, *best;
+	unsigned age, bestage;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	best = NULL;
+	bestage = 0;
+	THREADLIST_FORALL(t, curcpu->c_runqueue) {
+		if (t == curthread || t->t_affinity != NULL) {
+			continue;
+		}
+		if (t->t_lastcpu != curcpu->c_self) {
+			/* Nothing of it in our cache; take it. */
+			return t;
+		}
+		age = curcpu->c_hardclocks - t->t_lastran;
+		if (best == NULL || age > bestage) {
+			best = t;
+			bestage = age;
+		}
+	}
+	return best;
+}
+
+/*
+ * Send threads on the current cpu's run queue that are pinned to
+ * some other cpu to that cpu.
+ */
+static
+void
+thread_send_strays(void)
+{
+	struct threadlist strays;
+	struct thread *t, *next;
+	struct cpu *c;
+
+	threadlist_init(&strays);
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (t = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+	     t != NULL; t = next) {
+		next = t->t_listnode.tln_next->tln_self;
+		if (t->t_affinity == NULL ||
+		    t->t_affinity == curcpu->c_self ||
+		    t == curthread) {
+			continue;
+		}
+		threadlist_remove(&curcpu->c_runqueue, t);
+		threadlist_addtail(&strays, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	while ((t = threadlist_remhead(&strays)) != NULL) {
+		c = t->t_affinity;
+		spinlock_acquire(&c->c_runqueue_lock);
+		t->t_cpu = c;
+		threadlist_addtail(&c->c_runqueue, t);
+		DEBUG(DB_THREADS, "Moved pinned thread %s: cpu %u -> %u",
+		      t->t_name, curcpu->c_number, c->c_number);
+		if (c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
+
+	threadlist_cleanup(&strays);
+}
+
 /*
  * Thread migration.
  *
@@ -847,9 +1152,11 @@ schedule(void)
  * and the performance loss due to underutilization of some CPUs is
  * something that needs to be tuned and probably is workload-specific.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * System/161 does not (yet) model such cache effects, so we are still
+ * fairly aggressive about balancing; but when choosing which threads
+ * to move we leave alone the ones that ran here recently (see
+ * thread_pick_migrant) and never move pinned threads except to send
+ * them home.
  */
 void
 thread_consider_migration(void)
@@ -860,6 +1167,8 @@ thread_consider_migration(void)
 	struct threadlist victims;
 	struct thread *t;
 
+	thread_send_strays();
+
 	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
@@ -881,9 +1190,33 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+		/*
+		 * Ordinarily, curthread will not appear on the run
+		 * queue. However, it can under the following
+		 * circumstances:
+		 *   - it went to sleep;
+		 *   - the processor became idle, so it remained
+		 *     curthread;
+		 *   - it was reawakened, so it was put on the run
+		 *     queue;
+		 *   - and the processor hasn't fully unidled yet, so
+		 *     all these things are still true.
+		 *
+		 * If the timer interrupt happens at (almost) exactly
+		 * the proper moment, we can come here while things
+		 * are in this state and see curthread. However,
+		 * *migrating* curthread can cause bad things to happen
+		 * (Exercise: Why? And what?) so thread_pick_migrant
+		 * skips it.
+		 */
+		t = thread_pick_migrant();
+		if (t == NULL) {
+			break;
+		}
+		threadlist_remove(&curcpu->c_runqueue, t);
+		threadlist_addtail(&victims, t);
 	}
+	to_send = victims.tl_count;
 	spinlock_release(&curcpu->c_runqueue_lock);
 
 	for (i=0; i < numcpus && to_send > 0; i++) {
@@ -894,34 +1227,6 @@ thread_consider_migration(void)
 		spinlock_acquire(&c->c_runqueue_lock);
 		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
 			t->t_cpu = c;
 			threadlist_addtail(&c->c_runqueue, t);
 			DEBUG(DB_THREADS,
@@ -956,6 +1261,129 @@ thread_consider_migration(void)
 	threadlist_cleanup(&victims);
 }
 
+/*
+ * Per-cpu migration thread. It's pinned to its cpu, so when it runs,
+ * a thread that woke it and then yielded is on the run queue and no
+ * longer running, and can be sent elsewhere safely.
+ */
+static
+void
+thread_migrator(void *cpu, unsigned long junk)
+{
+	struct cpu *c = cpu;
+
+	(void)junk;
+
+	while (1) {
+		P(c->c_migratesem);
+		KASSERT(curcpu->c_self == c);
+		thread_send_strays();
+	}
+}
+
+/*
+ * Set the current thread's cpu affinity. If we're on the wrong cpu,
+ * move now rather than waiting for the next migration pass: wake
+ * this cpu's migration thread and get in line behind it.
+ *
+ * If we get preempted and moved between reading curcpu and the V,
+ * the V goes to a migration thread that then has nothing to do, and
+ * we go around again.
+ */
+int
+thread_setaffinity(int cpunum)
+{
+	struct cpu *target, *here;
+
+	if (cpunum == -1) {
+		curthread->t_affinity = NULL;
+		return 0;
+	}
+	if (cpunum < 0 || (unsigned)cpunum >= cpuarray_num(&allcpus)) {
+		return EINVAL;
+	}
+	target = cpuarray_get(&allcpus, cpunum);
+	curthread->t_affinity = target;
+
+	while ((here = curcpu->c_self) != target &&
+	       here->c_migratesem != NULL) {
+		V(here->c_migratesem);
+		thread_yield();
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Per-cpu event counters (see cpustats.h).
+ */
+
+static const char *const cpustat_names[CPUSTAT_NUM] = {
+	"interrupts",
+	"tlb faults",
+	"page faults",
+	"syscalls",
+	"switches",
+	"disk reads",
+	"disk writes",
+};
+
+int
+cpustats_get(int cpunum, unsigned *counts)
+{
+	struct cpu *c;
+	unsigned i, j, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	if (cpunum != CPUSTAT_ALLCPUS) {
+		if (cpunum < 0 || (unsigned)cpunum >= numcpus) {
+			return EINVAL;
+		}
+		c = cpuarray_get(&allcpus, cpunum);
+		for (j=0; j<CPUSTAT_NUM; j++) {
+			counts[j] = c->c_stats[j];
+		}
+		return 0;
+	}
+
+	for (j=0; j<CPUSTAT_NUM; j++) {
+		counts[j] = 0;
+	}
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		for (j=0; j<CPUSTAT_NUM; j++) {
+			counts[j] += c->c_stats[j];
+		}
+	}
+	return 0;
+}
+
+void
+cpustats_print(void)
+{
+	unsigned counts[CPUSTAT_NUM];
+	unsigned i, j, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+
+	kprintf("%-12s", "");
+	for (i=0; i<numcpus; i++) {
+		kprintf("    cpu%-3u", i);
+	}
+	kprintf("      total\n");
+
+	for (j=0; j<CPUSTAT_NUM; j++) {
+		kprintf("%-12s", cpustat_names[j]);
+		for (i=0; i<numcpus; i++) {
+			cpustats_get(i, counts);
+			kprintf(" %9u", counts[j]);
+		}
+		cpustats_get(CPUSTAT_ALLCPUS, counts);
+		kprintf(" %10u\n", counts[j]);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -1048,6 +1476,53 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	thread_make_runnable(target, false);
 }
 
+/*
+ * Wake up one thread sleeping on a wait channel and have it run next.
+ *
+ * We can't move the thread to the current cpu: it may not have
+ * finished switching out on its own cpu yet (see the notes in
+ * thread_consider_migration), so it goes to the front of its own
+ * cpu's run queue. If that is this cpu it runs as soon as the caller
+ * yields or sleeps.
+ */
+struct thread *
+wchan_wakeone_handoff(struct wchan *wc, struct spinlock *lk)
+{
+	struct thread *target;
+
+	KASSERT(spinlock_do_i_hold(lk));
+
+	target = threadlist_remhead(&wc->wc_threads);
+	if (target == NULL) {
+		return NULL;
+	}
+
+	target->t_runnext = true;
+	thread_make_runnable(target, false);
+	return target;
+}
+
+/*
+ * Move one thread sleeping on a wait channel to another one without
+ * waking it. Both spinlocks must be held, WC's first.
+ */
+void
+wchan_requeueone(struct wchan *wc, struct spinlock *lk,
+		 struct wchan *towc, struct spinlock *tolk)
+{
+	struct thread *target;
+
+	KASSERT(spinlock_do_i_hold(lk));
+	KASSERT(spinlock_do_i_hold(tolk));
+
+	target = threadlist_remhead(&wc->wc_threads);
+	if (target == NULL) {
+		return;
+	}
+	target->t_wchan_name = towc->wc_name;
+	threadlist_addtail(&towc->wc_threads, target);
+}
+
 /*
  * Wake up all threads sleeping on a wait channel.
  */
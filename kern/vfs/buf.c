@@ -0,0 +1,1117 @@
+/*
+ * Buffer cache (see buf.h).
+ *
+ * Every buffer in use is on a hash chain keyed by (fs, block). Buffers
+ * that aren't pinned are also on the LRU list, least recently released
+ * first; eviction takes from the front. Buffers holding nothing (never
+ * used, dropped, or invalidated) go on the front of the LRU list so
+ * they get reused before anything real is thrown away.
+ *
+ * The cache never shrinks: buffers are allocated on demand until the
+ * size limit is reached and are reused after that.
+ *
+ * buffer_lock protects all of the cache's own state, including the
+ * b_busy and b_dirty flags and the counters. The contents of a buffer,
+ * and its b_valid flag, belong to whoever has it pinned. I/O is never
+ * done while holding buffer_lock.
+ *
+ * Lock ordering: filesystems call in here holding their own locks,
+ * and may wait for a pinned buffer while holding them. So whatever
+ * pins a buffer must be able to finish with it without taking any
+ * filesystem lock: fsop_blockio must not take any, and the flusher and
+ * read-ahead threads never wait for a buffer while holding another.
+ * Read-ahead skips blocks that are pinned rather than waiting, since
+ * its queue can hold blocks that have since been freed and reused.
+ *
+ * buffer_dropfs at unmount waits for the read-ahead thread to finish
+ * with the filesystem (buffer_rafs) and for pinned buffers to come
+ * free, so neither thread touches a filesystem after it's gone.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <mainbus.h>
+#include <fs.h>
+#include <buf.h>
+
+struct buf {
+	/* key; b_fs is NULL if the buffer holds nothing */
+	struct fs *b_fs;
+	daddr_t b_block;
+
+	void *b_data;
+	size_t b_size;			/* size of b_data */
+
+	bool b_valid;			/* contents match or supersede disk */
+	bool b_dirty;			/* contents need writing back */
+	time_t b_dirtytime;		/* when it became dirty (seconds) */
+	bool b_readahead;		/* read ahead and not yet used */
+	bool b_busy;			/* pinned */
+	struct thread *b_holder;	/* who has it pinned */
+
+	struct buf *b_hashnext;		/* hash chain */
+	struct buf *b_lruprev;		/* LRU list (when not busy) */
+	struct buf *b_lrunext;
+	struct buf *b_allnext;		/* list of every buffer */
+};
+
+static struct lock *buffer_lock;
+static struct cv *buffer_cv;		/* signaled when a buffer is unpinned */
+
+static struct buf **buffer_hash;
+static unsigned buffer_hashsize;	/* power of 2 */
+
+static struct buf *buffer_lruhead;	/* least recently used */
+static struct buf *buffer_lrutail;	/* most recently used */
+static struct buf *buffer_all;
+
+static size_t buffer_bytes;		/* size of all buffers' data */
+static size_t buffer_maxbytes;
+static size_t buffer_dirtybytes;	/* size of dirty buffers' data */
+static unsigned buffer_count;
+
+/* counters */
+static unsigned buffer_hits;
+static unsigned buffer_misses;
+static unsigned buffer_reads;
+static unsigned buffer_writes;
+static unsigned buffer_readreqs;	/* device requests for the reads */
+static unsigned buffer_writereqs;	/* ...and for the writes */
+static unsigned buffer_evictions;
+static unsigned buffer_waits;
+static unsigned buffer_flushes;		/* writes done by the flusher */
+static unsigned buffer_flusherrors;	/* ...and ones that failed */
+static unsigned buffer_rareads;		/* reads done by read-ahead */
+static unsigned buffer_rahits;		/* ...that were then used */
+static unsigned buffer_radropped;	/* requests lost to a full queue */
+
+/*
+ * Read-ahead queue. Entries from RAHEAD up to RATAIL (mod the size)
+ * are pending; RA_FS is NULL if the entry was cancelled.
+ */
+static struct {
+	struct fs *ra_fs;
+	daddr_t ra_block;
+	size_t ra_size;
+} buffer_raqueue[BUFFER_RAQUEUE];
+static unsigned buffer_rahead, buffer_ratail;
+static struct cv *buffer_racv;		/* signaled when a request is queued */
+static struct fs *buffer_rafs;		/* fs the reader is working on */
+
+static void buffer_flusher(void *, unsigned long);
+static void buffer_reader(void *, unsigned long);
+
+void
+buffer_bootstrap(void)
+{
+	unsigned i, want;
+
+	buffer_lock = lock_create("buffer_lock");
+	buffer_cv = cv_create("buffer_cv");
+	buffer_racv = cv_create("buffer_racv");
+	if (buffer_lock == NULL || buffer_cv == NULL || buffer_racv == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+
+	buffer_maxbytes = mainbus_ramsize() / BUFFER_RAMFRACTION;
+
+	/* About four 512-byte buffers per hash chain when full. */
+	want = buffer_maxbytes / 512 / 4;
+	buffer_hashsize = 64;
+	while (buffer_hashsize < want) {
+		buffer_hashsize *= 2;
+	}
+	buffer_hash = kmalloc(buffer_hashsize * sizeof(buffer_hash[0]));
+	if (buffer_hash == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	for (i=0; i<buffer_hashsize; i++) {
+		buffer_hash[i] = NULL;
+	}
+
+	buffer_lruhead = buffer_lrutail = NULL;
+	buffer_all = NULL;
+	buffer_bytes = 0;
+	buffer_dirtybytes = 0;
+	buffer_count = 0;
+	buffer_rahead = buffer_ratail = 0;
+	buffer_rafs = NULL;
+
+	if (thread_fork("bufflush", NULL, buffer_flusher, NULL, 0)) {
+		panic("buffer_bootstrap: Cannot start flusher thread\n");
+	}
+	if (thread_fork("bufread", NULL, buffer_reader, NULL, 0)) {
+		panic("buffer_bootstrap: Cannot start read-ahead thread\n");
+	}
+
+	kprintf("buffer cache: up to %zu bytes, %u hash chains\n",
+		buffer_maxbytes, buffer_hashsize);
+}
+
+////////////////////////////////////////////////////////////
+// hash and LRU list
+
+static
+unsigned
+buffer_hashfunc(struct fs *fs, daddr_t block)
+{
+	/* Consecutive blocks go to consecutive chains. */
+	return (block + ((uintptr_t)fs >> 4) * 31) & (buffer_hashsize - 1);
+}
+
+static
+struct buf *
+buffer_lookup(struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	for (b = buffer_hash[buffer_hashfunc(fs, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_fs == fs && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buffer_hashinsert(struct buf *b)
+{
+	unsigned h;
+
+	h = buffer_hashfunc(b->b_fs, b->b_block);
+	b->b_hashnext = buffer_hash[h];
+	buffer_hash[h] = b;
+}
+
+/*
+ * Take B off its hash chain and forget its key.
+ */
+static
+void
+buffer_hashremove(struct buf *b)
+{
+	struct buf **bp;
+
+	KASSERT(b->b_fs != NULL);
+	for (bp = &buffer_hash[buffer_hashfunc(b->b_fs, b->b_block)];
+	     *bp != b; bp = &(*bp)->b_hashnext) {
+		KASSERT(*bp != NULL);
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+	b->b_fs = NULL;
+	b->b_valid = false;
+	b->b_readahead = false;
+	if (b->b_dirty) {
+		b->b_dirty = false;
+		buffer_dirtybytes -= b->b_size;
+	}
+}
+
+static
+void
+buffer_lruremove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buffer_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buffer_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+/*
+ * Put B on the LRU list: at the back if it holds something, at the
+ * front (first to be reused) if not.
+ */
+static
+void
+buffer_lruinsert(struct buf *b)
+{
+	if (b->b_fs != NULL) {
+		b->b_lruprev = buffer_lrutail;
+		b->b_lrunext = NULL;
+		if (buffer_lrutail != NULL) {
+			buffer_lrutail->b_lrunext = b;
+		}
+		else {
+			buffer_lruhead = b;
+		}
+		buffer_lrutail = b;
+	}
+	else {
+		b->b_lruprev = NULL;
+		b->b_lrunext = buffer_lruhead;
+		if (buffer_lruhead != NULL) {
+			buffer_lruhead->b_lruprev = b;
+		}
+		else {
+			buffer_lrutail = b;
+		}
+		buffer_lruhead = b;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// pinning
+
+static
+void
+buffer_pin(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(!b->b_busy);
+
+	buffer_lruremove(b);
+	b->b_busy = true;
+	b->b_holder = curthread;
+}
+
+static
+void
+buffer_unpin(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_busy);
+	KASSERT(b->b_holder == curthread);
+
+	b->b_busy = false;
+	b->b_holder = NULL;
+	buffer_lruinsert(b);
+	cv_broadcast(buffer_cv, buffer_lock);
+}
+
+/*
+ * Read or write the N buffers in RUN, which must be for consecutive
+ * blocks of the same filesystem and pinned by us, in one request.
+ * buffer_lock must not be held.
+ */
+static
+int
+buffer_io(struct buf **run, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[BUFFER_MAXRUN];
+	struct uio u;
+	unsigned i;
+
+	KASSERT(n > 0 && n <= BUFFER_MAXRUN);
+
+	for (i=0; i<n; i++) {
+		KASSERT(run[i]->b_busy);
+		KASSERT(run[i]->b_holder == curthread);
+		KASSERT(run[i]->b_fs == run[0]->b_fs);
+		KASSERT(run[i]->b_block == run[0]->b_block + i);
+		KASSERT(run[i]->b_size == run[0]->b_size);
+		iov[i].iov_kbase = run[i]->b_data;
+		iov[i].iov_len = run[i]->b_size;
+	}
+	u.uio_iov = iov;
+	u.uio_iovcnt = n;
+	u.uio_offset = (off_t)run[0]->b_block * run[0]->b_size;
+	u.uio_resid = n * run[0]->b_size;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = rw;
+	u.uio_space = NULL;
+
+	lock_acquire(buffer_lock);
+	if (rw == UIO_READ) {
+		buffer_readreqs++;
+	}
+	else {
+		buffer_writereqs++;
+	}
+	lock_release(buffer_lock);
+
+	return FSOP_BLOCKIO(run[0]->b_fs, &u);
+}
+
+/*
+ * Write B back. It must be pinned by us; buffer_lock must not be held.
+ * On success the caller marks it clean with buffer_cleaned.
+ */
+static
+int
+buffer_writeout(struct buf *b)
+{
+	KASSERT(b->b_valid);
+
+	return buffer_io(&b, 1, UIO_WRITE);
+}
+
+static
+void
+buffer_cleaned(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_dirty);
+
+	b->b_dirty = false;
+	buffer_dirtybytes -= b->b_size;
+	buffer_writes++;
+}
+
+/*
+ * Check if B2 can be written in the same request as B.
+ */
+static
+bool
+buffer_clusterable(struct buf *b, struct buf *b2)
+{
+	return b2 != NULL && b2->b_dirty && !b2->b_busy &&
+		b2->b_size == b->b_size;
+}
+
+/*
+ * Write back B, which we have pinned and which is dirty, along with as
+ * many dirty unpinned buffers for the blocks on either side of it as
+ * fit in one request. Call with buffer_lock held; it is released
+ * during the I/O. On success all of them are marked clean. B stays
+ * pinned; the others are unpinned.
+ */
+static
+int
+buffer_writerun(struct buf *b)
+{
+	struct buf *run[BUFFER_MAXRUN];
+	struct buf *b2;
+	daddr_t block, first;
+	unsigned i, n;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_busy);
+	KASSERT(b->b_holder == curthread);
+	KASSERT(b->b_dirty);
+
+	/* Find the start of the run of dirty blocks B is in. */
+	first = b->b_block;
+	while (first > 0 && b->b_block - first < BUFFER_MAXRUN - 1 &&
+	       buffer_clusterable(b, buffer_lookup(b->b_fs, first - 1))) {
+		first--;
+	}
+
+	/* Collect the run, pinning everything but B (which already is). */
+	n = 0;
+	for (block = first; n < BUFFER_MAXRUN; block++) {
+		if (block == b->b_block) {
+			run[n++] = b;
+			continue;
+		}
+		b2 = buffer_lookup(b->b_fs, block);
+		if (!buffer_clusterable(b, b2)) {
+			KASSERT(block > b->b_block);
+			break;
+		}
+		buffer_pin(b2);
+		run[n++] = b2;
+	}
+
+	lock_release(buffer_lock);
+	result = buffer_io(run, n, UIO_WRITE);
+	lock_acquire(buffer_lock);
+
+	for (i=0; i<n; i++) {
+		if (result == 0) {
+			buffer_cleaned(run[i]);
+		}
+		if (run[i] != b) {
+			buffer_unpin(run[i]);
+		}
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// getting buffers
+
+/*
+ * Allocate a new buffer, if we're still under the size limit. Returns
+ * it pinned and holding nothing.
+ */
+static
+struct buf *
+buffer_create(size_t size)
+{
+	struct buf *b;
+
+	if (buffer_bytes + size > buffer_maxbytes &&
+	    buffer_count >= BUFFER_MINBUFS) {
+		return NULL;
+	}
+
+	b = kmalloc(sizeof(*b));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(size);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_size = size;
+	b->b_fs = NULL;
+	b->b_block = 0;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_readahead = false;
+	b->b_busy = true;
+	b->b_holder = curthread;
+	b->b_hashnext = NULL;
+	b->b_lruprev = b->b_lrunext = NULL;
+
+	b->b_allnext = buffer_all;
+	buffer_all = b;
+	buffer_bytes += size;
+	buffer_count++;
+	return b;
+}
+
+/*
+ * Get a buffer to reuse: a new one if we can have one, otherwise the
+ * least recently used, writing it back first if it's dirty. Returns it
+ * pinned and holding nothing, with b_data at least SIZE bytes.
+ *
+ * May release and reacquire buffer_lock.
+ */
+static
+int
+buffer_getfree(size_t size, struct buf **ret)
+{
+	struct buf *b;
+	void *data;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	b = buffer_create(size);
+	if (b != NULL) {
+		*ret = b;
+		return 0;
+	}
+
+	while (buffer_lruhead == NULL) {
+		/* Everything is pinned; wait for something. */
+		buffer_waits++;
+		cv_wait(buffer_cv, buffer_lock);
+	}
+	b = buffer_lruhead;
+	buffer_pin(b);
+
+	if (b->b_dirty) {
+		result = buffer_writerun(b);
+		if (result) {
+			buffer_unpin(b);
+			return result;
+		}
+	}
+	if (b->b_fs != NULL) {
+		/*
+		 * Anyone who went looking for this block while we were
+		 * writing it found it busy and is waiting; once it's gone
+		 * from the hash they'll read it back in.
+		 */
+		buffer_hashremove(b);
+		buffer_evictions++;
+	}
+
+	if (b->b_size != size) {
+		data = kmalloc(size);
+		if (data == NULL) {
+			buffer_unpin(b);
+			return ENOMEM;
+		}
+		kfree(b->b_data);
+		buffer_bytes = buffer_bytes - b->b_size + size;
+		b->b_data = data;
+		b->b_size = size;
+	}
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Common part of buffer_get and buffer_read: find the buffer for
+ * (FS, BLOCK), creating it if necessary, and pin it. If READING is
+ * set, count a hit or miss. If WAIT is not set, fail with EAGAIN
+ * rather than wait for someone else to release the buffer.
+ */
+static
+int
+buffer_find(struct fs *fs, daddr_t block, size_t size, bool reading,
+	    bool wait, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(fs != NULL);
+
+	lock_acquire(buffer_lock);
+ again:
+	b = buffer_lookup(fs, block);
+	if (b != NULL) {
+		if (b->b_busy) {
+			KASSERT(b->b_holder != curthread);
+			if (!wait) {
+				lock_release(buffer_lock);
+				return EAGAIN;
+			}
+			buffer_waits++;
+			cv_wait(buffer_cv, buffer_lock);
+			goto again;
+		}
+		KASSERT(b->b_size == size);
+		buffer_pin(b);
+		if (reading) {
+			if (b->b_valid) {
+				buffer_hits++;
+			}
+			else {
+				buffer_misses++;
+			}
+		}
+		if (reading && b->b_readahead) {
+			buffer_rahits++;
+			b->b_readahead = false;
+		}
+		lock_release(buffer_lock);
+		*ret = b;
+		return 0;
+	}
+
+	result = buffer_getfree(size, &b);
+	if (result) {
+		lock_release(buffer_lock);
+		return result;
+	}
+
+	/* Someone else may have loaded it while we were writing. */
+	if (buffer_lookup(fs, block) != NULL) {
+		buffer_unpin(b);
+		goto again;
+	}
+
+	b->b_fs = fs;
+	b->b_block = block;
+	KASSERT(!b->b_valid);
+	KASSERT(!b->b_dirty);
+	buffer_hashinsert(b);
+	if (reading) {
+		buffer_misses++;
+	}
+	lock_release(buffer_lock);
+
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
+{
+	return buffer_find(fs, block, size, false, true, ret);
+}
+
+/*
+ * Common part of buffer_readrun and read-ahead: get and pin the
+ * buffers for N consecutive blocks, then read each stretch of them
+ * that isn't already valid in a single request. AHEAD is set for
+ * read-ahead, which shouldn't count as cache lookups and doesn't wait
+ * for pinned buffers: the run is cut short at the first one, and *N
+ * updated. If the first is pinned, fails with EAGAIN.
+ */
+static
+int
+buffer_getrun(struct fs *fs, daddr_t block, unsigned *np, size_t size,
+	      bool ahead, struct buf **bufs)
+{
+	unsigned i, j, k, n = *np;
+	int result;
+
+	KASSERT(n > 0 && n <= BUFFER_MAXRUN);
+
+	for (i=0; i<n; i++) {
+		result = buffer_find(fs, block + i, size, !ahead, !ahead,
+				     &bufs[i]);
+		if (result == EAGAIN && i > 0) {
+			n = *np = i;
+			break;
+		}
+		if (result) {
+			while (i-- > 0) {
+				buffer_release(bufs[i]);
+			}
+			return result;
+		}
+	}
+
+	for (i=0; i<n; i=j) {
+		if (bufs[i]->b_valid) {
+			j = i+1;
+			continue;
+		}
+		for (j=i+1; j<n && !bufs[j]->b_valid; j++);
+
+		result = buffer_io(&bufs[i], j - i, UIO_READ);
+		if (result) {
+			for (k=0; k<n; k++) {
+				if (k >= i && k < j) {
+					buffer_release_and_invalidate(bufs[k]);
+				}
+				else {
+					buffer_release(bufs[k]);
+				}
+			}
+			return result;
+		}
+
+		lock_acquire(buffer_lock);
+		for (k=i; k<j; k++) {
+			bufs[k]->b_valid = true;
+			bufs[k]->b_readahead = ahead;
+			buffer_reads++;
+			if (ahead) {
+				buffer_rareads++;
+			}
+		}
+		lock_release(buffer_lock);
+	}
+	return 0;
+}
+
+int
+buffer_read(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
+{
+	unsigned n = 1;
+
+	return buffer_getrun(fs, block, &n, size, false, ret);
+}
+
+int
+buffer_readrun(struct fs *fs, daddr_t block, unsigned n, size_t size,
+	       struct buf **bufs)
+{
+	return buffer_getrun(fs, block, &n, size, false, bufs);
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	buffer_unpin(b);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_release_and_invalidate(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	buffer_hashremove(b);
+	buffer_unpin(b);
+	lock_release(buffer_lock);
+}
+
+////////////////////////////////////////////////////////////
+// pinned buffer operations
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+bool
+buffer_is_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_valid;
+}
+
+void
+buffer_mark_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	struct timespec now;
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_valid);
+
+	lock_acquire(buffer_lock);
+	if (!b->b_dirty) {
+		clocktime(&now);
+		b->b_dirty = true;
+		b->b_dirtytime = now.tv_sec;
+		buffer_dirtybytes += b->b_size;
+	}
+	lock_release(buffer_lock);
+}
+
+int
+buffer_sync(struct buf *b)
+{
+	int result;
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_holder == curthread);
+
+	/* Only we can make it dirty, so this is safe without the lock. */
+	if (!b->b_dirty) {
+		return 0;
+	}
+	result = buffer_writeout(b);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(buffer_lock);
+	buffer_cleaned(b);
+	lock_release(buffer_lock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// whole-block and whole-fs operations
+
+void
+buffer_drop(struct fs *fs, daddr_t block, size_t size)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	while ((b = buffer_lookup(fs, block)) != NULL && b->b_busy) {
+		KASSERT(b->b_holder != curthread);
+		buffer_waits++;
+		cv_wait(buffer_cv, buffer_lock);
+	}
+	if (b != NULL) {
+		KASSERT(b->b_size == size);
+		buffer_lruremove(b);
+		buffer_hashremove(b);
+		buffer_lruinsert(b);
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * The list of all buffers only ever grows at the head, so it can be
+ * walked while buffer_lock is dropped for I/O.
+ */
+int
+buffer_syncfs(struct fs *fs)
+{
+	struct buf *b;
+	int result, ret = 0;
+
+	lock_acquire(buffer_lock);
+	for (b = buffer_all; b != NULL; b = b->b_allnext) {
+		while (b->b_fs == fs && b->b_dirty && b->b_busy) {
+			KASSERT(b->b_holder != curthread);
+			buffer_waits++;
+			cv_wait(buffer_cv, buffer_lock);
+		}
+		if (b->b_fs != fs || !b->b_dirty) {
+			continue;
+		}
+
+		buffer_pin(b);
+		result = buffer_writerun(b);
+		if (result && ret == 0) {
+			/* keep going, but report the first error */
+			ret = result;
+		}
+		buffer_unpin(b);
+	}
+	lock_release(buffer_lock);
+	return ret;
+}
+
+void
+buffer_dropfs(struct fs *fs)
+{
+	struct buf *b;
+	unsigned i;
+
+	lock_acquire(buffer_lock);
+	for (i = buffer_rahead; i != buffer_ratail; i++) {
+		if (buffer_raqueue[i % BUFFER_RAQUEUE].ra_fs == fs) {
+			buffer_raqueue[i % BUFFER_RAQUEUE].ra_fs = NULL;
+		}
+	}
+	while (buffer_rafs == fs) {
+		buffer_waits++;
+		cv_wait(buffer_cv, buffer_lock);
+	}
+	for (b = buffer_all; b != NULL; b = b->b_allnext) {
+		while (b->b_fs == fs && b->b_busy) {
+			KASSERT(b->b_holder != curthread);
+			buffer_waits++;
+			cv_wait(buffer_cv, buffer_lock);
+		}
+		if (b->b_fs != fs) {
+			continue;
+		}
+		KASSERT(!b->b_dirty);
+		buffer_lruremove(b);
+		buffer_hashremove(b);
+		buffer_lruinsert(b);
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Unlike buffer_dropfs this is safe on a live filesystem: it doesn't
+ * wait for anything, and whatever is pinned or dirty stays put.
+ */
+void
+buffer_dropclean(struct fs *fs)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	for (b = buffer_all; b != NULL; b = b->b_allnext) {
+		if (b->b_fs != fs || b->b_busy || b->b_dirty) {
+			continue;
+		}
+		buffer_lruremove(b);
+		buffer_hashremove(b);
+		buffer_lruinsert(b);
+	}
+	lock_release(buffer_lock);
+}
+
+////////////////////////////////////////////////////////////
+// flusher
+
+/*
+ * Write back buffers that have been dirty too long, or as many as it
+ * takes to relieve pressure if too much of the cache is dirty. Skips
+ * pinned buffers; they'll be there next time.
+ */
+static
+void
+buffer_flush(void)
+{
+	struct timespec now;
+	struct buf *b;
+	const char *volname;
+	bool pressure;
+	unsigned before;
+	int result;
+
+	clocktime(&now);
+
+	lock_acquire(buffer_lock);
+	pressure = buffer_dirtybytes > buffer_maxbytes / BUFFER_DIRTYHIGH;
+	for (b = buffer_all; b != NULL; b = b->b_allnext) {
+		if (pressure &&
+		    buffer_dirtybytes < buffer_maxbytes / BUFFER_DIRTYLOW) {
+			pressure = false;
+		}
+		if (!b->b_dirty || b->b_busy) {
+			continue;
+		}
+		if (!pressure && now.tv_sec - b->b_dirtytime < BUFFER_MAXAGE) {
+			continue;
+		}
+
+		buffer_pin(b);
+		before = buffer_writes;
+		result = buffer_writerun(b);
+		buffer_flushes += buffer_writes - before;
+		if (result) {
+			/* it's still dirty; we'll try again next time */
+			buffer_flusherrors++;
+			volname = FSOP_GETVOLNAME(b->b_fs);
+			kprintf("buffers: %s: block %llu write error: %s\n",
+				volname != NULL ? volname : "(unnamed)",
+				(unsigned long long)b->b_block,
+				strerror(result));
+		}
+		buffer_unpin(b);
+	}
+	lock_release(buffer_lock);
+}
+
+static
+void
+buffer_flusher(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(1);
+		buffer_flush();
+	}
+}
+
+////////////////////////////////////////////////////////////
+// read-ahead
+
+void
+buffer_readahead(struct fs *fs, daddr_t block, size_t size)
+{
+	unsigned slot;
+
+	lock_acquire(buffer_lock);
+	if (buffer_lookup(fs, block) != NULL) {
+		/* already here, or on its way */
+		lock_release(buffer_lock);
+		return;
+	}
+	if (buffer_ratail - buffer_rahead == BUFFER_RAQUEUE) {
+		buffer_radropped++;
+		lock_release(buffer_lock);
+		return;
+	}
+	slot = buffer_ratail++ % BUFFER_RAQUEUE;
+	buffer_raqueue[slot].ra_fs = fs;
+	buffer_raqueue[slot].ra_block = block;
+	buffer_raqueue[slot].ra_size = size;
+	cv_signal(buffer_racv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+/*
+ * Take the next request off the read-ahead queue, waiting for one,
+ * along with any requests right behind it for the blocks following
+ * it. Returns the number of blocks. The filesystem is recorded in
+ * buffer_rafs so it can't be unmounted before we're done with it
+ * (see buffer_dropfs); call buffer_radone afterwards.
+ */
+static
+unsigned
+buffer_nextra(struct fs **fs, daddr_t *block, size_t *size)
+{
+	unsigned slot, n;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		while (buffer_rahead == buffer_ratail) {
+			cv_wait(buffer_racv, buffer_lock);
+		}
+
+		while (buffer_rahead != buffer_ratail) {
+			slot = buffer_rahead++ % BUFFER_RAQUEUE;
+			if (buffer_raqueue[slot].ra_fs != NULL &&
+			    buffer_lookup(buffer_raqueue[slot].ra_fs,
+					  buffer_raqueue[slot].ra_block) == NULL) {
+				*fs = buffer_raqueue[slot].ra_fs;
+				*block = buffer_raqueue[slot].ra_block;
+				*size = buffer_raqueue[slot].ra_size;
+				for (n = 1; n < BUFFER_MAXRUN &&
+					     buffer_rahead != buffer_ratail; n++) {
+					slot = buffer_rahead % BUFFER_RAQUEUE;
+					if (buffer_raqueue[slot].ra_fs != *fs ||
+					    buffer_raqueue[slot].ra_block
+					    != *block + n ||
+					    buffer_raqueue[slot].ra_size != *size) {
+						break;
+					}
+					buffer_rahead++;
+				}
+				buffer_rafs = *fs;
+				lock_release(buffer_lock);
+				return n;
+			}
+		}
+	}
+}
+
+static
+void
+buffer_radone(void)
+{
+	lock_acquire(buffer_lock);
+	buffer_rafs = NULL;
+	cv_broadcast(buffer_cv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+static
+void
+buffer_reader(void *data1, unsigned long data2)
+{
+	struct buf *bufs[BUFFER_MAXRUN];
+	struct fs *fs;
+	daddr_t block;
+	size_t size;
+	unsigned i, n;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		n = buffer_nextra(&fs, &block, &size);
+		if (buffer_getrun(fs, block, &n, size, true, bufs) == 0) {
+			for (i=0; i<n; i++) {
+				buffer_release(bufs[i]);
+			}
+		}
+		buffer_radone();
+	}
+}
+
+////////////////////////////////////////////////////////////
+// stats
+
+void
+buffer_printstats(void)
+{
+	struct buf *b;
+	unsigned inuse = 0, dirty = 0, busy = 0;
+	unsigned lookups;
+
+	lock_acquire(buffer_lock);
+	for (b = buffer_all; b != NULL; b = b->b_allnext) {
+		if (b->b_fs != NULL) {
+			inuse++;
+		}
+		if (b->b_dirty) {
+			dirty++;
+		}
+		if (b->b_busy) {
+			busy++;
+		}
+	}
+	lookups = buffer_hits + buffer_misses;
+
+	kprintf("buffers: %u allocated (%zu of %zu bytes), %u in use, "
+		"%u dirty, %u pinned\n", buffer_count, buffer_bytes,
+		buffer_maxbytes, inuse, dirty, busy);
+	kprintf("buffers: %u hits, %u misses (%u%% hit rate)\n",
+		buffer_hits, buffer_misses,
+		lookups == 0 ? 0 : buffer_hits * 100 / lookups);
+	kprintf("buffers: %u reads in %u requests, %u writes (%u by flusher) "
+		"in %u requests\n", buffer_reads, buffer_readreqs,
+		buffer_writes, buffer_flushes, buffer_writereqs);
+	kprintf("buffers: %u evictions, %u waits, %u flusher write errors\n",
+		buffer_evictions, buffer_waits, buffer_flusherrors);
+	kprintf("buffers: %zu dirty bytes\n", buffer_dirtybytes);
+	kprintf("buffers: read-ahead %u reads, %u used, %u dropped\n",
+		buffer_rareads, buffer_rahits, buffer_radropped);
+	lock_release(buffer_lock);
+}
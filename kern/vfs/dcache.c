@@ -0,0 +1,432 @@
+/*
+ * Name lookup cache (see dcache.h).
+ *
+ * The entries are allocated once at boot. Every entry is on the LRU
+ * list, least recently used first; entries holding nothing go on the
+ * front so they're reused first. Entries in use are also on a hash
+ * chain keyed by (directory, name).
+ *
+ * dcache_lock protects everything here. Vnode references are taken
+ * under it, but never dropped under it: dropping the last reference
+ * reclaims the vnode, which can take filesystem locks (and, for
+ * emufs, the VFS big lock), and vfs_lookup calls in here holding
+ * those. So entries being thrown away hand their references back to
+ * the caller, which drops them after releasing dcache_lock.
+ *
+ * dcache_gen counts invalidations; see dcache.h for what it's for.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <fs.h>
+#include <vnode.h>
+#include <dcache.h>
+
+struct dcentry {
+	/* key; dc_dir is NULL if the entry holds nothing */
+	struct vnode *dc_dir;
+	char dc_name[DCACHE_NAMELEN];
+
+	struct vnode *dc_vn;		/* NULL for a negative entry */
+
+	struct dcentry *dc_hashnext;	/* hash chain */
+	struct dcentry *dc_lruprev;	/* LRU list */
+	struct dcentry *dc_lrunext;
+};
+
+static struct lock *dcache_lock;
+static struct dcentry *dcache_entries;
+static struct dcentry *dcache_hash[DCACHE_HASHSIZE];
+static struct dcentry *dcache_lruhead;	/* least recently used */
+static struct dcentry *dcache_lrutail;	/* most recently used */
+static unsigned dcache_gen;
+
+/* counters */
+static unsigned dcache_hits;
+static unsigned dcache_neghits;
+static unsigned dcache_misses;
+static unsigned dcache_enters;
+static unsigned dcache_evictions;
+static unsigned dcache_stale;
+static unsigned dcache_invalidations;
+
+////////////////////////////////////////////////////////////
+// hash and LRU list
+
+static
+unsigned
+dcache_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned h;
+
+	h = (unsigned)(uintptr_t)dir >> 4;
+	while (*name) {
+		h = h*31 + (unsigned char)*name++;
+	}
+	return h & (DCACHE_HASHSIZE - 1);
+}
+
+static
+void
+dcache_lru_remove(struct dcentry *dc)
+{
+	if (dc->dc_lruprev != NULL) {
+		dc->dc_lruprev->dc_lrunext = dc->dc_lrunext;
+	}
+	else {
+		dcache_lruhead = dc->dc_lrunext;
+	}
+	if (dc->dc_lrunext != NULL) {
+		dc->dc_lrunext->dc_lruprev = dc->dc_lruprev;
+	}
+	else {
+		dcache_lrutail = dc->dc_lruprev;
+	}
+	dc->dc_lruprev = dc->dc_lrunext = NULL;
+}
+
+static
+void
+dcache_lru_append(struct dcentry *dc)
+{
+	dc->dc_lrunext = NULL;
+	dc->dc_lruprev = dcache_lrutail;
+	if (dcache_lrutail != NULL) {
+		dcache_lrutail->dc_lrunext = dc;
+	}
+	else {
+		dcache_lruhead = dc;
+	}
+	dcache_lrutail = dc;
+}
+
+static
+void
+dcache_lru_prepend(struct dcentry *dc)
+{
+	dc->dc_lruprev = NULL;
+	dc->dc_lrunext = dcache_lruhead;
+	if (dcache_lruhead != NULL) {
+		dcache_lruhead->dc_lruprev = dc;
+	}
+	else {
+		dcache_lrutail = dc;
+	}
+	dcache_lruhead = dc;
+}
+
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc;
+
+	KASSERT(lock_do_i_hold(dcache_lock));
+
+	dc = dcache_hash[dcache_hashfunc(dir, name)];
+	for (; dc != NULL; dc = dc->dc_hashnext) {
+		if (dc->dc_dir == dir && !strcmp(dc->dc_name, name)) {
+			return dc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Empty an entry and move it to the front of the LRU list. Its
+ * references are handed back in *DIR and *VN for the caller to drop
+ * with dcache_drop once it has released dcache_lock.
+ */
+static
+void
+dcache_clear(struct dcentry *dc, struct vnode **dir, struct vnode **vn)
+{
+	struct dcentry **pp;
+
+	KASSERT(lock_do_i_hold(dcache_lock));
+	KASSERT(dc->dc_dir != NULL);
+
+	pp = &dcache_hash[dcache_hashfunc(dc->dc_dir, dc->dc_name)];
+	while (*pp != dc) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->dc_hashnext;
+	}
+	*pp = dc->dc_hashnext;
+	dc->dc_hashnext = NULL;
+
+	*dir = dc->dc_dir;
+	*vn = dc->dc_vn;
+	dc->dc_dir = NULL;
+	dc->dc_vn = NULL;
+	dc->dc_name[0] = 0;
+
+	dcache_lru_remove(dc);
+	dcache_lru_prepend(dc);
+}
+
+static
+void
+dcache_drop(struct vnode *dir, struct vnode *vn)
+{
+	KASSERT(!lock_do_i_hold(dcache_lock));
+
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// setup
+
+void
+dcache_bootstrap(void)
+{
+	unsigned i;
+
+	dcache_lock = lock_create("dcache_lock");
+	if (dcache_lock == NULL) {
+		panic("dcache_bootstrap: Out of memory\n");
+	}
+
+	dcache_entries = kmalloc(DCACHE_SIZE * sizeof(dcache_entries[0]));
+	if (dcache_entries == NULL) {
+		panic("dcache_bootstrap: Out of memory\n");
+	}
+
+	for (i=0; i<DCACHE_HASHSIZE; i++) {
+		dcache_hash[i] = NULL;
+	}
+	dcache_lruhead = dcache_lrutail = NULL;
+	for (i=0; i<DCACHE_SIZE; i++) {
+		dcache_entries[i].dc_dir = NULL;
+		dcache_entries[i].dc_name[0] = 0;
+		dcache_entries[i].dc_vn = NULL;
+		dcache_entries[i].dc_hashnext = NULL;
+		dcache_lru_append(&dcache_entries[i]);
+	}
+	dcache_gen = 0;
+}
+
+////////////////////////////////////////////////////////////
+// lookup and update
+
+bool
+dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct dcentry *dc;
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return false;
+	}
+
+	lock_acquire(dcache_lock);
+	dc = dcache_find(dir, name);
+	if (dc == NULL) {
+		dcache_misses++;
+		lock_release(dcache_lock);
+		return false;
+	}
+
+	dcache_lru_remove(dc);
+	dcache_lru_append(dc);
+	if (dc->dc_vn != NULL) {
+		VOP_INCREF(dc->dc_vn);
+		dcache_hits++;
+	}
+	else {
+		dcache_neghits++;
+	}
+	*ret = dc->dc_vn;
+	lock_release(dcache_lock);
+	return true;
+}
+
+unsigned
+dcache_getgen(void)
+{
+	unsigned gen;
+
+	lock_acquire(dcache_lock);
+	gen = dcache_gen;
+	lock_release(dcache_lock);
+	return gen;
+}
+
+void
+dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+	     unsigned gen)
+{
+	struct dcentry *dc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return;
+	}
+
+	lock_acquire(dcache_lock);
+	if (gen != dcache_gen) {
+		/* Something changed while the caller was looking. */
+		dcache_stale++;
+		lock_release(dcache_lock);
+		return;
+	}
+	if (dcache_find(dir, name) != NULL) {
+		/* Another lookup got here first. */
+		lock_release(dcache_lock);
+		return;
+	}
+
+	dc = dcache_lruhead;
+	KASSERT(dc != NULL);
+	if (dc->dc_dir != NULL) {
+		dcache_clear(dc, &olddir, &oldvn);
+		dcache_evictions++;
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	dc->dc_dir = dir;
+	strcpy(dc->dc_name, name);
+	dc->dc_vn = vn;
+
+	dc->dc_hashnext = dcache_hash[dcache_hashfunc(dir, name)];
+	dcache_hash[dcache_hashfunc(dir, name)] = dc;
+	dcache_lru_remove(dc);
+	dcache_lru_append(dc);
+	dcache_enters++;
+	lock_release(dcache_lock);
+
+	dcache_drop(olddir, oldvn);
+}
+
+/*
+ * Whether DC is to be thrown out by dcache_purge: if VN isn't NULL,
+ * when it's for a name in VN or leads to VN; otherwise when it's on
+ * FS and, if NAME isn't NULL, for that name.
+ */
+static
+bool
+dcache_match(struct dcentry *dc, struct fs *fs, const char *name,
+	     struct vnode *vn)
+{
+	KASSERT(dc->dc_dir != NULL);
+
+	if (vn != NULL) {
+		return dc->dc_dir == vn || dc->dc_vn == vn;
+	}
+	if (dc->dc_dir->vn_fs != fs) {
+		return false;
+	}
+	return name == NULL || !strcmp(dc->dc_name, name);
+}
+
+/*
+ * Clear the entries dcache_match picks. dcache_lock has to be let go
+ * of to drop their references, so this goes through the entry array
+ * by index, up to DCACHE_DROPBATCH entries at a time, rather than
+ * along a list that could change underneath it.
+ */
+static
+void
+dcache_purge(struct fs *fs, const char *name, struct vnode *vn)
+{
+	struct vnode *olddirs[DCACHE_DROPBATCH], *oldvns[DCACHE_DROPBATCH];
+	struct dcentry *dc;
+	unsigned i, j, n;
+
+	lock_acquire(dcache_lock);
+	dcache_gen++;
+	lock_release(dcache_lock);
+
+	i = 0;
+	while (i < DCACHE_SIZE) {
+		n = 0;
+		lock_acquire(dcache_lock);
+		for (; i<DCACHE_SIZE && n<DCACHE_DROPBATCH; i++) {
+			dc = &dcache_entries[i];
+			if (dc->dc_dir != NULL &&
+			    dcache_match(dc, fs, name, vn)) {
+				dcache_clear(dc, &olddirs[n], &oldvns[n]);
+				dcache_invalidations++;
+				n++;
+			}
+		}
+		lock_release(dcache_lock);
+
+		for (j=0; j<n; j++) {
+			dcache_drop(olddirs[j], oldvns[j]);
+		}
+	}
+}
+
+/*
+ * Some filesystems (emufs) can hand out more than one vnode for the
+ * same directory, so a name being changed in DIR might be cached
+ * under another vnode too. Rather than trust the vnode, throw the
+ * name out for every directory on the filesystem. This is rare
+ * enough, and the cache small enough, that it doesn't matter.
+ */
+void
+dcache_invalidate(struct vnode *dir, const char *name)
+{
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		/* Not cached, but lookups in progress must not enter it. */
+		lock_acquire(dcache_lock);
+		dcache_gen++;
+		lock_release(dcache_lock);
+		return;
+	}
+	dcache_purge(dir->vn_fs, name, NULL);
+}
+
+void
+dcache_purgevnode(struct vnode *vn)
+{
+	dcache_purge(NULL, NULL, vn);
+}
+
+void
+dcache_purgefs(struct fs *fs)
+{
+	dcache_purge(fs, NULL, NULL);
+}
+
+////////////////////////////////////////////////////////////
+// stats
+
+void
+dcache_printstats(void)
+{
+	struct dcentry *dc;
+	unsigned inuse = 0, negative = 0, lookups, i;
+
+	lock_acquire(dcache_lock);
+	for (i=0; i<DCACHE_SIZE; i++) {
+		dc = &dcache_entries[i];
+		if (dc->dc_dir != NULL) {
+			inuse++;
+			if (dc->dc_vn == NULL) {
+				negative++;
+			}
+		}
+	}
+	lookups = dcache_hits + dcache_neghits + dcache_misses;
+
+	kprintf("dcache: %u of %u entries in use (%u negative)\n",
+		inuse, DCACHE_SIZE, negative);
+	kprintf("dcache: %u hits, %u negative hits, %u misses "
+		"(%u%% hit rate)\n", dcache_hits, dcache_neghits,
+		dcache_misses,
+		lookups == 0 ? 0 : (dcache_hits + dcache_neghits) * 100 /
+		lookups);
+	kprintf("dcache: %u entered, %u evicted, %u stale, "
+		"%u invalidated\n", dcache_enters, dcache_evictions,
+		dcache_stale, dcache_invalidations);
+	lock_release(dcache_lock);
+}
@@ -39,6 +39,7 @@
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <dcache.h>
 
 static struct vnode *bootfs_vnode = NULL;
 
@@ -234,16 +235,103 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+/*
+ * Look up a single component NAME in directory DIR, through the name
+ * cache. "." and ".." aren't cached, since they'd tie a directory and
+ * its parent together in the cache; they go straight to VOP_LOOKUP.
+ */
+static
+int
+lookup_component(struct vnode *dir, char *name, struct vnode **ret)
+{
+	unsigned gen;
+	int result;
+
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return VOP_LOOKUP(dir, name, ret);
+	}
+
+	if (dcache_lookup(dir, name, ret)) {
+		return *ret == NULL ? ENOENT : 0;
+	}
+
+	gen = dcache_getgen();
+	result = VOP_LOOKUP(dir, name, ret);
+	if (result == 0) {
+		dcache_enter(dir, name, *ret, gen);
+	}
+	else if (result == ENOENT) {
+		dcache_enter(dir, name, NULL, gen);
+	}
+	return result;
+}
+
+/*
+ * Walk PATH from STARTVN one component at a time. Consumes the
+ * reference to STARTVN; on success *RET holds a reference to the
+ * result, which is STARTVN itself if PATH has no components.
+ *
+ * PATH is cut up in place.
+ */
+static
+int
+lookup_walk(struct vnode *startvn, char *path, struct vnode **ret)
+{
+	struct vnode *dir, *next;
+	char *name, *s;
+	int result;
+
+	dir = startvn;
+	name = path;
+	while (1) {
+		while (*name == '/') {
+			name++;
+		}
+		if (*name == 0) {
+			break;
+		}
+		s = strchr(name, '/');
+		if (s != NULL) {
+			*s = 0;
+		}
+		if (strlen(name) > NAME_MAX) {
+			VOP_DECREF(dir);
+			return ENAMETOOLONG;
+		}
+
+		result = lookup_component(dir, name, &next);
+		VOP_DECREF(dir);
+		if (result) {
+			return result;
+		}
+		dir = next;
+
+		if (s == NULL) {
+			break;
+		}
+		name = s+1;
+	}
+
+	*ret = dir;
+	return 0;
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
+ *
+ * Paths are walked here a component at a time, so each one can be
+ * looked up in the name cache, rather than handed to the filesystem
+ * whole.
  */
 
 int
 vfs_lookparent(char *path, struct vnode **retval,
 	       char *buf, size_t buflen)
 {
-	struct vnode *startvn;
+	struct vnode *startvn, *dir;
+	char *name;
+	size_t len;
 	int result;
 
 	vfs_biglock_acquire();
@@ -254,19 +342,41 @@ vfs_lookparent(char *path, struct vnode **retval,
 		return result;
 	}
 
-	if (strlen(path)==0) {
+	/* Trailing slashes don't change which name is meant. */
+	len = strlen(path);
+	while (len > 0 && path[len-1] == '/') {
+		path[--len] = 0;
+	}
+
+	if (len==0) {
 		/*
 		 * It does not make sense to use just a device name in
 		 * a context where "lookparent" is the desired
 		 * operation.
 		 */
-		result = EINVAL;
+		VOP_DECREF(startvn);
+		vfs_biglock_release();
+		return EINVAL;
+	}
+
+	name = strrchr(path, '/');
+	if (name == NULL) {
+		name = path;
+		dir = startvn;
 	}
 	else {
-		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
+		*name++ = 0;
+		result = lookup_walk(startvn, path, &dir);
+		if (result) {
+			vfs_biglock_release();
+			return result;
+		}
 	}
 
-	VOP_DECREF(startvn);
+	/* The filesystem checks that DIR is a directory. */
+	result = VOP_LOOKPARENT(dir, name, retval, buf, buflen);
+
+	VOP_DECREF(dir);
 
 	vfs_biglock_release();
 	return result;
@@ -286,15 +396,8 @@ vfs_lookup(char *path, struct vnode **retval)
 		return result;
 	}
 
-	if (strlen(path)==0) {
-		*retval = startvn;
-		vfs_biglock_release();
-		return 0;
-	}
-
-	result = VOP_LOOKUP(startvn, path, retval);
+	result = lookup_walk(startvn, path, retval);
 
-	VOP_DECREF(startvn);
 	vfs_biglock_release();
 	return result;
 }
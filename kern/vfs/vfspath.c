@@ -29,6 +29,10 @@
 
 /*
  * High-level VFS operations on pathnames.
+ *
+ * Everything here that adds or removes a name tells the name cache
+ * (dcache.h) afterwards, whether or not the filesystem call worked;
+ * a failed call may still have changed something.
  */
 
 #include <types.h>
@@ -38,6 +42,7 @@
 #include <lib.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <dcache.h>
 
 
 /* Does most of the work for open(). */
@@ -74,6 +79,7 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		dcache_invalidate(dir, name);
 
 		VOP_DECREF(dir);
 	}
@@ -146,6 +152,7 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	dcache_invalidate(dir, name);
 	VOP_DECREF(dir);
 
 	return result;
@@ -179,6 +186,8 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	dcache_invalidate(olddir, oldname);
+	dcache_invalidate(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -213,6 +222,7 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	dcache_invalidate(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -240,6 +250,7 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	dcache_invalidate(newdir, newname);
 	VOP_DECREF(newdir);
 
 	return result;
@@ -286,6 +297,7 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	dcache_invalidate(parent, name);
 
 	VOP_DECREF(parent);
 
@@ -298,7 +310,7 @@ vfs_mkdir(char *path, mode_t mode)
 int
 vfs_rmdir(char *path)
 {
-	struct vnode *parent;
+	struct vnode *parent, *dir;
 	char name[NAME_MAX+1];
 	int result;
 
@@ -307,7 +319,23 @@ vfs_rmdir(char *path)
 		return result;
 	}
 
+	/*
+	 * Get the directory itself too, so that once it's gone the
+	 * name cache can let go of the names cached in it. If this
+	 * fails, so will VOP_RMDIR.
+	 */
+	if (VOP_LOOKUP(parent, name, &dir)) {
+		dir = NULL;
+	}
+
 	result = VOP_RMDIR(parent, name);
+	dcache_invalidate(parent, name);
+	if (dir != NULL) {
+		if (result == 0) {
+			dcache_purgevnode(dir);
+		}
+		VOP_DECREF(dir);
+	}
 
 	VOP_DECREF(parent);
 
@@ -206,7 +206,8 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
         /* Initial user-level stack pointer */
         *stackptr = USERSTACK;
-        int err = as_define_region(as, USERSTACK - (PAGE_SIZE * 16), PAGE_SIZE * 16, 1, 1, 0);
+        // 32 pages, so a full ARG_MAX of arguments still leaves room
+        int err = as_define_region(as, USERSTACK - (PAGE_SIZE * 32), PAGE_SIZE * 32, 1, 1, 0);
         if(err) {
                 return err;
         }
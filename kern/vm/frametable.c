@@ -4,6 +4,7 @@
 #include <thread.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <kmem.h>
 
 /* Place your frametable data-structures here 
  * You probably also want to write a frametable initialisation
@@ -16,6 +17,25 @@ size_t table_size = 0;
 
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
+/*
+ * Multi-page kernel allocations (large kmallocs) need physically
+ * contiguous frames, which the free list can't give us. So we set
+ * aside an arena of frames at boot that only multi-page allocations
+ * use, and hand it out first-fit. If the arena is full or too
+ * fragmented we fall back to looking for a free run among the
+ * ordinary frames.
+ *
+ * The arena is 1/ARENA_FRACTION of RAM, within ARENA_MINPAGES and
+ * ARENA_MAXPAGES.
+ */
+#define ARENA_FRACTION 16
+#define ARENA_MINPAGES 16
+#define ARENA_MAXPAGES 256
+
+static size_t arena_first = 0;  // first frame in the arena
+static size_t arena_end = 0;    // one past the last
+static size_t nframes_total = 0;
+
 void frametable_bootstrap(void) {
         paddr_t top_of_ram = ram_getsize();
         size_t nframes =  top_of_ram / PAGE_SIZE;
@@ -32,6 +52,7 @@ void frametable_bootstrap(void) {
         for (size_t i = location / PAGE_SIZE; i < nframes; i++) {
                 frame_table[i].ref_count = 1;
                 frame_table[i].next_free = NULL;
+                frame_table[i].run = 0;
         }
         for (size_t i = 0; i < table_size; i++) {
                 page_table[i] = NULL;
@@ -43,47 +64,121 @@ void frametable_bootstrap(void) {
         for (size_t i = 0; i < highest_used; i++) {
                 frame_table[i].ref_count = 1;
                 frame_table[i].next_free = NULL;
+                frame_table[i].run = 0;
+        }
+
+        // carve the multi-page arena off the bottom of free memory
+        size_t narena = (location / PAGE_SIZE - highest_used) / ARENA_FRACTION;
+        if (narena < ARENA_MINPAGES) {
+                narena = ARENA_MINPAGES;
+        }
+        if (narena > ARENA_MAXPAGES) {
+                narena = ARENA_MAXPAGES;
+        }
+        KASSERT(highest_used + narena < location / PAGE_SIZE);
+        arena_first = highest_used;
+        arena_end = highest_used + narena;
+        for (size_t i = arena_first; i < arena_end; i++) {
+                frame_table[i].ref_count = 0;
+                frame_table[i].next_free = NULL;
+                frame_table[i].run = 0;
         }
-        next_free = &(frame_table[highest_used]);
+        next_free = &(frame_table[arena_end]);
 
         // mark everything else as free memory
-        for (size_t i = highest_used; i < location / PAGE_SIZE; i++) {
+        for (size_t i = arena_end; i < location / PAGE_SIZE; i++) {
                 frame_table[i].ref_count = 0;
                 frame_table[i].next_free = &(frame_table[i + 1]);
+                frame_table[i].run = 0;
         }
         frame_table[(location / PAGE_SIZE) - 1].next_free = NULL;
+        nframes_total = location / PAGE_SIZE;
 }
 
-/* Note that this function returns a VIRTUAL address, not a physical 
- * address
- * WARNING: this function gets called very early, before
- * vm_bootstrap().  You may wish to modify main.c to call your
- * frame table initialisation function, or check to see if the
- * frame table has been initialised and call ram_stealmem() otherwise.
+/*
+ * Find NPAGES free frames in a row between FIRST and END. Returns the
+ * index of the first, or 0 if there's no such run (frame 0 is never
+ * free). Call with stealmem_lock held.
  */
+static size_t find_run(size_t first, size_t end, unsigned npages)
+{
+        size_t start = first;
 
-vaddr_t alloc_kpages(unsigned int npages)
+        for (size_t i = first; i < end; i++) {
+                if (frame_table[i].ref_count != 0) {
+                        start = i + 1;
+                }
+                else if (i + 1 - start == npages) {
+                        return start;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Get NPAGES contiguous frames. Call with stealmem_lock held.
+ */
+static paddr_t alloc_run(unsigned npages)
+{
+        size_t start = find_run(arena_first, arena_end, npages);
+
+        if (start == 0) {
+                // arena can't do it; try the ordinary frames
+                start = find_run(arena_end, nframes_total, npages);
+                if (start == 0) {
+                        return 0;
+                }
+
+                // pull them off the free list
+                struct frame_table_entry **fp = &next_free;
+                while (*fp) {
+                        size_t i = *fp - frame_table;
+                        if (i >= start && i < start + npages) {
+                                *fp = (*fp)->next_free;
+                        }
+                        else {
+                                fp = &(*fp)->next_free;
+                        }
+                }
+        }
+
+        for (size_t i = start; i < start + npages; i++) {
+                frame_table[i].ref_count = 1;
+                frame_table[i].next_free = NULL;
+        }
+        frame_table[start].run = npages;
+        return start * PAGE_SIZE;
+}
+
+/*
+ * Take NPAGES frames off the frame table, or return 0 if we can't.
+ */
+static vaddr_t alloc_frames(unsigned int npages)
 {
         paddr_t addr;
 
-        if (frame_table == NULL) {
+        if (npages > 1) {
                 spinlock_acquire(&stealmem_lock);
-                addr = ram_stealmem(npages);
+                addr = alloc_run(npages);
                 spinlock_release(&stealmem_lock);
 
-                if(addr == 0)
+                if (addr == 0) {
                         return 0;
-
+                }
                 return PADDR_TO_KVADDR(addr);
         }
         else {
-                if (npages != 1) {
-                        return 0;
-                }
-
                 spinlock_acquire(&stealmem_lock);
                 if (next_free == NULL) {
-                        addr = 0;
+                        // last resort: borrow a frame from the arena
+                        size_t i = find_run(arena_first, arena_end, 1);
+                        if (i == 0) {
+                                addr = 0;
+                        }
+                        else {
+                                frame_table[i].ref_count = 1;
+                                addr = PADDR_TO_KVADDR(i * PAGE_SIZE);
+                        }
                 }
                 else {
                         addr = PADDR_TO_KVADDR((next_free - frame_table) * PAGE_SIZE);
@@ -96,6 +191,40 @@ vaddr_t alloc_kpages(unsigned int npages)
         }
 }
 
+/* Note that this function returns a VIRTUAL address, not a physical 
+ * address
+ * WARNING: this function gets called very early, before
+ * vm_bootstrap().  You may wish to modify main.c to call your
+ * frame table initialisation function, or check to see if the
+ * frame table has been initialised and call ram_stealmem() otherwise.
+ */
+
+vaddr_t alloc_kpages(unsigned int npages)
+{
+        paddr_t addr;
+        vaddr_t vaddr;
+
+        if (frame_table == NULL) {
+                spinlock_acquire(&stealmem_lock);
+                addr = ram_stealmem(npages);
+                spinlock_release(&stealmem_lock);
+
+                if(addr == 0)
+                        return 0;
+
+                return PADDR_TO_KVADDR(addr);
+        }
+
+        vaddr = alloc_frames(npages);
+        if (vaddr == 0) {
+                // out of frames; squeeze the kernel heap and try once more
+                kheap_reclaim();
+                kmem_cache_reclaim();
+                vaddr = alloc_frames(npages);
+        }
+        return vaddr;
+}
+
 void free_kpages(vaddr_t addr)
 {
         if (frame_table == NULL) {
@@ -105,10 +234,20 @@ void free_kpages(vaddr_t addr)
         unsigned entry = paddr / PAGE_SIZE;
 
         spinlock_acquire(&stealmem_lock);
-        frame_table[entry].ref_count = 0;
+        KASSERT(frame_table[entry].ref_count == 1);
 
-        frame_table[entry].next_free = next_free;
-        next_free = &frame_table[entry];
+        unsigned npages = frame_table[entry].run > 1 ? frame_table[entry].run : 1;
+        frame_table[entry].run = 0;
+        for (unsigned i = entry; i < entry + npages; i++) {
+                frame_table[i].ref_count = 0;
+
+                // arena frames don't go on the free list
+                if (i >= arena_first && i < arena_end) {
+                        continue;
+                }
+                frame_table[i].next_free = next_free;
+                next_free = &frame_table[i];
+        }
         spinlock_release(&stealmem_lock);
 }
 
@@ -30,6 +30,8 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
 
 /*
@@ -160,10 +162,9 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * One spinlock protects the page lists and pagerefs. Most calls don't
+ * get this far, though; they're served from the per-cpu magazines
+ * (see below), which have their own locks.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -345,6 +346,62 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Map from physical page number to pageref, so kfree doesn't have to
+ * search allbase. This covers the 16M that System/161 can have (see
+ * NUM_PAGEREFPAGES above); anything past that is looked up the slow
+ * way.
+ */
+#define NUM_PAGEMAP TOTAL_PAGEREFS
+static struct pageref *pagemap[NUM_PAGEMAP];
+
+/*
+ * When the last block on a page is freed we don't give the page back
+ * right away; up to KM_KEEPEMPTY completely free pages of each size
+ * stay on sizebases[] so that a workload hovering around a page
+ * boundary doesn't bounce pages in and out of the VM system.
+ * kheap_reclaim() gives them back when memory gets tight.
+ */
+#define KM_KEEPEMPTY 2
+static unsigned nemptypages[NSIZES];
+
+/* Page churn counters; protected by kmalloc_spinlock. */
+static struct {
+	unsigned kh_pagesgotten;	/* pages from alloc_kpages */
+	unsigned kh_pagesfreed;		/* pages given back */
+	unsigned kh_pagesreused;	/* kept empty pages put back in use */
+	unsigned kh_pageskept;		/* empty pages kept */
+	unsigned kh_reclaims;		/* kheap_reclaim calls */
+} kheapstats;
+
+////////////////////////////////////////
+
+/*
+ * Per-cpu caches of free blocks. See the comments with the code.
+ */
+
+#define KM_MAGMAX 16		/* most blocks in one magazine */
+#define KM_MAGBYTES PAGE_SIZE	/* most bytes in one magazine */
+
+struct kmalloc_magazine {
+	unsigned km_count;		/* blocks in km_objs[] */
+	unsigned km_max;		/* capacity for this size */
+	void *km_objs[KM_MAGMAX];
+};
+
+struct kmalloc_cpucache {
+	struct spinlock kc_lock;
+	struct kmalloc_magazine kc_mags[NSIZES];
+	unsigned kc_hits;		/* allocations served here */
+	unsigned kc_misses;		/* allocations that refilled */
+	struct kmalloc_cpucache *kc_next;	/* on allcaches */
+};
+
+/* All the per-cpu caches; protected by kmalloc_spinlock. */
+static struct kmalloc_cpucache *allcaches;
+
+static void kmalloc_drain_magazines(void);
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -635,32 +692,50 @@ establishlabel(void *block, vaddr_t label)
 	return ml;
 }
 
+/*
+ * Set a bit in ISFREE for each block on PR's freelist.
+ */
 static
 void
-dump_subpage(struct pageref *pr, unsigned generation)
+subpage_freemap(struct pageref *pr, uint32_t *isfree, unsigned numfreewords)
 {
 	unsigned blocksize = sizes[PR_BLOCKTYPE(pr)];
-	unsigned numblocks = PAGE_SIZE / blocksize;
-	unsigned numfreewords = DIVROUNDUP(numblocks, 32);
-	uint32_t isfree[numfreewords], mask;
 	vaddr_t prpage;
 	struct freelist *fl;
-	vaddr_t blockaddr;
-	struct malloclabel *ml;
 	unsigned i;
 
 	for (i=0; i<numfreewords; i++) {
 		isfree[i] = 0;
 	}
 
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		return;
+	}
+
 	prpage = PR_PAGEADDR(pr);
 	fl = (struct freelist *)(prpage + pr->freelist_offset);
 	for (; fl != NULL; fl = fl->next) {
 		i = ((vaddr_t)fl - prpage) / blocksize;
-		mask = 1U << (i % 32);
-		isfree[i / 32] |= mask;
+		isfree[i / 32] |= 1U << (i % 32);
 	}
+}
 
+static
+void
+dump_subpage(struct pageref *pr, unsigned generation)
+{
+	unsigned blocksize = sizes[PR_BLOCKTYPE(pr)];
+	unsigned numblocks = PAGE_SIZE / blocksize;
+	unsigned numfreewords = DIVROUNDUP(numblocks, 32);
+	uint32_t isfree[numfreewords], mask;
+	vaddr_t prpage;
+	vaddr_t blockaddr;
+	struct malloclabel *ml;
+	unsigned i;
+
+	subpage_freemap(pr, isfree, numfreewords);
+
+	prpage = PR_PAGEADDR(pr);
 	for (i=0; i<numblocks; i++) {
 		mask = 1U << (i % 32);
 		if (isfree[i / 32] & mask) {
@@ -691,6 +766,128 @@ dump_subpages(unsigned generation)
 	}
 }
 
+/*
+ * Allocation profile: live blocks and bytes per (call site, block
+ * size) pair. This is built while holding kmalloc_spinlock, so it
+ * can't be kmalloc'd; if there are more distinct sites than fit, the
+ * rest are totalled in profoverflow, which may mix block sizes.
+ */
+
+#define NPROFSITES 128
+
+struct profsite {
+	vaddr_t ps_label;
+	unsigned ps_blktype;
+	unsigned ps_count;
+	unsigned long ps_bytes;
+};
+
+static struct profsite profsites[NPROFSITES];
+static unsigned nprofsites;
+static struct profsite profoverflow;
+
+static
+void
+profile_add(vaddr_t label, unsigned blktype)
+{
+	struct profsite *ps;
+	unsigned i;
+
+	for (i=0; i<nprofsites; i++) {
+		if (profsites[i].ps_label == label &&
+		    profsites[i].ps_blktype == blktype) {
+			break;
+		}
+	}
+	if (i < nprofsites) {
+		ps = &profsites[i];
+	}
+	else if (nprofsites < NPROFSITES) {
+		ps = &profsites[nprofsites++];
+		ps->ps_label = label;
+		ps->ps_blktype = blktype;
+		ps->ps_count = 0;
+		ps->ps_bytes = 0;
+	}
+	else {
+		/* table full */
+		ps = &profoverflow;
+	}
+	ps->ps_count++;
+	ps->ps_bytes += sizes[blktype];
+}
+
+static
+void
+profile_subpage(struct pageref *pr)
+{
+	unsigned blktype = PR_BLOCKTYPE(pr);
+	unsigned blocksize = sizes[blktype];
+	unsigned numblocks = PAGE_SIZE / blocksize;
+	unsigned numfreewords = DIVROUNDUP(numblocks, 32);
+	uint32_t isfree[numfreewords];
+	struct malloclabel *ml;
+	unsigned i;
+
+	subpage_freemap(pr, isfree, numfreewords);
+
+	for (i=0; i<numblocks; i++) {
+		if (isfree[i / 32] & (1U << (i % 32))) {
+			continue;
+		}
+		ml = (struct malloclabel *)(PR_PAGEADDR(pr) + i * blocksize);
+		if (ml->label == 0xdeadbeef) {
+			/* free, but sitting in a magazine */
+			continue;
+		}
+		profile_add(ml->label, blktype);
+	}
+}
+
+/*
+ * Print the profile, biggest users (by bytes) first.
+ */
+static
+void
+profile_print(void)
+{
+	struct profsite tmp;
+	unsigned i, j, best;
+	unsigned long totalbytes, totalobjs;
+
+	/* selection sort; there aren't many */
+	for (i=0; i<nprofsites; i++) {
+		best = i;
+		for (j=i+1; j<nprofsites; j++) {
+			if (profsites[j].ps_bytes > profsites[best].ps_bytes) {
+				best = j;
+			}
+		}
+		tmp = profsites[i];
+		profsites[i] = profsites[best];
+		profsites[best] = tmp;
+	}
+
+	kprintf("%-10s %5s %7s %9s\n", "call site", "size", "objects",
+		"bytes");
+	totalbytes = totalobjs = 0;
+	for (i=0; i<nprofsites; i++) {
+		kprintf("0x%08lx %5zu %7u %9lu\n",
+			(unsigned long)profsites[i].ps_label,
+			sizes[profsites[i].ps_blktype],
+			profsites[i].ps_count, profsites[i].ps_bytes);
+		totalbytes += profsites[i].ps_bytes;
+		totalobjs += profsites[i].ps_count;
+	}
+	if (profoverflow.ps_count > 0) {
+		kprintf("%-10s %5s %7u %9lu\n", "(others)", "",
+			profoverflow.ps_count, profoverflow.ps_bytes);
+		totalbytes += profoverflow.ps_bytes;
+		totalobjs += profoverflow.ps_count;
+	}
+	kprintf("%-10s %5s %7lu %9lu\n", "total", "", totalobjs, totalbytes);
+}
+
 #else
 
 #define LABEL_OVERHEAD 0
@@ -720,6 +917,31 @@ kheap_dump(void)
 #endif
 }
 
+/*
+ * Print live subpage allocations totalled by call site. Whole-page
+ * allocations aren't labeled and don't show up.
+ */
+void
+kheap_profile(void)
+{
+#ifdef LABELS
+	struct pageref *pr;
+
+	/* print the whole thing with interrupts off */
+	spinlock_acquire(&kmalloc_spinlock);
+	nprofsites = 0;
+	profoverflow.ps_count = 0;
+	profoverflow.ps_bytes = 0;
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		profile_subpage(pr);
+	}
+	profile_print();
+	spinlock_release(&kmalloc_spinlock);
+#else
+	kprintf("Enable LABELS in kmalloc.c to use this functionality.\n");
+#endif
+}
+
 void
 kheap_dumpall(void)
 {
@@ -801,6 +1023,8 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	struct kmalloc_cpucache *kc;
+	unsigned i;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -811,6 +1035,26 @@ kheap_printstats(void)
 		subpage_stats(pr);
 	}
 
+	kprintf("Per-cpu magazines (blocks cached per size):\n");
+	for (kc = allcaches; kc != NULL; kc = kc->kc_next) {
+		kprintf("  ");
+		for (i=0; i<NSIZES; i++) {
+			kprintf(" %2u", kc->kc_mags[i].km_count);
+		}
+		kprintf("   %u hits, %u misses\n", kc->kc_hits, kc->kc_misses);
+	}
+
+	kprintf("Pages: %u gotten, %u freed, %u kept empty, %u reused, "
+		"%u reclaims\n",
+		kheapstats.kh_pagesgotten, kheapstats.kh_pagesfreed,
+		kheapstats.kh_pageskept, kheapstats.kh_pagesreused,
+		kheapstats.kh_reclaims);
+	kprintf("Empty pages now held:");
+	for (i=0; i<NSIZES; i++) {
+		kprintf(" %u", nemptypages[i]);
+	}
+	kprintf("\n");
+
 	spinlock_release(&kmalloc_spinlock);
 }
 
@@ -867,57 +1111,101 @@ int blocktype(size_t clientsz)
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Find the pageref for the heap page containing PTRADDR, or NULL if
+ * it isn't one of ours.
+ *
+ * This does not need kmalloc_spinlock for pages covered by
+ * pagemap[]: if PTRADDR is a live allocation its page cannot go away
+ * or change block type underneath us, and if it isn't, no page
+ * containing it can turn into a heap page until it's freed. Pages
+ * beyond the end of pagemap[] fall back to searching allbase, which
+ * does need the lock.
  */
 static
-void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+struct pageref *
+subpage_findpage(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+	paddr_t pa;
+
+	pa = KVADDR_TO_PADDR(ptraddr);
+	if (pa / PAGE_SIZE < NUM_PAGEMAP) {
+		return pagemap[pa / PAGE_SIZE];
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (pr = allbase; pr; pr = pr->next_all) {
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+		checksubpage(pr);
+
+		if (ptraddr >= PR_PAGEADDR(pr) &&
+		    ptraddr < PR_PAGEADDR(pr) + PAGE_SIZE) {
+			break;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+	return pr;
+}
+
+/*
+ * Record (or, with PR NULL, forget) the pageref for a heap page.
+ */
+static
+void
+subpage_setpage(vaddr_t prpage, struct pageref *pr)
+{
+	paddr_t pa;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	pa = KVADDR_TO_PADDR(prpage);
+	if (pa / PAGE_SIZE < NUM_PAGEMAP) {
+		pagemap[pa / PAGE_SIZE] = pr;
+	}
+}
+
+/*
+ * Take up to MAX raw blocks of type BLKTYPE off the heap pages and
+ * put them in BLOCKS. Returns the number gotten, which is 0 only if
+ * we're out of memory.
+ */
+static
+unsigned
+subpage_getblocks(unsigned blktype, void **blocks, unsigned max)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
+	unsigned n;		// number of blocks gotten so far
+	bool drained;		// true once we've emptied the magazines
 
 	volatile int i;
 
-#ifdef GUARDS
-	size_t clientsz;
-#endif
-
-#ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-#ifdef GUARDS
-	/* Include the label in what GUARDS considers the client data. */
-	clientsz += LABEL_PTROFFSET;
-#endif
-	sz += LABEL_PTROFFSET;
-#endif
-	blktype = blocktype(sz);
-#ifdef GUARDS
-	sz = sizes[blktype];
-#endif
+	n = 0;
+	drained = false;
 
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+ again:
+	for (pr = sizebases[blktype]; pr != NULL && n < max;
+	     pr = pr->next_samesize) {
 
 		/* check for corruption */
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
 
-		if (pr->nfree > 0) {
+		while (pr->nfree > 0 && n < max) {
+
+			if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+				/* one we kept empty */
+				KASSERT(nemptypages[blktype] > 0);
+				nemptypages[blktype]--;
+				kheapstats.kh_pagesreused++;
+			}
 
 		doalloc: /* comes here after getting a whole fresh page */
 
@@ -926,7 +1214,7 @@ subpage_kmalloc(size_t sz
 			fla = prpage + pr->freelist_offset;
 			fl = (struct freelist *)fla;
 
-			retptr = fl;
+			blocks[n++] = fl;
 			fl = fl->next;
 			pr->nfree--;
 
@@ -940,20 +1228,15 @@ subpage_kmalloc(size_t sz
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
 			}
-#ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
-#endif
-#ifdef LABELS
-			retptr = establishlabel(retptr, label);
-#endif
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
 		}
 	}
 
+	if (n > 0) {
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return n;
+	}
+
 	/*
 	 * No page of the right size available.
 	 * Make a new one.
@@ -966,9 +1249,20 @@ subpage_kmalloc(size_t sz
 	spinlock_release(&kmalloc_spinlock);
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
+		if (!drained) {
+			/*
+			 * Blocks sitting in the per-cpu magazines
+			 * might be holding pages hostage; give them
+			 * back and try again.
+			 */
+			kmalloc_drain_magazines();
+			drained = true;
+			spinlock_acquire(&kmalloc_spinlock);
+			goto again;
+		}
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
-		return NULL;
+		return 0;
 	}
 	KASSERT(prpage % PAGE_SIZE == 0);
 #ifdef CHECKBEEF
@@ -983,8 +1277,9 @@ subpage_kmalloc(size_t sz
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
-		return NULL;
+		return 0;
 	}
+	kheapstats.kh_pagesgotten++;
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
@@ -1013,10 +1308,353 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
+	subpage_setpage(prpage, pr);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
+/*
+ * Put N raw blocks of type BLKTYPE back on their heap pages. The
+ * blocks have already been checked and deadbeefed.
+ */
+static
+void
+subpage_putblocks(unsigned blktype, void **blocks, unsigned n)
+{
+	struct pageref *prs[KM_MAGMAX];
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t ptraddr;	// block address
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+	unsigned i;
+
+	KASSERT(n <= KM_MAGMAX);
+
+	/* Look the pages up first, as that may need the lock itself. */
+	for (i=0; i<n; i++) {
+		prs[i] = subpage_findpage((vaddr_t)blocks[i]);
+		KASSERT(prs[i] != NULL);
+		KASSERT(PR_BLOCKTYPE(prs[i]) == blktype);
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	for (i=0; i<n; i++) {
+		pr = prs[i];
+		checksubpage(pr);
+
+		ptraddr = (vaddr_t)blocks[i];
+		prpage = PR_PAGEADDR(pr);
+		offset = ptraddr - prpage;
+
+		/*
+		 * We probably ought to check for free twice by seeing
+		 * if the block is already on the free list. But that's
+		 * expensive, so we don't.
+		 */
+
+		fl = (struct freelist *)ptraddr;
+		if (pr->freelist_offset == INVALID_OFFSET) {
+			fl->next = NULL;
+		} else {
+			fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+			/* this block should not already be on the free list! */
+#ifdef SLOW
+			{
+				struct freelist *fl2;
+
+				for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+					KASSERT(fl2 != fl);
+				}
+			}
+#else
+			/* check just the head */
+			KASSERT(fl != fl->next);
+#endif
+		}
+		pr->freelist_offset = offset;
+		pr->nfree++;
+
+		KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+		if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+			/* Whole page is free. */
+			if (nemptypages[blktype] < KM_KEEPEMPTY) {
+				/* Hang onto it for now. */
+				nemptypages[blktype]++;
+				kheapstats.kh_pageskept++;
+				continue;
+			}
+			remove_lists(pr, blktype);
+			subpage_setpage(prpage, NULL);
+			freepageref(pr);
+			kheapstats.kh_pagesfreed++;
+			/* Call free_kpages without kmalloc_spinlock. */
+			spinlock_release(&kmalloc_spinlock);
+			free_kpages(prpage);
+			spinlock_acquire(&kmalloc_spinlock);
+		}
+	}
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+}
+
+////////////////////////////////////////
+
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps a small stack ("magazine") of free blocks of each
+ * size in front of the page lists, so most kmalloc and kfree calls
+ * only touch the cpu's own cache and never take kmalloc_spinlock.
+ * When a magazine runs dry we refill half of it from the pages in
+ * one go; when it overflows we send the older half back in one go.
+ *
+ * Blocks sitting in magazines look allocated as far as the page
+ * lists (and kheap_printstats) are concerned.
+ *
+ * The magazines for the big sizes are kept short so a cpu can't
+ * hoard more than about KM_MAGBYTES of each size.
+ *
+ * kc_lock is almost always taken only by the owning cpu; it's there
+ * because a thread can migrate between looking up curcpu's cache and
+ * using it, and so that kmalloc_drain_magazines can empty other cpus'
+ * caches.
+ */
+
+static
+struct kmalloc_magazine *
+kmalloc_mymagazine(unsigned blktype, struct kmalloc_cpucache **ret)
+{
+	struct kmalloc_cpucache *kc;
+
+	if (!CURCPU_EXISTS() || curcpu == NULL) {
+		/* Too early in boot. */
+		return NULL;
+	}
+	kc = curcpu->c_kmalloc;
+	if (kc == NULL) {
+		/* This cpu is still being created. */
+		return NULL;
+	}
+	*ret = kc;
+	return &kc->kc_mags[blktype];
+}
+
+/*
+ * Set up a cache for a new cpu.
+ */
+struct kmalloc_cpucache *
+kmalloc_cpucache_create(void)
+{
+	struct kmalloc_cpucache *kc;
+	unsigned i;
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	spinlock_init(&kc->kc_lock);
+	for (i=0; i<NSIZES; i++) {
+		kc->kc_mags[i].km_count = 0;
+		kc->kc_mags[i].km_max = KM_MAGBYTES / sizes[i];
+		if (kc->kc_mags[i].km_max > KM_MAGMAX) {
+			kc->kc_mags[i].km_max = KM_MAGMAX;
+		}
+		KASSERT(kc->kc_mags[i].km_max >= 2);
+	}
+	kc->kc_hits = 0;
+	kc->kc_misses = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	kc->kc_next = allcaches;
+	allcaches = kc;
+	spinlock_release(&kmalloc_spinlock);
+
+	return kc;
+}
+
+/*
+ * Return everything in every cpu's magazines to the heap pages.
+ */
+static
+void
+kmalloc_drain_magazines(void)
+{
+	struct kmalloc_cpucache *kc;
+	void *blocks[KM_MAGMAX];
+	unsigned i, n;
+
+	/* Caches are never freed, so we can walk the list unlocked. */
+	spinlock_acquire(&kmalloc_spinlock);
+	kc = allcaches;
+	spinlock_release(&kmalloc_spinlock);
+
+	for (; kc != NULL; kc = kc->kc_next) {
+		for (i=0; i<NSIZES; i++) {
+			spinlock_acquire(&kc->kc_lock);
+			n = kc->kc_mags[i].km_count;
+			memcpy(blocks, kc->kc_mags[i].km_objs,
+			       n * sizeof(blocks[0]));
+			kc->kc_mags[i].km_count = 0;
+			spinlock_release(&kc->kc_lock);
+
+			if (n > 0) {
+				subpage_putblocks(i, blocks, n);
+			}
+		}
+	}
+}
+
+/*
+ * Give back to the VM system every heap page we can: first empty the
+ * magazines, then free all the completely free pages we were keeping.
+ * Called by the frame allocator when it runs short. Must not be
+ * called with kmalloc_spinlock held.
+ */
+void
+kheap_reclaim(void)
+{
+	struct pageref *pr;
+	vaddr_t prpage;
+	unsigned i;
+
+	kmalloc_drain_magazines();
+
+	spinlock_acquire(&kmalloc_spinlock);
+	kheapstats.kh_reclaims++;
+	for (i=0; i<NSIZES; i++) {
+ again:
+		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
+			if (pr->nfree == PAGE_SIZE / sizes[i]) {
+				break;
+			}
+		}
+		if (pr == NULL) {
+			continue;
+		}
+
+		KASSERT(nemptypages[i] > 0);
+		nemptypages[i]--;
+		prpage = PR_PAGEADDR(pr);
+		remove_lists(pr, i);
+		subpage_setpage(prpage, NULL);
+		freepageref(pr);
+		kheapstats.kh_pagesfreed++;
+
+		spinlock_release(&kmalloc_spinlock);
+		free_kpages(prpage);
+		spinlock_acquire(&kmalloc_spinlock);
+
+		/* the list may have changed while we were unlocked */
+		goto again;
+	}
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct kmalloc_cpucache *kc;
+	struct kmalloc_magazine *mag;
+	void *blocks[KM_MAGMAX];
+	unsigned n, i;
+	void *retptr;		// our result
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+#ifdef GUARDS
+	sz = sizes[blktype];
+#endif
+
+	mag = kmalloc_mymagazine(blktype, &kc);
+	if (mag == NULL) {
+		if (subpage_getblocks(blktype, &retptr, 1) == 0) {
+			return NULL;
+		}
+		goto gotblock;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	if (mag->km_count > 0) {
+		retptr = mag->km_objs[--mag->km_count];
+		kc->kc_hits++;
+		spinlock_release(&kc->kc_lock);
+		goto gotblock;
+	}
+	kc->kc_misses++;
+	spinlock_release(&kc->kc_lock);
+
+	/*
+	 * Refill without holding kc_lock; the page code may call
+	 * alloc_kpages, which may come back here.
+	 */
+	n = subpage_getblocks(blktype, blocks, mag->km_max / 2);
+	if (n == 0) {
+		return NULL;
+	}
+	retptr = blocks[--n];
+
+	/*
+	 * The rest still have a free list pointer in their first word.
+	 * Overwrite it, so magazine blocks look like freed ones (which
+	 * kfree fills with 0xdeadbeef) to kheap_profile.
+	 */
+	for (i=0; i<n; i++) {
+		*(uint32_t *)blocks[i] = 0xdeadbeef;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	while (n > 0 && mag->km_count < mag->km_max) {
+		mag->km_objs[mag->km_count++] = blocks[--n];
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (n > 0) {
+		/* Somebody else filled it meanwhile. */
+		subpage_putblocks(blktype, blocks, n);
+	}
+
+ gotblock:
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, label);
+#endif
+	return retptr;
+}
+
 /*
  * Free a pointer previously returned from subpage_kmalloc. If the
  * pointer is not on any heap page we recognize, return -1.
@@ -1029,9 +1667,11 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
+	struct kmalloc_cpucache *kc;
+	struct kmalloc_magazine *mag;
+	void *blocks[KM_MAGMAX];
+	unsigned n;
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
 #endif
@@ -1061,34 +1701,16 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = subpage_findpage(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype >= 0 && blktype < NSIZES);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1108,57 +1730,39 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	mag = kmalloc_mymagazine(blktype, &kc);
+	if (mag == NULL) {
+		blocks[0] = (void *)ptraddr;
+		subpage_putblocks(blktype, blocks, 1);
+		return 0;
+	}
 
-		/* this block should not already be on the free list! */
+	spinlock_acquire(&kc->kc_lock);
 #ifdef SLOW
-		{
-			struct freelist *fl2;
-
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
+	/* this block should not already be in the magazine! */
+	for (n=0; n<mag->km_count; n++) {
+		KASSERT(mag->km_objs[n] != (void *)ptraddr);
+	}
 #endif
+	if (mag->km_count < mag->km_max) {
+		mag->km_objs[mag->km_count++] = (void *)ptraddr;
+		spinlock_release(&kc->kc_lock);
+		return 0;
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
-	}
+	/* Full; send the older (bottom) half back to the pages. */
+	n = mag->km_max / 2;
+	memcpy(blocks, mag->km_objs, n * sizeof(blocks[0]));
+	memmove(mag->km_objs, mag->km_objs + n,
+		(mag->km_count - n) * sizeof(blocks[0]));
+	mag->km_count -= n;
+	mag->km_objs[mag->km_count++] = (void *)ptraddr;
+	spinlock_release(&kc->kc_lock);
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
+	subpage_putblocks(blktype, blocks, n);
 
 	return 0;
 }
-
 //
 ////////////////////////////////////////////////////////////
 
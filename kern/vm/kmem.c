@@ -0,0 +1,431 @@
+/*
+ * Typed object caches (see kmem.h).
+ *
+ * Each slab is one page. The page starts with a struct kmem_slab,
+ * followed by a stack of the indexes of the free objects, a bitmap of
+ * which objects have been constructed, and then the objects
+ * themselves. Keeping the free list out of line means free objects
+ * stay exactly as the constructor (or the last user) left them.
+ *
+ * A cache keeps the slabs that have any free objects on ks_partial;
+ * full slabs are on no list. It holds onto one completely empty slab
+ * so that an alloc/free pair at the boundary doesn't bounce a page in
+ * and out of the VM system; any further empty slabs are destructed
+ * and given back.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmem.h>
+
+struct kmem_slab {
+	struct kmem_cache *sl_cache;	/* cache we belong to */
+	struct kmem_slab *sl_next;	/* on kc_partial */
+	struct kmem_slab **sl_prevp;	/* NULL if not on kc_partial */
+	unsigned sl_nfree;		/* number of free objects */
+	uint16_t *sl_free;		/* stack of free object indexes */
+	uint32_t *sl_constructed;	/* bitmap of constructed objects */
+	vaddr_t sl_objs;		/* address of object 0 */
+};
+
+struct kmem_cache {
+	char *kc_name;
+	size_t kc_size;			/* object size, rounded */
+	unsigned kc_perslab;		/* objects per slab */
+	int (*kc_ctor)(void *);
+	void (*kc_dtor)(void *);
+
+	struct spinlock kc_lock;
+	struct kmem_slab *kc_partial;	/* slabs with free objects */
+	struct kmem_slab *kc_empty;	/* one spare empty slab, or NULL */
+
+	/* statistics; protected by kc_lock */
+	unsigned kc_nslabs;		/* slabs held */
+	unsigned kc_inuse;		/* objects allocated */
+	unsigned kc_allocs;		/* total kmem_cache_alloc calls */
+	unsigned kc_ctors;		/* constructor calls */
+	unsigned kc_slabfrees;		/* slabs given back */
+
+	struct kmem_cache *kc_next;	/* on allcaches */
+};
+
+/* All caches, for kmem_cache_printstats. */
+static struct kmem_cache *allcaches;
+static struct spinlock allcaches_lock = SPINLOCK_INITIALIZER;
+
+/* Alignment of objects within a slab. */
+#define KMEM_ALIGN 8
+
+/*
+ * Figure out how many objects of size SIZE fit on a slab page.
+ */
+static
+unsigned
+kmem_perslab(size_t size)
+{
+	unsigned n;
+	size_t hdr;
+
+	for (n = PAGE_SIZE / size; n > 0; n--) {
+		hdr = sizeof(struct kmem_slab);
+		hdr += n * sizeof(uint16_t);
+		hdr = ROUNDUP(hdr, sizeof(uint32_t));
+		hdr += DIVROUNDUP(n, 32) * sizeof(uint32_t);
+		hdr = ROUNDUP(hdr, KMEM_ALIGN);
+		if (hdr + n * size <= PAGE_SIZE) {
+			return n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Create a cache.
+ */
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *), void (*dtor)(void *))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0 && size <= KMEM_MAXOBJSIZE);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = kstrdup(name);
+	if (kc->kc_name == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+
+	/* sizeof a struct is already a multiple of its alignment */
+	kc->kc_size = ROUNDUP(size, sizeof(uint32_t));
+	kc->kc_perslab = kmem_perslab(kc->kc_size);
+	KASSERT(kc->kc_perslab > 0);
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = NULL;
+	kc->kc_empty = NULL;
+
+	kc->kc_nslabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_allocs = 0;
+	kc->kc_ctors = 0;
+	kc->kc_slabfrees = 0;
+
+	spinlock_acquire(&allcaches_lock);
+	kc->kc_next = allcaches;
+	allcaches = kc;
+	spinlock_release(&allcaches_lock);
+
+	return kc;
+}
+
+/*
+ * Get a fresh slab page for KC and set it up. Called without kc_lock.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *sl;
+	vaddr_t va, p;
+	unsigned i;
+
+	va = alloc_kpages(1);
+	if (va == 0) {
+		return NULL;
+	}
+
+	sl = (struct kmem_slab *)va;
+	sl->sl_cache = kc;
+	sl->sl_next = NULL;
+	sl->sl_prevp = NULL;
+	sl->sl_nfree = kc->kc_perslab;
+
+	p = va + sizeof(struct kmem_slab);
+	sl->sl_free = (uint16_t *)p;
+	p += kc->kc_perslab * sizeof(uint16_t);
+	p = ROUNDUP(p, sizeof(uint32_t));
+	sl->sl_constructed = (uint32_t *)p;
+	p += DIVROUNDUP(kc->kc_perslab, 32) * sizeof(uint32_t);
+	p = ROUNDUP(p, KMEM_ALIGN);
+	sl->sl_objs = p;
+	KASSERT(p + kc->kc_perslab * kc->kc_size <= va + PAGE_SIZE);
+
+	/* Hand out low addresses first. */
+	for (i=0; i<kc->kc_perslab; i++) {
+		sl->sl_free[i] = kc->kc_perslab - 1 - i;
+	}
+	for (i=0; i<DIVROUNDUP(kc->kc_perslab, 32); i++) {
+		sl->sl_constructed[i] = 0;
+	}
+
+	return sl;
+}
+
+/*
+ * Destruct whatever objects on a slab were constructed and give the
+ * page back. Called without kc_lock; the slab must be off all lists.
+ */
+static
+void
+kmem_slab_destroy(struct kmem_cache *kc, struct kmem_slab *sl)
+{
+	unsigned i;
+
+	KASSERT(sl->sl_nfree == kc->kc_perslab);
+	KASSERT(sl->sl_prevp == NULL);
+
+	if (kc->kc_dtor != NULL) {
+		for (i=0; i<kc->kc_perslab; i++) {
+			if (sl->sl_constructed[i/32] & (1U << (i%32))) {
+				kc->kc_dtor((void *)(sl->sl_objs +
+						     i * kc->kc_size));
+			}
+		}
+	}
+	free_kpages((vaddr_t)sl);
+}
+
+static
+void
+kmem_slab_link(struct kmem_cache *kc, struct kmem_slab *sl)
+{
+	KASSERT(sl->sl_prevp == NULL);
+	sl->sl_next = kc->kc_partial;
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prevp = &sl->sl_next;
+	}
+	sl->sl_prevp = &kc->kc_partial;
+	kc->kc_partial = sl;
+}
+
+static
+void
+kmem_slab_unlink(struct kmem_slab *sl)
+{
+	KASSERT(sl->sl_prevp != NULL);
+	*sl->sl_prevp = sl->sl_next;
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prevp = sl->sl_prevp;
+	}
+	sl->sl_next = NULL;
+	sl->sl_prevp = NULL;
+}
+
+/*
+ * Allocate an object.
+ */
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *sl;
+	unsigned index;
+	uint32_t mask;
+	bool constructed;
+	void *obj;
+	int result;
+
+	spinlock_acquire(&kc->kc_lock);
+	while ((sl = kc->kc_partial) == NULL && kc->kc_empty == NULL) {
+		/* Don't call alloc_kpages with our lock held. */
+		spinlock_release(&kc->kc_lock);
+		sl = kmem_slab_create(kc);
+		if (sl == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		kc->kc_nslabs++;
+		kmem_slab_link(kc, sl);
+	}
+	if (sl == NULL) {
+		/* Reuse the spare. */
+		sl = kc->kc_empty;
+		kc->kc_empty = NULL;
+		kmem_slab_link(kc, sl);
+	}
+
+	KASSERT(sl->sl_nfree > 0);
+	index = sl->sl_free[--sl->sl_nfree];
+	KASSERT(index < kc->kc_perslab);
+	if (sl->sl_nfree == 0) {
+		kmem_slab_unlink(sl);
+	}
+
+	mask = 1U << (index % 32);
+	constructed = (sl->sl_constructed[index / 32] & mask) != 0;
+	sl->sl_constructed[index / 32] |= mask;
+
+	kc->kc_inuse++;
+	kc->kc_allocs++;
+	if (!constructed && kc->kc_ctor != NULL) {
+		kc->kc_ctors++;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	obj = (void *)(sl->sl_objs + index * kc->kc_size);
+
+	if (!constructed && kc->kc_ctor != NULL) {
+		result = kc->kc_ctor(obj);
+		if (result) {
+			/* Put it back as not constructed. */
+			spinlock_acquire(&kc->kc_lock);
+			sl->sl_constructed[index / 32] &= ~mask;
+			spinlock_release(&kc->kc_lock);
+			kmem_cache_free(kc, obj);
+			return NULL;
+		}
+	}
+
+	return obj;
+}
+
+/*
+ * Free an object.
+ */
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *sl, *spare;
+	vaddr_t offset;
+	unsigned index;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	sl = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(sl->sl_cache == kc);
+	offset = (vaddr_t)obj - sl->sl_objs;
+	index = offset / kc->kc_size;
+	if (offset % kc->kc_size != 0 || index >= kc->kc_perslab) {
+		panic("kmem_cache_free: %s: invalid object %p\n",
+		      kc->kc_name, obj);
+	}
+
+	spare = NULL;
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(sl->sl_nfree < kc->kc_perslab);
+	if (sl->sl_nfree == 0) {
+		/* was full */
+		kmem_slab_link(kc, sl);
+	}
+	sl->sl_free[sl->sl_nfree++] = index;
+	kc->kc_inuse--;
+
+	if (sl->sl_nfree == kc->kc_perslab) {
+		kmem_slab_unlink(sl);
+		if (kc->kc_empty == NULL) {
+			kc->kc_empty = sl;
+		}
+		else {
+			spare = sl;
+			kc->kc_nslabs--;
+			kc->kc_slabfrees++;
+		}
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (spare != NULL) {
+		kmem_slab_destroy(kc, spare);
+	}
+}
+
+/*
+ * Destroy a cache.
+ */
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **kcp;
+	struct kmem_slab *sl;
+
+	KASSERT(kc->kc_inuse == 0);
+
+	spinlock_acquire(&allcaches_lock);
+	for (kcp = &allcaches; *kcp != kc; kcp = &(*kcp)->kc_next) {
+		KASSERT(*kcp != NULL);
+	}
+	*kcp = kc->kc_next;
+	spinlock_release(&allcaches_lock);
+
+	/* With nothing in use, every slab is empty. */
+	while ((sl = kc->kc_partial) != NULL) {
+		kmem_slab_unlink(sl);
+		kmem_slab_destroy(kc, sl);
+	}
+	if (kc->kc_empty != NULL) {
+		kmem_slab_destroy(kc, kc->kc_empty);
+	}
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc->kc_name);
+	kfree(kc);
+}
+
+/*
+ * Give back every cache's spare empty slab. Called when physical
+ * memory runs short.
+ */
+void
+kmem_cache_reclaim(void)
+{
+	struct kmem_cache *kc;
+	struct kmem_slab *sl, *spares;
+
+	spares = NULL;
+
+	spinlock_acquire(&allcaches_lock);
+	for (kc = allcaches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		sl = kc->kc_empty;
+		if (sl != NULL) {
+			kc->kc_empty = NULL;
+			kc->kc_nslabs--;
+			kc->kc_slabfrees++;
+			sl->sl_next = spares;
+			spares = sl;
+		}
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&allcaches_lock);
+
+	/* Run the destructors without holding any spinlocks. */
+	while (spares != NULL) {
+		sl = spares;
+		spares = sl->sl_next;
+		sl->sl_next = NULL;
+		kmem_slab_destroy(sl->sl_cache, sl);
+	}
+}
+
+/*
+ * Print statistics for all caches.
+ */
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	kprintf("Object caches:\n");
+	kprintf("%-16s %5s %5s %6s %7s %9s %7s %7s\n",
+		"name", "size", "/slab", "slabs", "in use", "allocs",
+		"ctors", "freed");
+
+	spinlock_acquire(&allcaches_lock);
+	for (kc = allcaches; kc != NULL; kc = kc->kc_next) {
+		kprintf("%-16s %5zu %5u %6u %7u %9u %7u %7u\n",
+			kc->kc_name, kc->kc_size, kc->kc_perslab,
+			kc->kc_nslabs, kc->kc_inuse, kc->kc_allocs,
+			kc->kc_ctors, kc->kc_slabfrees);
+	}
+	spinlock_release(&allcaches_lock);
+}
@@ -8,10 +8,20 @@
 #include <thread.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <kmem.h>
+#include <cpustats.h>
 #include <machine/tlb.h>
 
 /* Place your page table functions here */
-static struct lock *page_table_lock;
+
+/*
+ * Faults only read the page table unless they have to add a page, so
+ * let them look things up in parallel.
+ */
+static struct rwlock *page_table_lock;
+
+/* Page table entries come from their own object cache. */
+static struct kmem_cache *pte_cache;
 
 static uint32_t hpt_hash(struct addrspace *as, vaddr_t faultaddr)
 {
@@ -28,7 +38,12 @@ void vm_bootstrap(void)
            frame table here as well.
         */
         frametable_bootstrap();
-        page_table_lock = lock_create("page_table_lock");
+        page_table_lock = rwlock_create("page_table_lock");
+        pte_cache = kmem_cache_create("pte", sizeof(struct page_table_entry),
+                                      NULL, NULL);
+        if (pte_cache == NULL) {
+                panic("vm_bootstrap: Out of memory\n");
+        }
 }
 
 static as_region find_region(struct addrspace *as, vaddr_t faultaddress)
@@ -45,7 +60,7 @@ void vm_destroy(struct addrspace *as)
 {
         size_t i;
         for(i = 0; i < table_size; i++){
-                lock_acquire(page_table_lock);
+                rwlock_acquire_write(page_table_lock);
                 struct page_table_entry *cur = page_table[i], *prev = NULL;
 
                 while(cur){
@@ -60,7 +75,7 @@ void vm_destroy(struct addrspace *as)
                                 if(cur->elo & PAGE_FRAME){
                                         free_kpages(PADDR_TO_KVADDR(cur->elo & PAGE_FRAME));
                                 }
-                                kfree(cur);
+                                kmem_cache_free(pte_cache, cur);
 
                                 cur = prev ? prev->next : page_table[i];
                         }
@@ -69,7 +84,7 @@ void vm_destroy(struct addrspace *as)
                                 cur = cur->next;
                         }
                 }
-                lock_release(page_table_lock);
+                rwlock_release_write(page_table_lock);
         }
 }
 
@@ -79,20 +94,20 @@ int vm_copy(struct addrspace *old, struct addrspace *newas)
         for(i = 0; i < table_size; i++){
                 struct page_table_entry *cur;
 
-                lock_acquire(page_table_lock);
+                rwlock_acquire_write(page_table_lock);
                 for(cur = page_table[i]; cur; cur = cur->next){
                         if(cur->pid == (uint32_t) old){
 
-                                struct page_table_entry *new = kmalloc(sizeof(struct page_table_entry));
+                                struct page_table_entry *new = kmem_cache_alloc(pte_cache);
                                 if(!new){
-                                        lock_release(page_table_lock);
+                                        rwlock_release_write(page_table_lock);
                                         return ENOMEM;
                                 }
 
                                 new->elo = KVADDR_TO_PADDR(alloc_kpages(1));
                                 if(!new->elo){
-                                        kfree(new);
-                                        lock_release(page_table_lock);
+                                        kmem_cache_free(pte_cache, new);
+                                        rwlock_release_write(page_table_lock);
                                         return ENOMEM;
                                 }
 
@@ -108,7 +123,7 @@ int vm_copy(struct addrspace *old, struct addrspace *newas)
                                 page_table[hash] = new;
                         }
                 }
-                lock_release(page_table_lock);
+                rwlock_release_write(page_table_lock);
         }
 
         return 0;
@@ -151,7 +166,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         uint32_t elo;
         uint32_t hash = hpt_hash(as, faultaddress);
 
-        lock_acquire(page_table_lock);
+        rwlock_acquire_read(page_table_lock);
         struct page_table_entry *entry = page_table[hash];
 
         bool found = false;
@@ -164,7 +179,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
                 }
                 entry = entry->next;
         }
-        lock_release(page_table_lock);
+        rwlock_release_read(page_table_lock);
 
         if (found == false) {
                 as_region region = find_region(as, full_faultaddress);
@@ -172,13 +187,14 @@ vm_fault(int faulttype, vaddr_t faultaddress)
                         return EFAULT;
                 }
 
+                CPUSTAT_INC(CPUSTAT_PAGEFAULTS);
                 vaddr_t vaddr = alloc_kpages(1);
                 if (vaddr == 0) {
                         return ENOMEM;
                 }
                 bzero((void*) vaddr, PAGE_SIZE);
 
-                struct page_table_entry *new = kmalloc(sizeof(struct page_table_entry));
+                struct page_table_entry *new = kmem_cache_alloc(pte_cache);
                 if (!new) {
                         free_kpages(vaddr);
                         return ENOMEM;
@@ -191,10 +207,10 @@ vm_fault(int faulttype, vaddr_t faultaddress)
                         new->elo |= TLBLO_DIRTY;
                 }
 
-                lock_acquire(page_table_lock);
+                rwlock_acquire_write(page_table_lock);
                 new->next = page_table[hash];
                 page_table[hash] = new;
-                lock_release(page_table_lock);
+                rwlock_release_write(page_table_lock);
 
                 elo = new->elo;
         }
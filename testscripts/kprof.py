@@ -0,0 +1,130 @@
+#!/usr/pkg/bin/python2.7
+# kprof.py - symbolize the output of the kernel's "prof dump" command
+# usage: kprof.py [options] kernel [logfile]
+# options:
+#    --nm=PROG		nm program to use (default mips-harvard-os161-nm)
+#    --cpus		Also break the histogram down by cpu
+#    --top=N		Only show the N busiest functions (default all)
+#
+# Reads the console output of a kernel run (from logfile, or stdin),
+# picks out the kprof-pc lines that "prof dump" prints, and resolves
+# each sampled address against the symbol table of the kernel image,
+# which must be the same build that produced the samples. Prints the
+# samples grouped by function, busiest first. The kprof-pid lines and
+# the summary line are passed through unchanged.
+#
+
+import sys
+import subprocess
+from bisect import bisect_right
+from optparse import OptionParser
+
+############################################################
+# global settings
+
+g_nm = "mips-harvard-os161-nm"
+g_cpus = False
+g_top = None
+
+############################################################
+# symbols
+
+#
+# Return sorted lists of (address, name) for the text symbols in
+# the kernel image.
+#
+def loadsyms(kernel):
+	p = subprocess.Popen([g_nm, "-n", kernel], stdout=subprocess.PIPE,
+			     universal_newlines=True)
+	addrs = []
+	names = []
+	for line in p.stdout:
+		f = line.split()
+		if len(f) != 3 or f[1] not in "tTwW":
+			continue
+		addrs.append(int(f[0], 16))
+		names.append(f[2])
+	if p.wait() != 0:
+		sys.stderr.write("kprof.py: %s failed on %s\n" % (g_nm, kernel))
+		exit(1)
+	return (addrs, names)
+# end loadsyms
+
+def lookup(syms, pc):
+	(addrs, names) = syms
+	i = bisect_right(addrs, pc)
+	if i == 0:
+		return "0x%08x" % pc
+	return names[i - 1]
+# end lookup
+
+############################################################
+# main
+
+def getargs():
+	global g_nm
+	global g_cpus
+	global g_top
+
+	p = OptionParser()
+	p.add_option("-n", "--nm", dest="nm")
+	p.add_option("-c", "--cpus", dest="cpus", action="store_true")
+	p.add_option("-t", "--top", dest="top")
+
+	(options, args) = p.parse_args()
+	if options.nm is not None:
+		g_nm = options.nm
+	if options.cpus is not None:
+		g_cpus = True
+	if options.top is not None:
+		g_top = int(options.top)
+
+	if len(args) < 1 or len(args) > 2:
+		sys.stderr.write("Usage: kprof.py [options] kernel [logfile]\n")
+		exit(1)
+	return args
+# end getargs
+
+args = getargs()
+syms = loadsyms(args[0])
+if len(args) == 2:
+	log = open(args[1])
+else:
+	log = sys.stdin
+
+funcs = {}
+percpu = {}
+total = 0
+for line in log:
+	f = line.split()
+	if len(f) == 0:
+		continue
+	if f[0] == "kprof-pid" or f[0] == "kprof:":
+		sys.stdout.write(line)
+		continue
+	if f[0] != "kprof-pc" or len(f) != 4:
+		continue
+	cpu = int(f[1])
+	name = lookup(syms, int(f[2], 16))
+	count = int(f[3])
+	funcs[name] = funcs.get(name, 0) + count
+	percpu[(name, cpu)] = percpu.get((name, cpu), 0) + count
+	total += count
+
+if total == 0:
+	sys.stderr.write("kprof.py: no kernel samples found\n")
+	exit(1)
+
+cpus = sorted(set([cpu for (name, cpu) in percpu.keys()]))
+ranked = sorted(funcs.items(), key=lambda x: (-x[1], x[0]))
+if g_top is not None:
+	ranked = ranked[:g_top]
+
+for (name, count) in ranked:
+	line = "%8d %5.1f%%  %s" % (count, 100.0 * count / total, name)
+	if g_cpus:
+		line += "  [" + " ".join(["%d:%d" % (cpu, percpu.get((name, cpu), 0))
+					  for cpu in cpus]) + "]"
+	print(line)
+print("%8d samples in the kernel" % total)
+exit(0)
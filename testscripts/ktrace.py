@@ -0,0 +1,145 @@
+#!/usr/pkg/bin/python2.7
+# ktrace.py - decode a kernel event trace written by "trace dump"
+# usage: ktrace.py [options] tracefile
+# options:
+#    --merge		Interleave the cpus by timestamp (default: one
+#			cpu after another)
+#    --summary		Only print the summary
+#
+# Prints one line per record: time in microseconds, cpu, pid, event,
+# and argument, then a summary with the number of each event and the
+# average and maximum fault and syscall latencies. The file format is
+# described in kern/include/kern/ktrace.h.
+#
+# Cycle counters on different cpus are not synchronized, so merged
+# output is only approximately in order across cpus, and an entry/exit
+# pair is only timed if both ends were recorded on the same cpu.
+#
+
+import sys
+import struct
+from optparse import OptionParser
+
+############################################################
+# file format (must match kern/include/kern/ktrace.h)
+
+KTRACE_MAGIC = 0x6b747263
+KTRACE_VERSION = 1
+HEADER = ">6I"
+RECORD = ">QIHBB"
+
+EVENTS = {
+	1: "fault",
+	2: "faultdone",
+	3: "syscall",
+	4: "syscalldone",
+	5: "switch",
+	6: "diskstart",
+	7: "diskdone",
+}
+
+# entry event -> exit event, for latencies
+PAIRS = { 1: 2, 3: 4 }
+
+############################################################
+# global settings
+
+g_merge = False
+g_summary = False
+
+############################################################
+# decoding
+
+def readtrace(name):
+	f = open(name, "rb")
+	data = f.read()
+	f.close()
+
+	hsize = struct.calcsize(HEADER)
+	rsize = struct.calcsize(RECORD)
+	if len(data) < hsize:
+		sys.stderr.write("ktrace.py: %s: too short\n" % name)
+		exit(1)
+	(magic, version, rate, ncpus, nrecords, lost) = \
+		struct.unpack(HEADER, data[:hsize])
+	if magic != KTRACE_MAGIC or version != KTRACE_VERSION:
+		sys.stderr.write("ktrace.py: %s: not a version %d trace\n" %
+				 (name, KTRACE_VERSION))
+		exit(1)
+	if len(data) < hsize + nrecords * rsize:
+		sys.stderr.write("ktrace.py: %s: truncated\n" % name)
+		nrecords = (len(data) - hsize) // rsize
+
+	records = []
+	for i in range(nrecords):
+		pos = hsize + i * rsize
+		records.append(struct.unpack(RECORD, data[pos:pos + rsize]))
+	return (rate, ncpus, lost, records)
+# end readtrace
+
+def describe(event, arg):
+	if event == 1:
+		return "0x%08x" % arg
+	if event in (2, 4, 7):
+		if arg == 0:
+			return "ok"
+		return "error %d" % arg
+	return "%d" % arg
+# end describe
+
+############################################################
+# main
+
+def getargs():
+	global g_merge
+	global g_summary
+
+	p = OptionParser()
+	p.add_option("-m", "--merge", dest="merge", action="store_true")
+	p.add_option("-s", "--summary", dest="summary", action="store_true")
+
+	(options, args) = p.parse_args()
+	if options.merge is not None:
+		g_merge = True
+	if options.summary is not None:
+		g_summary = True
+
+	if len(args) != 1:
+		sys.stderr.write("Usage: ktrace.py [options] tracefile\n")
+		exit(1)
+	return args[0]
+# end getargs
+
+(rate, ncpus, lost, records) = readtrace(getargs())
+if g_merge:
+	records.sort(key=lambda r: r[0])
+
+counts = {}
+pending = {}
+latency = {}
+for (time, arg, pid, event, cpu) in records:
+	usecs = time * 1000000.0 / rate
+	if not g_summary:
+		print("%14.1f %2d %5d %-12s %s" % (usecs, cpu, pid,
+			EVENTS.get(event, "event%d" % event),
+			describe(event, arg)))
+	counts[event] = counts.get(event, 0) + 1
+	if event in PAIRS:
+		pending[(pid, PAIRS[event])] = (cpu, usecs)
+	elif (pid, event) in pending:
+		(startcpu, start) = pending.pop((pid, event))
+		if startcpu == cpu:
+			(n, total, worst) = latency.get(event, (0, 0.0, 0.0))
+			latency[event] = (n + 1, total + usecs - start,
+					  max(worst, usecs - start))
+
+print("%d records from %d cpus, %d lost" % (len(records), ncpus, lost))
+for event in sorted(counts.keys()):
+	line = "%-12s %8d" % (EVENTS.get(event, "event%d" % event),
+			      counts[event])
+	if event in latency:
+		(n, total, worst) = latency[event]
+		line += "   avg %.1f us, max %.1f us (%d timed)" % \
+			(total / n, worst, n)
+	print(line)
+exit(0)
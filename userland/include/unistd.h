@@ -38,6 +38,7 @@
  * kernel includes. This way user-level code doesn't need to know
  * about the kern/ headers.
  */
+#include <kern/cpustats.h>
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
 #include <kern/reboot.h>
@@ -148,6 +149,8 @@ int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
 ssize_t __getcwd(char *buf, size_t buflen);
+int setaffinity(int cpunum);
+int cpustats(int cpunum, unsigned *counts);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -163,6 +163,9 @@ dumpsb(void)
 		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
 	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
 	dumplval("Volume name", sb.sb_volname);
+	dumpvalf("Flags", "0x%x%s", SWAP32(sb.sb_flags),
+		 (SWAP32(sb.sb_flags) & SFS_SBF_EXTENTS) ?
+		 " (extents)" : "");
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
 		if (sb.reserved[i] != 0) {
@@ -228,10 +231,15 @@ dumpfreemap(uint32_t fsblocks)
 	printf("\n");
 }
 
+/*
+ * Dump indirect block BLOCK, which is at indirection LEVEL (1 for a
+ * single indirect block), and the blocks under it.
+ */
 static
 void
-dumpindirect(uint32_t block)
+dumpindirect(uint32_t block, unsigned level)
 {
+	static const char *const names[] = { "", "", "Double ", "Triple " };
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	char tmp[128];
 	unsigned i;
@@ -239,7 +247,8 @@ dumpindirect(uint32_t block)
 	if (block == 0) {
 		return;
 	}
-	printf("Indirect block %u\n", block);
+	assert(level >= 1 && level <= 3);
+	printf("%sIndirect block %u\n", names[level], block);
 
 	diskread(ib, block);
 	for (i=0; i<ARRAYCOUNT(ib); i++) {
@@ -253,12 +262,21 @@ dumpindirect(uint32_t block)
 			printf("\n");
 		}
 	}
+	if (level > 1) {
+		for (i=0; i<ARRAYCOUNT(ib); i++) {
+			dumpindirect(SWAP32(ib[i]), level - 1);
+		}
+	}
 }
 
+/*
+ * Call DOBLOCK for each block mapped by indirect block BLOCK, which
+ * is at indirection LEVEL, up to NUMBLOCKS.
+ */
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
-	    void (*doblock)(uint32_t, uint32_t))
+	    unsigned level, void (*doblock)(uint32_t, uint32_t))
 {
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	unsigned i;
@@ -270,11 +288,56 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 		diskread(ib, block);
 	}
 	for (i=0; i<ARRAYCOUNT(ib) && fileblock < numblocks; i++) {
-		doblock(fileblock++, SWAP32(ib[i]));
+		if (level > 1) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(ib[i]), level - 1,
+						doblock);
+		}
+		else {
+			doblock(fileblock++, SWAP32(ib[i]));
+		}
 	}
 	return fileblock;
 }
 
+/*
+ * Extent inodes: the extents are sorted by file block, and anything
+ * not covered by one is a hole.
+ */
+static
+void
+traverse_ext(const struct sfs_dinode *sfi, uint32_t numblocks,
+	     void (*doblock)(uint32_t, uint32_t))
+{
+	const struct sfs_extent *ext;
+	uint32_t fileblock, start, len, block;
+	unsigned i, nextents;
+
+	nextents = SWAP32(sfi->sfi_nextents);
+	if (nextents > SFS_NEXTENTS) {
+		nextents = SFS_NEXTENTS;
+	}
+
+	i = 0;
+	for (fileblock=0; fileblock<numblocks; fileblock++) {
+		block = 0;
+		while (i < nextents) {
+			ext = &sfi->sfi_extents[i];
+			start = SWAP32(ext->sfe_fileblock);
+			len = SWAP32(ext->sfe_len);
+			if (fileblock < start + len) {
+				if (fileblock >= start) {
+					block = SWAP32(ext->sfe_block) +
+						(fileblock - start);
+				}
+				break;
+			}
+			i++;
+		}
+		doblock(fileblock, block);
+	}
+}
+
 static
 void
 traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
@@ -285,13 +348,26 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 
 	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), SFS_BLOCKSIZE);
 
+	if (SWAP32(sfi->sfi_flags) & SFS_IF_EXTENTS) {
+		traverse_ext(sfi, numblocks, doblock);
+		return;
+	}
+
 	fileblock = 0;
 	for (i=0; i<SFS_NDIRECT && fileblock < numblocks; i++) {
 		doblock(fileblock++, SWAP32(sfi->sfi_direct[i]));
 	}
 	if (fileblock < numblocks) {
 		fileblock = traverse_ib(fileblock, numblocks,
-					SWAP32(sfi->sfi_indirect), doblock);
+					SWAP32(sfi->sfi_indirect), 1, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_dindirect), 2, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_tindirect), 3, doblock);
 	}
 	assert(fileblock == numblocks);
 }
@@ -449,8 +525,22 @@ dumpinode(uint32_t ino, const char *name)
 	dumpvalf("Type", "%u (%s)", SWAP16(sfi.sfi_type), typename);
 	dumpvalf("Size", "%u", SWAP32(sfi.sfi_size));
 	dumpvalf("Link count", "%u", SWAP16(sfi.sfi_linkcount));
+	dumpvalf("Flags", "0x%x%s", SWAP32(sfi.sfi_flags),
+		 (SWAP32(sfi.sfi_flags) & SFS_IF_EXTENTS) ? " (extents)" : "");
 	printf("\n");
 
+	if (SWAP32(sfi.sfi_flags) & SFS_IF_EXTENTS) {
+		printf("    Extents: %u\n", SWAP32(sfi.sfi_nextents));
+		for (i=0; i<SFS_NEXTENTS && i<SWAP32(sfi.sfi_nextents); i++) {
+			printf("@%-2u      file blocks %u-%u at %u (0x%x)\n", i,
+			       SWAP32(sfi.sfi_extents[i].sfe_fileblock),
+			       SWAP32(sfi.sfi_extents[i].sfe_fileblock) +
+			       SWAP32(sfi.sfi_extents[i].sfe_len) - 1,
+			       SWAP32(sfi.sfi_extents[i].sfe_block),
+			       SWAP32(sfi.sfi_extents[i].sfe_block));
+		}
+	}
+
         printf("    Direct blocks:\n");
         for (i=0; i<SFS_NDIRECT; i++) {
 		if (i % 4 == 0) {
@@ -476,6 +566,10 @@ dumpinode(uint32_t ino, const char *name)
 	}
 	printf("    Indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
+	printf("    Triple indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
 	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
 		if (sfi.sfi_waste[i] != 0) {
 			printf("    Word %u in waste area: 0x%x\n",
@@ -484,7 +578,9 @@ dumpinode(uint32_t ino, const char *name)
 	}
 
 	if (doindirect) {
-		dumpindirect(SWAP32(sfi.sfi_indirect));
+		dumpindirect(SWAP32(sfi.sfi_indirect), 1);
+		dumpindirect(SWAP32(sfi.sfi_dindirect), 2);
+		dumpindirect(SWAP32(sfi.sfi_tindirect), 3);
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {
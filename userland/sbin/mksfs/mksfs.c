@@ -58,7 +58,7 @@
 #include "disk.h"
 
 /* Maximum size of freemap we support */
-#define MAXFREEMAPBLOCKS 32
+#define MAXFREEMAPBLOCKS 256
 
 /* Free block bitmap */
 static char freemapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
@@ -125,7 +125,7 @@ initfreemap(uint32_t fsblocks)
  */
 static
 void
-writesuper(const char *volname, uint32_t nblocks)
+writesuper(const char *volname, uint32_t nblocks, uint32_t flags)
 {
 	struct sfs_superblock sb;
 
@@ -140,6 +140,7 @@ writesuper(const char *volname, uint32_t nblocks)
 	sb.sb_magic = SWAP32(SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
 	strcpy(sb.sb_volname, volname);
+	sb.sb_flags = SWAP32(flags);
 
 	/* and write it out. */
 	diskwrite(&sb, SFS_SUPER_BLOCK);
@@ -169,7 +170,7 @@ writefreemap(uint32_t fsblocks)
  */
 static
 void
-writerootdir(void)
+writerootdir(uint32_t flags)
 {
 	struct sfs_dinode sfi;
 
@@ -178,6 +179,9 @@ writerootdir(void)
 	sfi.sfi_size = SWAP32(0);
 	sfi.sfi_type = SWAP16(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAP16(1);
+	if (flags & SFS_SBF_EXTENTS) {
+		sfi.sfi_flags = SWAP32(SFS_IF_EXTENTS);
+	}
 
 	/* Write it out */
 	diskwrite(&sfi, SFS_ROOTDIR_INO);
@@ -189,15 +193,23 @@ writerootdir(void)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, blocksize, flags;
 	char *volname, *s;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	/* -e: make files with extents rather than block pointers */
+	flags = 0;
+	if (argc==4 && !strcmp(argv[1], "-e")) {
+		flags |= SFS_SBF_EXTENTS;
+		argc--;
+		argv++;
+	}
+
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-e] device/diskfile volume-name");
 	}
 
 	check();
@@ -230,9 +242,9 @@ main(int argc, char **argv)
 
 	/* Write out the on-disk structures */
 	initfreemap(size);
-	writesuper(volname, size);
+	writesuper(volname, size, flags);
 	writefreemap(size);
-	writerootdir();
+	writerootdir(flags);
 
 	closedisk();
 
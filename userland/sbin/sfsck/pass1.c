@@ -172,6 +172,151 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	}
 }
 
+/*
+ * Check the extent table of inode INO, which has SFS_IF_EXTENTS set
+ * and has already been loaded into SFI. Extents that are empty,
+ * out of order, overlapping, or off the end of the volume are
+ * dropped; blocks past EOF are freed. ISDIR is a shortcut telling us
+ * if the inode is a directory.
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+check_inode_extents(uint32_t ino, struct sfs_dinode *sfi, int isdir)
+{
+	struct sfs_extent ext;
+	uint32_t fileblocks, volblocks, lastend, keep, b;
+	unsigned pasteofcount, i, j;
+	blockusage_t usagetype;
+	int changed = 0;
+
+	fileblocks = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE) / SFS_BLOCKSIZE;
+	volblocks = sb_totalblocks();
+	usagetype = isdir ? B_DIRDATA : B_DATA;
+	pasteofcount = 0;
+
+	/* The block pointers aren't used. */
+	for (i=0; i<NUM_D; i++) {
+		if (GET_D(sfi, i) != 0) {
+			SET_D(sfi, i) = 0;
+			changed = 1;
+		}
+	}
+	for (i=0; i<NUM_I; i++) {
+		if (GET_I(sfi, i) != 0) {
+			SET_I(sfi, i) = 0;
+			changed = 1;
+		}
+	}
+	for (i=0; i<NUM_II; i++) {
+		if (GET_II(sfi, i) != 0) {
+			SET_II(sfi, i) = 0;
+			changed = 1;
+		}
+	}
+	for (i=0; i<NUM_III; i++) {
+		if (GET_III(sfi, i) != 0) {
+			SET_III(sfi, i) = 0;
+			changed = 1;
+		}
+	}
+	if (changed) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: block pointers set in extent inode (cleared)",
+		      (unsigned long) ino);
+	}
+
+	if (sfi->sfi_nextents > SFS_NEXTENTS) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: extent count %lu too large (truncated)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_nextents);
+		sfi->sfi_nextents = SFS_NEXTENTS;
+		changed = 1;
+	}
+
+	/* The unused part of the table must be zero. */
+	j = sfi->sfi_nextents;
+	if (checkzeroed(&sfi->sfi_extents[j],
+			(SFS_NEXTENTS - j) * sizeof(sfi->sfi_extents[0]))) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: unused extents not zeroed (fixed)",
+		      (unsigned long) ino);
+		changed = 1;
+	}
+
+	lastend = 0;
+	for (i=j=0; i<sfi->sfi_nextents; i++) {
+		ext = sfi->sfi_extents[i];
+		if (ext.sfe_len == 0) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: extent %u is empty (dropped)",
+			      (unsigned long) ino, i);
+			changed = 1;
+			continue;
+		}
+		if (ext.sfe_fileblock < lastend ||
+		    ext.sfe_fileblock + ext.sfe_len < ext.sfe_fileblock) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: extent %u overlaps the one before "
+			      "(dropped)", (unsigned long) ino, i);
+			changed = 1;
+			continue;
+		}
+		if (ext.sfe_block == 0 || ext.sfe_block >= volblocks ||
+		    ext.sfe_len > volblocks - ext.sfe_block) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: extent %u (blocks %lu-%lu) outside "
+			      "of volume (dropped)", (unsigned long) ino, i,
+			      (unsigned long) ext.sfe_block,
+			      (unsigned long) ext.sfe_block + ext.sfe_len - 1);
+			changed = 1;
+			continue;
+		}
+
+		/* Free whatever is past EOF */
+		if (ext.sfe_fileblock >= fileblocks) {
+			keep = 0;
+		}
+		else if (ext.sfe_len > fileblocks - ext.sfe_fileblock) {
+			keep = fileblocks - ext.sfe_fileblock;
+		}
+		else {
+			keep = ext.sfe_len;
+		}
+		for (b=keep; b<ext.sfe_len; b++) {
+			freemap_blockfree(ext.sfe_block + b);
+			pasteofcount++;
+		}
+		if (keep < ext.sfe_len) {
+			setbadness(EXIT_RECOV);
+			changed = 1;
+			ext.sfe_len = keep;
+			if (keep == 0) {
+				continue;
+			}
+		}
+
+		for (b=0; b<ext.sfe_len; b++) {
+			freemap_blockinuse(ext.sfe_block + b, usagetype, ino);
+		}
+		lastend = ext.sfe_fileblock + ext.sfe_len;
+		sfi->sfi_extents[j++] = ext;
+	}
+	sfi->sfi_nextents = j;
+	memset(&sfi->sfi_extents[j], 0,
+	       (SFS_NEXTENTS - j) * sizeof(sfi->sfi_extents[0]));
+
+	if (pasteofcount > 0) {
+		warnx("Inode %lu: %u blocks after EOF (freed)",
+		     (unsigned long) ino, pasteofcount);
+		setbadness(EXIT_RECOV);
+	}
+
+	return changed;
+}
+
 /*
  * Check the blocks belonging to inode INO, whose inode has already
  * been loaded into SFI. ISDIR is a shortcut telling us if the inode
@@ -189,6 +334,10 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	int changed;
 	int i;
 
+	if (sfi->sfi_flags & SFS_IF_EXTENTS) {
+		return check_inode_extents(ino, sfi, isdir);
+	}
+
 	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
 
 	ibs.ino = ino;
@@ -270,6 +419,26 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 
 	freemap_blockinuse(ino, B_INODE, ino);
 
+	if (sfi->sfi_flags & ~SFS_IF_EXTENTS) {
+		warnx("Inode %lu: unknown flags 0x%lx (cleared)",
+		      (unsigned long) ino,
+		      (unsigned long) (sfi->sfi_flags & ~SFS_IF_EXTENTS));
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= SFS_IF_EXTENTS;
+		changed = 1;
+	}
+
+	if (!(sfi->sfi_flags & SFS_IF_EXTENTS) &&
+	    (sfi->sfi_nextents != 0 ||
+	     checkzeroed(sfi->sfi_extents, sizeof(sfi->sfi_extents)))) {
+		warnx("Inode %lu: extent table in use without extent flag "
+		      "(cleared)", (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_nextents = 0;
+		memset(sfi->sfi_extents, 0, sizeof(sfi->sfi_extents));
+		changed = 1;
+	}
+
 	if (checkzeroed(sfi->sfi_waste, sizeof(sfi->sfi_waste))) {
 		warnx("Inode %lu: sfi_waste section not zeroed (fixed)",
 		      (unsigned long) ino);
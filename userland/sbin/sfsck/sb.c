@@ -83,6 +83,13 @@ sb_check(void)
 		setbadness(EXIT_RECOV);
 		schanged = 1;
 	}
+	if (sb.sb_flags & ~SFS_SBF_EXTENTS) {
+		warnx("Unknown superblock flags 0x%lx (cleared)",
+		      (unsigned long) (sb.sb_flags & ~SFS_SBF_EXTENTS));
+		setbadness(EXIT_RECOV);
+		sb.sb_flags &= SFS_SBF_EXTENTS;
+		schanged = 1;
+	}
 	if (checkzeroed(sb.reserved, sizeof(sb.reserved))) {
 		warnx("Reserved section of superblock not zeroed (fixed)");
 		setbadness(EXIT_RECOV);
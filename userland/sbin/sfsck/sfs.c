@@ -62,6 +62,7 @@ swapsb(struct sfs_superblock *sb)
 {
 	sb->sb_magic = SWAP32(sb->sb_magic);
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
+	sb->sb_flags = SWAP32(sb->sb_flags);
 }
 
 static
@@ -97,6 +98,17 @@ swapinode(struct sfs_dinode *sfi)
 	for (i=0; i<NUM_III; i++) {
 		SET_III(sfi, i) = SWAP32(GET_III(sfi, i));
 	}
+
+	sfi->sfi_flags = SWAP32(sfi->sfi_flags);
+	sfi->sfi_nextents = SWAP32(sfi->sfi_nextents);
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		sfi->sfi_extents[i].sfe_fileblock =
+			SWAP32(sfi->sfi_extents[i].sfe_fileblock);
+		sfi->sfi_extents[i].sfe_block =
+			SWAP32(sfi->sfi_extents[i].sfe_block);
+		sfi->sfi_extents[i].sfe_len =
+			SWAP32(sfi->sfi_extents[i].sfe_len);
+	}
 }
 
 static
@@ -161,7 +173,20 @@ static
 uint32_t
 bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 {
-	uint32_t iblock, offset;
+	const struct sfs_extent *ext;
+	uint32_t iblock, offset, i;
+
+	if (sfi->sfi_flags & SFS_IF_EXTENTS) {
+		for (i=0; i<sfi->sfi_nextents && i<SFS_NEXTENTS; i++) {
+			ext = &sfi->sfi_extents[i];
+			if (fileblock >= ext->sfe_fileblock &&
+			    fileblock - ext->sfe_fileblock < ext->sfe_len) {
+				return ext->sfe_block +
+					(fileblock - ext->sfe_fileblock);
+			}
+		}
+		return 0;
+	}
 
 	if (fileblock < INOMAX_D) {
 		return GET_D(sfi, fileblock);